@@ -0,0 +1,36 @@
+#
+# Embed the shaders into the binary
+#
+# Run with cmake -P. Writes OUTPUT, a header with one EmbeddedShader per
+# SHADER_DIR/NAME.vert and its NAME.frag, as raw string literals.
+#
+
+file(GLOB VERTEX_SHADERS ${SHADER_DIR}/*.vert)
+list(SORT VERTEX_SHADERS)
+
+set(SHADERS "")
+foreach(VERTEX_SHADER ${VERTEX_SHADERS})
+	get_filename_component(NAME ${VERTEX_SHADER} NAME_WE)
+	file(READ ${VERTEX_SHADER} VERTEX_SOURCE)
+	file(READ ${SHADER_DIR}/${NAME}.frag FRAGMENT_SOURCE)
+	set(SHADERS "${SHADERS}\t{ \"${NAME}\",\nR\"glsl(${VERTEX_SOURCE})glsl\",\nR\"glsl(${FRAGMENT_SOURCE})glsl\" },\n")
+endforeach()
+
+set(HEADER "// generated from ${SHADER_DIR} by cmake/EmbedShaders.cmake, don't edit\n
+struct EmbeddedShader {
+	const char* name;
+	const char* vertex;
+	const char* fragment;
+};
+
+static const EmbeddedShader EMBEDDED_SHADERS[] = {
+${SHADERS}};
+")
+
+# only touched when it changes, so nothing rebuilds needlessly
+if (EXISTS ${OUTPUT})
+	file(READ ${OUTPUT} EXISTING)
+endif()
+if (NOT "${EXISTING}" STREQUAL "${HEADER}")
+	file(WRITE ${OUTPUT} "${HEADER}")
+endif()
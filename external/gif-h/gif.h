@@ -55,6 +55,14 @@
 #define GIF_FREE free
 #endif
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GIF_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define GIF_SSE2
+#endif
+
 const int kGifTransIndex = 0;
 
 struct GifPalette
@@ -72,6 +80,22 @@ struct GifPalette
     uint8_t treeSplit[255];
 };
 
+// Remembers palette lookups, so each distinct color in a frame only walks the k-d tree once.
+// Direct-mapped on a hash of the color: each entry holds the full RGB and the palette index,
+// so a hit gives exactly what the tree search would. Index 0 (transparency) is never a search
+// result and marks an empty entry. Must be cleared whenever the palette changes.
+const int kGifColorCacheBits = 15;
+
+struct GifColorCache
+{
+    uint32_t entries[1 << kGifColorCacheBits];  // rgb << 8 | palette index
+};
+
+void GifClearColorCache(GifColorCache* pCache)
+{
+    memset(pCache->entries, 0, sizeof(pCache->entries));
+}
+
 // max, min, and abs functions
 int GifIMax(int l, int r) { return l>r?l:r; }
 int GifIMin(int l, int r) { return l<r?l:r; }
@@ -129,6 +153,34 @@ void GifGetClosestPaletteColor(GifPalette* pPal, int r, int g, int b, int& bestI
     }
 }
 
+// GifGetClosestPaletteColor() for one color, through the cache if there is one.
+// Returns the palette index and its error in bestDiff.
+int GifLookupPaletteColor(GifPalette* pPal, GifColorCache* pCache, int r, int g, int b, int& bestDiff)
+{
+    int bestInd = 1;
+    bestDiff = 1000000;
+
+    // dithering can push components past 255; those aren't cached
+    if(!pCache || ((r | g | b) & ~0xff))
+    {
+        GifGetClosestPaletteColor(pPal, r, g, b, bestInd, bestDiff);
+        return bestInd;
+    }
+
+    uint32_t rgb = (uint32_t)(r << 16 | g << 8 | b);
+    uint32_t& entry = pCache->entries[(rgb * 2654435761u) >> (32 - kGifColorCacheBits)];
+    if((entry >> 8) == rgb && (entry & 0xff) != kGifTransIndex)
+    {
+        bestInd = (int)(entry & 0xff);
+        bestDiff = GifIAbs(r - pPal->r[bestInd]) + GifIAbs(g - pPal->g[bestInd]) + GifIAbs(b - pPal->b[bestInd]);
+        return bestInd;
+    }
+
+    GifGetClosestPaletteColor(pPal, r, g, b, bestInd, bestDiff);
+    entry = rgb << 8 | (uint32_t)bestInd;
+    return bestInd;
+}
+
 void GifSwapPixels(uint8_t* image, int pixA, int pixB)
 {
     uint8_t rA = image[pixA*4];
@@ -375,7 +427,7 @@ void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_
 }
 
 // Implements Floyd-Steinberg dithering, writes palette value to alpha
-void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifColorCache* pCache = NULL )
 {
     int numPixels = (int)(width * height);
 
@@ -417,11 +469,9 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
                 continue;
             }
 
-            int32_t bestDiff = 1000000;
-            int32_t bestInd = kGifTransIndex;
-
             // Search the palete
-            GifGetClosestPaletteColor(pPal, rr, gg, bb, bestInd, bestDiff);
+            int32_t bestDiff;
+            int32_t bestInd = GifLookupPaletteColor(pPal, pCache, rr, gg, bb, bestDiff);
 
             // Write the result to the temp buffer
             int32_t r_err = nextPix[0] - int32_t(pPal->r[bestInd]) * 256;
@@ -483,12 +533,46 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
     GIF_TEMP_FREE(quantPixels);
 }
 
-// Picks palette colors for the image using simple thresholding, no dithering
-void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+// Picks palette colors for the image using simple thresholding, no dithering.
+// Returns the mean error (sum of absolute channel differences) of the palettized pixels,
+// which tells how well a palette reused from an earlier frame still fits.
+float GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifColorCache* pCache = NULL )
 {
     uint32_t numPixels = width*height;
-    for( uint32_t ii=0; ii<numPixels; ++ii )
+    uint64_t totalDiff = 0;
+    uint32_t numPalettized = 0;
+
+    for( uint32_t ii=0; ii<numPixels; )
     {
+        // runs of pixels unchanged from the previous frame, several at a time: they become transparent
+        if(lastFrame)
+        {
+#if defined(GIF_NEON)
+            const uint32x4_t rgbMask = vdupq_n_u32(0x00ffffff);
+            while( ii+4 <= numPixels )
+            {
+                uint32x4_t last = vandq_u32(vreinterpretq_u32_u8(vld1q_u8(lastFrame)), rgbMask);
+                uint32x4_t next = vandq_u32(vreinterpretq_u32_u8(vld1q_u8(nextFrame)), rgbMask);
+                uint32x4_t same = vceqq_u32(last, next);
+                uint32x2_t folded = vand_u32(vget_low_u32(same), vget_high_u32(same));
+                if( (vget_lane_u32(folded, 0) & vget_lane_u32(folded, 1)) == 0 ) break;
+                vst1q_u8(outFrame, vreinterpretq_u8_u32(last));
+                ii += 4; lastFrame += 16; nextFrame += 16; outFrame += 16;
+            }
+#elif defined(GIF_SSE2)
+            const __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+            while( ii+4 <= numPixels )
+            {
+                __m128i last = _mm_and_si128(_mm_loadu_si128((const __m128i*)lastFrame), rgbMask);
+                __m128i next = _mm_and_si128(_mm_loadu_si128((const __m128i*)nextFrame), rgbMask);
+                if( _mm_movemask_epi8(_mm_cmpeq_epi32(last, next)) != 0xffff ) break;
+                _mm_storeu_si128((__m128i*)outFrame, last);
+                ii += 4; lastFrame += 16; nextFrame += 16; outFrame += 16;
+            }
+#endif
+            if( ii == numPixels ) break;
+        }
+
         // if a previous color is available, and it matches the current color,
         // set the pixel to transparent
         if(lastFrame &&
@@ -504,9 +588,10 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
         else
         {
             // palettize the pixel
-            int32_t bestDiff = 1000000;
-            int32_t bestInd = 1;
-            GifGetClosestPaletteColor(pPal, nextFrame[0], nextFrame[1], nextFrame[2], bestInd, bestDiff);
+            int32_t bestDiff;
+            int32_t bestInd = GifLookupPaletteColor(pPal, pCache, nextFrame[0], nextFrame[1], nextFrame[2], bestDiff);
+            totalDiff += (uint64_t)bestDiff;
+            ++numPalettized;
 
             // Write the resulting color to the output buffer
             outFrame[0] = pPal->r[bestInd];
@@ -518,55 +603,40 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
         if(lastFrame) lastFrame += 4;
         outFrame += 4;
         nextFrame += 4;
+        ++ii;
     }
+
+    return numPalettized ? (float)totalDiff / (float)numPalettized : 0.0f;
 }
 
-// Simple structure to write out the LZW-compressed portion of the image
-// one bit at a time
+// Simple structure to write out the LZW-compressed portion of the image.
+// Codes are collected in a bit accumulator and moved out a byte at a time
 struct GifBitStatus
 {
-    uint8_t bitIndex;  // how many bits in the partial byte written so far
-    uint8_t byte;      // current partial byte
+    uint32_t bits;      // bits not yet moved to the chunk, lowest first
+    uint32_t bitCount;  // how many
 
     uint32_t chunkIndex;
     uint8_t chunk[256];   // bytes are written in here until we have 256 of them, then written to the file
 };
 
-// insert a single bit
-void GifWriteBit( GifBitStatus& stat, uint32_t bit )
-{
-    bit = bit & 1;
-    bit = bit << stat.bitIndex;
-    stat.byte |= bit;
-
-    ++stat.bitIndex;
-    if( stat.bitIndex > 7 )
-    {
-        // move the newly-finished byte to the chunk buffer
-        stat.chunk[stat.chunkIndex++] = stat.byte;
-        // and start a new byte
-        stat.bitIndex = 0;
-        stat.byte = 0;
-    }
-}
-
 // write all bytes so far to the file
 void GifWriteChunk( FILE* f, GifBitStatus& stat )
 {
     fputc((int)stat.chunkIndex, f);
     fwrite(stat.chunk, 1, stat.chunkIndex, f);
 
-    stat.bitIndex = 0;
-    stat.byte = 0;
     stat.chunkIndex = 0;
 }
 
-void GifWriteCode( FILE* f, GifBitStatus& stat, uint32_t code, uint32_t length )
+// move the finished bytes of the accumulator to the chunk, or all of them with a zero padded last byte
+void GifFlushBits( FILE* f, GifBitStatus& stat, bool partial )
 {
-    for( uint32_t ii=0; ii<length; ++ii )
+    while( stat.bitCount >= 8 || (partial && stat.bitCount > 0) )
     {
-        GifWriteBit(stat, code);
-        code = code >> 1;
+        stat.chunk[stat.chunkIndex++] = (uint8_t)(stat.bits & 0xff);
+        stat.bits >>= 8;
+        stat.bitCount = stat.bitCount > 8 ? stat.bitCount - 8 : 0;
 
         if( stat.chunkIndex == 255 )
         {
@@ -575,6 +645,14 @@ void GifWriteCode( FILE* f, GifBitStatus& stat, uint32_t code, uint32_t length )
     }
 }
 
+// codes are at most 12 bits, so they always fit next to the fewer than 8 bits left over
+void GifWriteCode( FILE* f, GifBitStatus& stat, uint32_t code, uint32_t length )
+{
+    stat.bits |= code << stat.bitCount;
+    stat.bitCount += length;
+    GifFlushBits(f, stat, false);
+}
+
 // The LZW dictionary is a 256-ary tree constructed as the file is encoded,
 // this is one node
 struct GifLzwNode
@@ -639,14 +717,15 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
 
     GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*4096);
 
-    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+    // only the nodes of single values to begin with; the others are cleared as their codes are assigned
+    memset(codetree, 0, sizeof(GifLzwNode)*clearCode);
     int32_t curCode = -1;
     uint32_t codeSize = (uint32_t)minCodeSize + 1;
     uint32_t maxCode = clearCode+1;
 
     GifBitStatus stat;
-    stat.byte = 0;
-    stat.bitIndex = 0;
+    stat.bits = 0;
+    stat.bitCount = 0;
     stat.chunkIndex = 0;
 
     GifWriteCode(f, stat, clearCode, codeSize);  // start with a fresh LZW dictionary
@@ -678,6 +757,7 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
 
                 // insert the new run into the dictionary
                 codetree[curCode].m_next[nextValue] = (uint16_t)++maxCode;
+                memset(&codetree[maxCode], 0, sizeof(GifLzwNode));
 
                 if( maxCode >= (1ul << codeSize) )
                 {
@@ -690,7 +770,7 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
                     // the dictionary is full, clear it out and begin anew
                     GifWriteCode(f, stat, clearCode, codeSize); // clear tree
 
-                    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+                    memset(codetree, 0, sizeof(GifLzwNode)*clearCode);
                     codeSize = (uint32_t)(minCodeSize + 1);
                     maxCode = clearCode+1;
                 }
@@ -706,7 +786,7 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
     GifWriteCode(f, stat, clearCode + 1, (uint32_t)minCodeSize + 1);
 
     // write out the last partial chunk
-    while( stat.bitIndex ) GifWriteBit(stat, 0);
+    GifFlushBits(f, stat, true);
     if( stat.chunkIndex ) GifWriteChunk(f, stat);
 
     fputc(0, f); // image block terminator
@@ -718,6 +798,7 @@ struct GifWriter
 {
     FILE* f;
     uint8_t* oldImage;
+    GifColorCache* colorCache;
     bool firstFrame;
 };
 
@@ -739,6 +820,7 @@ bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t
 
     // allocate
     writer->oldImage = (uint8_t*)GIF_MALLOC(width*height*4);
+    writer->colorCache = (GifColorCache*)GIF_MALLOC(sizeof(GifColorCache));
 
     fputs("GIF89a", writer->f);
 
@@ -794,11 +876,12 @@ bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uin
 
     GifPalette pal;
     GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, dither, &pal);
+    GifClearColorCache(writer->colorCache);
 
     if(dither)
-        GifDitherImage(oldImage, image, writer->oldImage, width, height, &pal);
+        GifDitherImage(oldImage, image, writer->oldImage, width, height, &pal, writer->colorCache);
     else
-        GifThresholdImage(oldImage, image, writer->oldImage, width, height, &pal);
+        GifThresholdImage(oldImage, image, writer->oldImage, width, height, &pal, writer->colorCache);
 
     GifWriteLzwImage(writer->f, writer->oldImage, 0, 0, width, height, delay, &pal);
 
@@ -814,10 +897,12 @@ bool GifEnd( GifWriter* writer )
 
     fputc(0x3b, writer->f); // end of file
     fclose(writer->f);
+    GIF_FREE(writer->colorCache);
     GIF_FREE(writer->oldImage);
 
     writer->f = NULL;
     writer->oldImage = NULL;
+    writer->colorCache = NULL;
 
     return true;
 }
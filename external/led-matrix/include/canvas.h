@@ -41,6 +41,24 @@ public:
   virtual void SetPixel(int x, int y,
                         uint8_t red, uint8_t green, uint8_t blue) = 0;
 
+  // Set a whole rectangle of pixels at once, with its top left corner at
+  // (x,y). The source is "width" x "height" pixels of 32bpp image data in
+  // R, G, B, A byte order; "stride" is the distance in bytes from one row
+  // to the next. The alpha byte is ignored. Pixels outside the canvas are
+  // clipped.
+  //
+  // This default implementation simply calls SetPixel() for each pixel;
+  // canvases that can do better, such as the FrameCanvas, override it.
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgba, int stride) {
+    for (int row = 0; row < height; ++row) {
+      const uint8_t *pixel = rgba + row * stride;
+      for (int col = 0; col < width; ++col, pixel += 4) {
+        SetPixel(x + col, y + row, pixel[0], pixel[1], pixel[2]);
+      }
+    }
+  }
+
   // Clear screen to be all black.
   virtual void Clear() = 0;
 
@@ -6,7 +6,10 @@
 // the Pi to avoid stuttering or brightness glitches.
 //
 // The disadvantage is, that this represents the full expanded internal
-// representation of a frame, so is very large memory wise.
+// representation of a frame, so is very large memory wise. The compressed
+// format (version 2) stores most frames as run-length encoded difference to
+// the previous one and has an index to seek; it is played back from a memory
+// mapping without system calls.
 //
 // These abstractions are used in util/led-image-viewer.cc to read and
 // write such animations to disk. It is also used in util/video-viewer.cc
@@ -15,6 +18,7 @@
 #include <stdlib.h>
 
 #include <string>
+#include <vector>
 
 namespace rgb_matrix {
 class FrameCanvas;
@@ -33,6 +37,11 @@ public:
   // Write bytes from buffer. Similar to Posix behavior that allows short
   // writes.
   virtual ssize_t Append(const void *buf, size_t count) = 0;
+
+  // If the whole stream can be accessed in memory, return a pointer to it
+  // and its length in "len". Otherwise NULL. Valid until the next Append()
+  // or Map().
+  virtual const char *Map(size_t * /*len*/) { return NULL; }
 };
 
 class FileStreamIO : public StreamIO {
@@ -43,9 +52,14 @@ public:
   virtual void Rewind();
   virtual ssize_t Read(void *buf, size_t count);
   virtual ssize_t Append(const void *buf, size_t count);
+  virtual const char *Map(size_t *len);
 
 private:
+  void Unmap();
+
   const int fd_;
+  void *map_;
+  size_t map_len_;
 };
 
 class MemStreamIO : public StreamIO {
@@ -53,6 +67,7 @@ public:
   virtual void Rewind();
   virtual ssize_t Read(void *buf, size_t count);
   virtual ssize_t Append(const void *buf, size_t count);
+  virtual const char *Map(size_t *len);
 
 private:
   std::string buffer_;  // super simplistic.
@@ -62,17 +77,31 @@ private:
 class StreamWriter {
 public:
   // Does not take ownership of StreamIO
-  StreamWriter(StreamIO *io);
+  // If "compress" is set, writes the compressed format, which can only be
+  // read back from a StreamIO that supports Map().
+  StreamWriter(StreamIO *io, bool compress = false);
+  ~StreamWriter();
 
   // Stream out given canvas at the given time. "hold_time_us" indicates
   // for how long this frame is to be shown in microseconds.
   bool Stream(const FrameCanvas &frame, uint32_t hold_time_us);
 
+  // Write the frame index of a compressed stream; no frames can be added
+  // after that. Called by the destructor if not done before.
+  bool Finish();
+
 private:
   void WriteFileHeader(const FrameCanvas &frame, size_t len);
+  bool Append(const void *buf, size_t count);
 
   StreamIO *const io_;
+  const bool compress_;
   bool header_written_;
+  bool finished_;
+  uint64_t offset_;                 // Bytes written so far.
+  std::vector<uint64_t> index_;     // Offset of each frame.
+  std::vector<uint32_t> previous_;  // Previous frame, to encode differences.
+  std::vector<uint32_t> encoded_;
 };
 
 class StreamReader {
@@ -88,18 +117,38 @@ public:
   // or end of stream reached..
   bool GetNext(FrameCanvas *frame, uint32_t* hold_time_us);
 
+  // Number of frames in the stream, and positioning on one of them so that
+  // the next GetNext() returns it. Only for streams that can be mapped;
+  // FrameCount() returns 0 and Seek() fails otherwise.
+  size_t FrameCount();
+  bool Seek(size_t frame_number);
+
 private:
   enum State {
     STREAM_AT_BEGIN,
     STREAM_READING,
     STREAM_ERROR,
   };
-  bool ReadFileHeader(const FrameCanvas &frame);
+  bool ReadFileHeader();
+  void ReadIndex();
+  const char *MappedFrame(size_t frame_number) const;
+  bool GetNextMapped(FrameCanvas *frame, uint32_t* hold_time_us);
+  bool DecodeMapped(size_t frame_number);
 
   StreamIO *io_;
   size_t buf_size_;
+  int width_;
+  int height_;
   State state_;
 
   char *buffer_;
+
+  // If the stream can be mapped, frames are read from there.
+  const char *map_;
+  size_t map_len_;
+  bool compressed_;
+  std::vector<uint64_t> index_;  // Offset of each frame in the mapping.
+  size_t next_frame_;
+  size_t decoded_frame_;         // Frame in buffer_, for differences.
 };
 }
@@ -76,6 +76,33 @@ private:
   List list_;
 };
 
+// Flattens another transformer, e.g. a LinkedTransformer stack, into one
+// lookup table. The first Transform() onto an output of a given size learns
+// where each pixel of the transformed canvas lands; after that, SetPixel()
+// is one table lookup and one call on the output, however many transformers
+// there are. The wrapped transformer must not change its mapping afterwards
+// (e.g. RotateTransformer::SetAngle()); call Recompile() if it does.
+//
+// On an RGBMatrix, RGBMatrix::ApplyStaticTransformer() goes one step further
+// and compiles the mapping into the matrix itself.
+class CompiledTransformer : public CanvasTransformer {
+public:
+  // The ownership of "transformer" is _not_ taken over.
+  CompiledTransformer(CanvasTransformer *transformer);
+  virtual ~CompiledTransformer();
+
+  // Learn the mapping again with the next Transform().
+  void Recompile();
+
+  virtual Canvas *Transform(Canvas *output);
+
+private:
+  class TransformCanvas;
+
+  CanvasTransformer *const transformer_;
+  TransformCanvas *const canvas_;
+};
+
 // If we take a long chain of panels and arrange them in a U-shape, so
 // that after half the panels we bend around and continue below. This way
 // we have a panel that has double the height but only uses one chain.
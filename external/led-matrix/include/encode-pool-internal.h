@@ -0,0 +1,69 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_ENCODE_POOL_INTERNAL_H
+#define RPI_ENCODE_POOL_INTERNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <vector>
+
+#include "thread.h"
+
+namespace rgb_matrix {
+namespace internal {
+// A few threads that split the work of encoding a frame into the bitplane
+// buffer. The calling thread does part 0 of each job and worker threads do
+// the others, so a pool of "threads" uses threads - 1 workers.
+class EncodePool {
+public:
+  class Job {
+  public:
+    virtual ~Job() {}
+    // Do part "part" of parts 0 .. threads() - 1. Parts run concurrently, so
+    // they must not write the same memory.
+    virtual void RunPart(int part) = 0;
+  };
+
+  // The workers are kept to the CPUs in "cpu_affinity_mask", e.g. away from
+  // the refresh thread's core.
+  EncodePool(int threads, uint32_t cpu_affinity_mask);
+  ~EncodePool();
+
+  int threads() const { return workers_.size() + 1; }
+
+  // Run all parts of "job" and return once they are done. Jobs from several
+  // threads are run one after the other.
+  void Run(Job *job);
+
+private:
+  class Worker;
+
+  std::vector<Worker*> workers_;
+  Mutex run_sync_;         // One job at a time.
+
+  Mutex state_sync_;       // Guards everything below.
+  pthread_cond_t job_start_;
+  pthread_cond_t job_done_;
+  Job *job_;
+  unsigned generation_;    // Incremented for every job.
+  int pending_;            // Workers not done with the current job.
+  bool running_;
+};
+
+}  // namespace internal
+}  // namespace rgb_matrix
+
+#endif  // RPI_ENCODE_POOL_INTERNAL_H
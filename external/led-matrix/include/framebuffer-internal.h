@@ -18,23 +18,30 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "hardware-mapping.h"
 
 namespace rgb_matrix {
 class GPIO;
 class PinPulser;
 namespace internal {
+class EncodePool;
 class RowAddressSetter;
 
 // An opaque type used within the framebuffer that can be used
 // to copy between PixelMappers.
 struct PixelDesignator {
-  PixelDesignator() : gpio_word(-1), r_bit(0), g_bit(0), b_bit(0), mask(~0){}
+  PixelDesignator() : gpio_word(-1), r_bit(0), g_bit(0), b_bit(0), mask(~0),
+                      panel(0) {}
   int gpio_word;
   uint32_t r_bit;
   uint32_t g_bit;
   uint32_t b_bit;
   uint32_t mask;
+  int panel;  // Physical panel, for its color calibration.
 };
 
 class PixelDesignatorMap {
@@ -52,11 +59,64 @@ public:
   // All bits that set red/green/blue pixels; used for Fill().
   const PixelDesignator &GetFillColorBits() { return fill_bits_; }
 
+  // The same designators as get() returns, but as structure-of-arrays in
+  // row-major order, so that the bulk Framebuffer::SetPixels() can load them
+  // four at a time. Built on first use, so the designators must not be
+  // modified through get() after that.
+  struct DesignatorArrays {
+    int *gpio_word;
+    uint32_t *r_bit;
+    uint32_t *g_bit;
+    uint32_t *b_bit;
+    uint32_t *mask;
+    int *panel;
+  };
+  const DesignatorArrays &GetDesignatorArrays();
+
+  // The pixels split into "parts" by the double row their gpio word is in:
+  // part p gets the runs of pixels (row-major index and length, never
+  // crossing a row) in the p-th of "parts" equal ranges of double rows. No
+  // two parts share a gpio word, so they can be encoded concurrently. Built
+  // on first use, like GetDesignatorArrays().
+  struct Run {
+    int index;
+    int length;
+  };
+  typedef std::vector<std::vector<Run> > Partition;
+  const Partition &GetPartition(int parts, int words_per_double_row,
+                                int double_rows);
+
+  // The designators in the order their gpio words are laid out in the
+  // bitplane buffer: by double row, then by the color bits they set (which
+  // chain and which half of the panel), then by gpio word. Encoding in this
+  // order writes the bitplanes front to back, mostly four consecutive words
+  // at a time, however the mappers scattered them in visible order. Unused
+  // pixels are left out. Built on first use, like GetDesignatorArrays().
+  struct OutputOrder {
+    DesignatorArrays designators;  // Permuted; views of the vectors below.
+    std::vector<int> x, y;         // Visible position of each designator.
+    // Where the p-th of "parts" equal ranges of double rows starts;
+    // part_start[parts] is the number of designators.
+    std::vector<int> part_start;
+    // Visible order would write the bitplanes out of order (e.g. behind a
+    // rotating or U-folding mapper), so this order is worth using.
+    bool scattered;
+
+    std::vector<int> gpio_word;
+    std::vector<uint32_t> r_bit, g_bit, b_bit, mask;
+    std::vector<int> panel;
+  };
+  const OutputOrder &GetOutputOrder(int parts, int words_per_double_row,
+                                    int double_rows);
+
 private:
   const int width_;
   const int height_;
   const PixelDesignator fill_bits_;  // Precalculated for fill.
   PixelDesignator *const buffer_;
+  DesignatorArrays arrays_;
+  Partition partition_;
+  OutputOrder output_order_;
 };
 
 // Internal representation of the frame-buffer that as well can
@@ -65,19 +125,37 @@ private:
 // written out.
 class Framebuffer {
 public:
+  // "panel_columns" is the width of one panel in the chain, so that pixels
+  // know which panel's color calibration applies; 0 means the whole chain.
   Framebuffer(int rows, int columns, int parallel,
               int scan_mode,
               const char* led_sequence, bool inverse_color,
-              PixelDesignatorMap **mapper);
+              PixelDesignatorMap **mapper, int panel_columns = 0);
   ~Framebuffer();
 
   // Initialize GPIO bits for output. Only call once.
+  //
+  // The output enable pulses are prepared for every combination of LSB time
+  // (pwm_lsb_nanoseconds, halved as long as it stays at or above
+  // "min_pwm_lsb_nanoseconds") and dither bits ("dither_bits" up to
+  // "max_dither_bits"), so that they can be switched per refresh; see
+  // PulseProfile(). The defaults prepare only the configured ones.
   static void InitHardwareMapping(const char *named_hardware);
   static void InitGPIO(GPIO *io, int rows, int parallel,
                        bool allow_hardware_pulsing,
                        int pwm_lsb_nanoseconds,
                        int dither_bits,
-                       int row_address_type);
+                       int row_address_type,
+                       int min_pwm_lsb_nanoseconds = 0,
+                       int max_dither_bits = 0);
+
+  // Number of LSB times prepared by InitGPIO().
+  static int lsb_levels();
+
+  // Pulse profile for DumpToMatrix() with LSB time pwm_lsb_nanoseconds >>
+  // "lsb_step" and the given dither bits, both within what InitGPIO()
+  // prepared. 0 is the configured LSB time and dither.
+  static int PulseProfile(int lsb_step, int dither_bits);
 
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
@@ -86,17 +164,40 @@ public:
   uint8_t pwmbits() { return pwm_bits_; }
 
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
+  void set_luminance_correct(bool on);
   bool luminance_correct() const { return do_luminance_correct_; }
 
   // Set brightness in percent; range=1..100
   // This will only affect newly set pixels.
-  void SetBrightness(uint8_t b) {
-    brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
-  }
+  void SetBrightness(uint8_t b);
   uint8_t brightness() { return brightness_; }
 
-  void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
+  // White balance of one panel in percent per color (0..100), -1 for all
+  // panels. Panels are counted along the first chain from the Pi outwards,
+  // then along the next parallel chain. Only affects newly set pixels.
+  void SetWhiteBalance(int panel, uint8_t red, uint8_t green, uint8_t blue);
+  int panels() const { return panels_; }
+
+  // Per color channel, the PWM bits to show for each 8 bit value, with
+  // brightness, luminance correction, white balance and inverse colors
+  // folded in.
+  struct ColorTable {
+    uint16_t channel[3][256];
+  };
+  // Never changed once published; a rebuild publishes a new set.
+  typedef std::shared_ptr<const std::vector<ColorTable> > ColorTables;
+
+  void DumpToMatrix(GPIO *io, int pwm_low_bit, int pulse_profile = 0);
+
+  // Precompute what DumpToMatrix() writes to the GPIO if the content changed
+  // since the last time. DumpToMatrix() does this itself when needed, but
+  // calling it before handing the frame to the refresh thread keeps that
+  // work out of the refresh loop.
+  void PrepareOutput();
+
+  // Spread large SetPixels() and PrepareOutput() over the threads of "pool";
+  // NULL (the default) does all encoding on the calling thread.
+  void set_encode_pool(EncodePool *pool) { encode_pool_ = pool; }
 
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
@@ -107,6 +208,8 @@ public:
   int width() const;
   int height() const;
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *rgba, int stride);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
@@ -123,8 +226,16 @@ private:
 
   void InitDefaultDesignator(int x, int y, const char *led_sequence,
                              PixelDesignator *designator);
-  inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
-                         uint16_t *red, uint16_t *green, uint16_t *blue);
+
+  // The tables in use: one for all panels, or one per panel if their white
+  // balance differs. Hold on to the returned set for the whole encode.
+  ColorTables color_tables() const {
+    return std::atomic_load(&color_tables_);
+  }
+  void SetPixel(const std::vector<ColorTable> &tables,
+                int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  // Build the tables for the current settings and switch to them.
+  void RebuildColorTables();
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
@@ -150,7 +261,44 @@ private:
   inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
 
   PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
+
+  // Bits of all colors of all used chains, plus the clock.
+  gpio_bits_t color_clk_mask_;
+
+  // The bitplane_buffer_ as it is clocked out: per column a pair of words,
+  // the bits to clear (including the clock) followed by the bits to set.
+  // Only the bits that differ from the previous column are touched; the first
+  // column of each bitplane is written in full.
+  gpio_bits_t *output_words_;
+  inline gpio_bits_t *OutputWordsAt(int double_row, int bit);
+  // Per double row and bitplane: true if the bitplane has the same content as
+  // the one below it, so what is in the shift registers can be shown again.
+  bool *plane_repeats_;
+  // Set whenever bitplane_buffer_ changes; output_words_ are stale then.
+  std::atomic<bool> output_dirty_;
+  inline void MarkModified() {
+    output_dirty_.store(true, std::memory_order_release);
+  }
+  void BuildOutputWords(int first_double_row, int end_double_row);
+
+  EncodePool *encode_pool_;
+
+  const int panel_columns_;
+  const int panels_;
+  struct WhiteBalance {
+    uint8_t percent[3];
+  };
+  std::vector<WhiteBalance> white_balance_;  // Per panel.
+  // The tables in use, only accessed through std::atomic_load/store. An
+  // encode running during a rebuild keeps the set it started with alive
+  // until it is done; it is freed with the last reference.
+  ColorTables color_tables_;
 };
+
+// Parses a white balance as given to --led-white-balance: "<r>,<g>,<b>" in
+// percent, or several of them separated by ';', one per panel. Appends three
+// values per panel to "percents". Returns false on syntax or range errors.
+bool ParseWhiteBalance(const char *spec, std::vector<uint8_t> *percents);
 }  // namespace internal
 }  // namespace rgb_matrix
 #endif // RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
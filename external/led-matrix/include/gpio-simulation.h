@@ -0,0 +1,120 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_GPIO_SIMULATION_H
+#define RPI_GPIO_SIMULATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "gpio.h"
+
+namespace rgb_matrix {
+// Stands in for the GPIO registers and the output enable timing on machines
+// that are not a Raspberry Pi; hand it to GPIO::InitSimulation().
+//
+// It keeps the state of the pins and models what the panels do with them:
+// shift in the colors on a rising clock, latch on strobe and show the latched
+// row while output enable is pulsed.
+//
+// Time is not measured but modeled with a simulated clock: each register
+// write takes "write_nanos" (repeated by the GPIO slowdown like on the
+// hardware), each output enable pulse the time it was asked for. A pulser
+// created with hardware pulsing allowed runs the pulse in the background like
+// the PWM pulser does, while the timer based one blocks.
+class GPIOSimulation {
+public:
+  // The pins the panel model needs to know about.
+  struct Signals {
+    uint32_t clock;
+    uint32_t strobe;
+    uint32_t color;    // All color bits of all chains.
+    uint32_t address;  // Row address bits.
+  };
+
+  // A write or a pulse as recorded in the trace.
+  struct Event {
+    uint64_t nanos;  // Simulated time.
+    char op;         // 'S'et bits, 'C'lear bits or output enable 'P'ulse.
+    uint32_t bits;   // Bits written, or bitplane of the pulse.
+  };
+
+  // "columns" is the length of the shift registers, i.e. the number of
+  // columns of the chain.
+  GPIOSimulation(const Signals &signals, int columns, int write_nanos);
+
+  // Record the first "max_events" writes and pulses in trace().
+  void EnableTrace(size_t max_events);
+  const std::vector<Event> &trace() const { return trace_; }
+
+  // Counters; all of them accumulate from the start, so measure differences.
+  uint64_t nanos() const { return nanos_; }       // Simulated time.
+  uint64_t writes() const { return writes_; }     // Without slowdown repeats.
+  uint64_t clock_edges() const { return clock_edges_; }
+  uint64_t strobes() const { return strobes_; }
+  uint64_t pulses() const { return pulses_; }
+
+  // Simulated time spent on each bitplane: from its pulse being sent up to
+  // the next pulse being sent. That is the longer of the pulse itself and
+  // clocking in the next data, plus strobe and row address. Together with
+  // plane_pulses(), this gives the time per bitplane.
+  uint64_t plane_nanos(int bit) const;
+  uint64_t plane_pulses(int bit) const;
+
+  // Hash of everything that was shown: latched data, row address and which
+  // pulse length. Output that looks the same has the same hash.
+  uint32_t output_hash() const { return output_hash_; }
+
+  void SetBits(uint32_t value, int slowdown);
+  void ClearBits(uint32_t value, int slowdown);
+
+  // Used by PinPulser::Create() for a GPIO in simulation.
+  PinPulser *CreatePinPulser(GPIO *io, uint32_t gpio_mask, bool asynchronous,
+                             const std::vector<int> &nano_wait_spec);
+
+private:
+  class Pulser;
+
+  void Record(char op, uint32_t bits);
+  void StartPulse(int spec, int nanos, bool asynchronous);
+  void FinishPulse();
+
+  const Signals signals_;
+  const int write_nanos_;
+
+  uint32_t state_;
+  std::vector<uint32_t> shift_register_;  // Ring buffer, oldest at head.
+  size_t shift_head_;
+  uint32_t latched_hash_;
+  uint32_t output_hash_;
+
+  uint64_t nanos_;
+  uint64_t pulse_end_nanos_;  // Of a running asynchronous pulse.
+  uint64_t last_pulse_nanos_;  // When the previous pulse was sent,
+  int last_pulse_spec_;        // and for which bitplane.
+  uint64_t writes_;
+  uint64_t clock_edges_;
+  uint64_t strobes_;
+  uint64_t pulses_;
+  std::vector<uint64_t> plane_nanos_;
+  std::vector<uint64_t> plane_pulses_;
+
+  size_t max_trace_;
+  std::vector<Event> trace_;
+};
+}  // end namespace rgb_matrix
+
+#endif  // RPI_GPIO_SIMULATION_H
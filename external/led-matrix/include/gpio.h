@@ -23,6 +23,8 @@
 // Putting this in our namespace to not collide with other things called like
 // this.
 namespace rgb_matrix {
+class GPIOSimulation;
+
 // For now, everything is initialized as output.
 class GPIO {
  public:
@@ -41,6 +43,12 @@ class GPIO {
 #endif
             );
 
+  // Initialize without hardware: writes go to "simulation" instead of the
+  // GPIO registers, so that the output can be measured on any machine.
+  // Does not take ownership of "simulation".
+  bool InitSimulation(GPIOSimulation *simulation, int slowdown = 1);
+  GPIOSimulation *simulation() const { return simulation_; }
+
   // Initialize outputs.
   // Returns the bits that were available and could be set for output.
   // (never use the optional adafruit_hack_needed parameter, it is used
@@ -53,20 +61,14 @@ class GPIO {
 
   // Set the bits that are '1' in the output. Leave the rest untouched.
   inline void SetBits(uint32_t value) {
-    if (!value) return;
-    *gpio_set_bits_ = value;
-    for (int i = 0; i < slowdown_; ++i) {
-      *gpio_set_bits_ = value;
-    }
+    if (simulation_) { SimulateSetBits(value); return; }
+    HardwareSetBits(value);
   }
 
   // Clear the bits that are '1' in the output. Leave the rest untouched.
   inline void ClearBits(uint32_t value) {
-    if (!value) return;
-    *gpio_clr_bits_ = value;
-    for (int i = 0; i < slowdown_; ++i) {
-      *gpio_clr_bits_ = value;
-    }
+    if (simulation_) { SimulateClearBits(value); return; }
+    HardwareClearBits(value);
   }
 
   // Write all the bits of "value" mentioned in "mask". Leave the rest untouched.
@@ -78,9 +80,48 @@ class GPIO {
   }
 
   inline void Write(uint32_t value) { WriteMaskedBits(value, output_bits_); }
-  inline uint32_t Read() const { return *gpio_read_bits_ & input_bits_; }
+
+  // Clock "count" words into the shift registers. "words" are pairs of
+  // bits to clear (which includes the clock) and bits to set, after which
+  // the clock goes high again. This is the one place the whole sequence of a
+  // row goes through, so a batched writer (e.g. DMA or SMI feeding the GPIO
+  // registers) can take over here.
+  inline void ClockOutWords(const uint32_t *words, int count, uint32_t clock) {
+    if (simulation_) { SimulateClockOutWords(words, count, clock); return; }
+    for (int i = 0; i < count; ++i, words += 2) {
+      HardwareClearBits(words[0]);
+      HardwareSetBits(words[1]);
+      HardwareSetBits(clock);   // Rising edge: clock color in.
+    }
+  }
+
+  inline uint32_t Read() const {
+    return simulation_ ? 0 : *gpio_read_bits_ & input_bits_;
+  }
 
  private:
+  // The register writes themselves, without the check for a simulation.
+  inline void HardwareSetBits(uint32_t value) {
+    if (!value) return;
+    *gpio_set_bits_ = value;
+    for (int i = 0; i < slowdown_; ++i) {
+      *gpio_set_bits_ = value;
+    }
+  }
+
+  inline void HardwareClearBits(uint32_t value) {
+    if (!value) return;
+    *gpio_clr_bits_ = value;
+    for (int i = 0; i < slowdown_; ++i) {
+      *gpio_clr_bits_ = value;
+    }
+  }
+
+  // Implemented in gpio-simulation.cc
+  void SimulateSetBits(uint32_t value);
+  void SimulateClearBits(uint32_t value);
+  void SimulateClockOutWords(const uint32_t *words, int count, uint32_t clock);
+
   uint32_t output_bits_;
   uint32_t input_bits_;
   uint32_t reserved_bits_;
@@ -89,6 +130,7 @@ class GPIO {
   volatile uint32_t *gpio_set_bits_;
   volatile uint32_t *gpio_clr_bits_;
   volatile uint32_t *gpio_read_bits_;
+  GPIOSimulation *simulation_;
 };
 
 // A PinPulser is a utility class that pulses a GPIO pin. There can be various
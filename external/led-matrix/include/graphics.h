@@ -9,9 +9,12 @@
 
 #include "canvas.h"
 
-#include <map>
+#include <stddef.h>
 #include <stdint.h>
 
+#include <string>
+#include <vector>
+
 namespace rgb_matrix {
 struct Color {
   Color() : r(0), g(0), b(0) {}
@@ -68,14 +71,28 @@ public:
 private:
   Font(const Font& x);  // No copy constructor. Use references or pointer instead.
 
-  struct Glyph;
-  typedef std::map<uint32_t, Glyph*> CodepointGlyphMap;
+  struct Glyph {
+    int device_width, device_height;
+    int width, height;
+    int x_offset, y_offset;
+    size_t bitmap;  // Index of the first of its 'height' rows in bitmaps_.
+  };
 
   const Glyph *FindGlyph(uint32_t codepoint) const;
+  void AddGlyph(uint32_t codepoint, const Glyph &glyph, const uint64_t *rows);
 
   int font_height_;
   int base_line_;
-  CodepointGlyphMap glyphs_;
+
+  // The glyph atlas. Codepoints are looked up in pages of 256:
+  // page_index_[codepoint >> 8] is where the page starts in glyph_index_ (-1
+  // if no glyph is in it), which has the index into glyphs_ (or -1) for each
+  // codepoint of the page. The rows of all glyphs are packed in bitmaps_,
+  // leftmost pixel in the most significant bit.
+  std::vector<Glyph> glyphs_;
+  std::vector<uint64_t> bitmaps_;
+  std::vector<int32_t> page_index_;
+  std::vector<int32_t> glyph_index_;
 };
 
 // -- Some utility functions.
@@ -107,6 +124,60 @@ int VerticalDrawText(Canvas *c, const Font &font, int x, int y,
                      const Color &color, const Color *background_color,
                      const char *utf8_text, int kerning_offset = 0);
 
+// Text rendered once into a strip of pixels, for text that is drawn over and
+// over again, such as a scrolling ticker. Drawing the strip takes a few
+// SetPixels() calls, without decoding or looking up any glyph, and it can be
+// drawn at fractional x positions to scroll in steps smaller than a pixel.
+class TextStrip {
+public:
+  TextStrip();
+
+  // Render "utf8_text" like DrawText() with the same arguments would. Does
+  // nothing if the text, font, colors and spacing are the same as last time.
+  void SetText(const Font &font, const Color &color,
+               const Color *background_color, const char *utf8_text,
+               int kerning_offset = 0);
+
+  // How far DrawText() would have advanced, and the pixels covered.
+  int advance() const { return advance_; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Draw with the origin at "x","y" ("y" is the baseline), like DrawText().
+  void Draw(Canvas *c, int x, int y) const;
+
+  // Same at a fractional "x": each pixel is blended between the two strip
+  // pixels it straddles. Without background color, the partly covered
+  // pixels at the edges of the glyphs are blended against black.
+  void DrawSubpixel(Canvas *c, float x, int y) const;
+
+private:
+  TextStrip(const TextStrip&);
+
+  struct Span {
+    int x, y, length;  // Opaque pixels of the strip.
+  };
+
+  // Pixels from column "first" up to "end" of the strip moved right by
+  // "fraction" / 256 pixels, blended into row_.
+  void BlendRow(int row, int first, int end, int fraction) const;
+
+  const Font *font_;
+  std::string text_;
+  Color color_;
+  Color background_color_;
+  bool has_background_;
+  int kerning_offset_;
+
+  int advance_;
+  int left_, top_;                // Strip origin, relative to the text's.
+  int width_, height_;
+  std::vector<uint8_t> pixels_;   // RGBA, alpha 0 where transparent.
+  std::vector<Span> spans_;
+  bool opaque_;                   // One span per row, all of it.
+  mutable std::vector<uint8_t> row_;
+};
+
 // Draw a circle centered at "x", "y", with a radius of "radius" and with "color"
 void DrawCircle(Canvas *c, int x, int y, int radius, const Color &color);
 
@@ -34,6 +34,7 @@ class RGBMatrix;
 class FrameCanvas;   // Canvas for Double- and Multibuffering
 
 namespace internal {
+class EncodePool;
 class Framebuffer;
 class PixelDesignatorMap;
 }
@@ -107,11 +108,37 @@ public:
     // Flag: --led-pwm-dither-bits
     int pwm_dither_bits;
 
+    // Refresh rate in Hz to hold, e.g. 200 to avoid flicker on camera. While
+    // the refresh is slower, the output trades quality for speed: first more
+    // dither bits (up to max_pwm_dither_bits), then fewer PWM bits (down to
+    // min_pwm_bits), then shorter LSB times (halving, down to
+    // min_pwm_lsb_nanoseconds). The configured settings come back once the
+    // refresh is fast enough again. Default: 0, fixed settings.
+    // Flag: --led-refresh-target
+    int refresh_target_hz;
+    int min_pwm_bits;             // Flag: --led-min-pwm-bits (Default: 7)
+    int max_pwm_dither_bits;      // Flag: --led-max-pwm-dither-bits (Default: 2)
+    // 0 (default) keeps the LSB time as configured.
+    int min_pwm_lsb_nanoseconds;  // Flag: --led-min-pwm-lsb-nanoseconds
+
+    // Threads that convert large SetPixels() calls and new frames into
+    // bitplanes, each taking a share of the rows. They run on all cores but
+    // the refresh thread's. Worth it for long chains or parallel chains, where
+    // encoding on one thread limits the frame rate. 1..4, Default: 1.
+    // Flag: --led-encode-threads
+    int encode_threads;
+
     // The initial brightness of the panel in percent. Valid range is 1..100
     // Default: 100
     // Flag: --led-brightness
     int brightness;
 
+    // White balance in percent per color as "<r>,<g>,<b>", e.g. "100,85,90",
+    // for all panels, or several separated by ';', one per panel in the order
+    // of RGBMatrix::SetWhiteBalance(). Default: NULL, no correction.
+    // Flag: --led-white-balance
+    const char *white_balance;
+
     // Scan mode: 0=progressive, 1=interlaced
     // Flag: --led-scan-mode
     int scan_mode;
@@ -227,6 +254,13 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Set the white balance in percent per color (0..100) of one panel, or of
+  // all panels with panel = -1, e.g. to match panels from different batches.
+  // Panels are counted along the first chain from the Pi outwards, then along
+  // the next parallel chain. Like brightness, this applies to all
+  // FrameCanvas and only affects newly set pixels.
+  void SetWhiteBalance(int panel, uint8_t red, uint8_t green, uint8_t blue);
+
   //-- GPIO interaction
 
   // Return pointer to GPIO object for your own interaction with free
@@ -285,12 +319,43 @@ public:
   // 28Hz animation, nicely locked to the frame-rate).
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // Non-blocking alternative to SwapOnVSync() for animations that should not
+  // be locked to the refresh rate (lock-free triple buffering).
+  //
+  // Hands "other" to the refresh thread, which starts showing it with its
+  // next refresh, unless an even newer frame is published before that. Never
+  // waits. Returns a FrameCanvas that is neither on screen nor pending, to
+  // draw the next frame into. Its content is undefined (usually an older
+  // frame), so redraw it completely.
+  //
+  // Three FrameCanvases take turns; the third one is created on the first
+  // call. Don't mix with SwapOnVSync().
+  FrameCanvas *PublishFrame(FrameCanvas *other);
+
+  // Gets told about every refresh of the panels, e.g. to keep statistics of
+  // the refresh rate and its jitter.
+  class RefreshObserver {
+  public:
+    virtual ~RefreshObserver() {}
+
+    // Called on the refresh thread after each refresh with the time it took
+    // in microseconds. Runs at real-time priority between refreshes, so keep
+    // it short and never block.
+    virtual void OnRefresh(uint32_t usec) = 0;
+  };
+
+  // Set the observer, or NULL to remove it. Can be changed at any time; does
+  // not take ownership.
+  void SetRefreshObserver(RefreshObserver *observer);
+
   // -- Canvas interface. These write to the active FrameCanvas
   // (see documentation in canvas.h)
   virtual int width() const;
   virtual int height() const;
   virtual void SetPixel(int x, int y,
                         uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgba, int stride);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
@@ -334,8 +399,11 @@ private:
   CanvasTransformer *transformer_;  // deprecated. To be removed.
 #endif
   UpdateThread *updater_;
+  RefreshObserver *refresh_observer_;
   std::vector<FrameCanvas*> created_frames_;
   internal::PixelDesignatorMap *shared_pixel_mapper_;
+  internal::EncodePool *encode_pool_;
+  std::vector<uint8_t> white_balance_;  // Red, green, blue percent per panel.
 };
 
 class FrameCanvas : public Canvas {
@@ -383,6 +451,8 @@ public:
   virtual int height() const;
   virtual void SetPixel(int x, int y,
                         uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgba, int stride);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
@@ -480,6 +550,13 @@ bool ParseOptionsFromFlags(int *argc, char ***argv,
 RGBMatrix *CreateMatrixFromOptions(const RGBMatrix::Options &options,
                                    const RuntimeOptions &runtime_options);
 
+// Switch from root to user and group 'daemon', which is what
+// CreateMatrixFromOptions() does if RuntimeOptions::drop_privileges is on.
+// For programs that turn that off because they still need root for a
+// moment, e.g. to open devices on another thread while the matrix starts.
+// Returns 'false' if that failed; not running as root is fine.
+bool DropPrivileges();
+
 // A convenience function that combines the previous two steps. Optionally,
 // you can pass in option structs with a couple of defaults. A matrix is
 // created and returned; also the options structs are updated to reflect
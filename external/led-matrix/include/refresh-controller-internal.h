@@ -0,0 +1,81 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_REFRESH_CONTROLLER_INTERNAL_H
+#define RPI_REFRESH_CONTROLLER_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace rgb_matrix {
+namespace internal {
+// Holds a target refresh rate by trading output quality for speed: while
+// refreshes are too slow (a busy CPU, a long chain), it steps down a ladder
+// of output settings, and back up once there is time to spare.
+//
+// The ladder starts at the configured settings and goes, one step at a time,
+//  - to more dither bits, up to max_dither_bits: each one roughly halves
+//    the time the LEDs are pulsed, at the cost of the lowest bits only being
+//    shown every other refresh;
+//  - to fewer PWM bits, down to min_pwm_bits: fewer bitplanes to clock out;
+//  - to shorter LSB times, halving down to the number of prepared levels.
+//
+// Decisions are made on the mean refresh time of a window of refreshes. A
+// step up that has to be taken back soon after makes the controller wait
+// twice as long before trying again.
+class RefreshController {
+public:
+  struct Level {
+    int pwm_bits;
+    int dither_bits;
+    int lsb_step;  // LSB time is pwm_lsb_nanoseconds >> lsb_step.
+  };
+
+  RefreshController(int target_hz,
+                    int pwm_bits, int min_pwm_bits,
+                    int dither_bits, int max_dither_bits,
+                    int lsb_levels);
+
+  // Feed the duration of one refresh and the current time. Returns true if
+  // the level changed.
+  bool Update(uint32_t refresh_usec, uint32_t now_usec);
+
+  const Level &level() const { return ladder_[current_]; }
+
+  // Lowest bitplane to show in the "sequence"th refresh: dithered bits are
+  // only shown in some of them, dropped bits never.
+  int StartBit(unsigned sequence) const;
+
+private:
+  void Step(int direction, uint32_t now_usec);
+
+  const uint32_t target_usec_;
+  std::vector<Level> ladder_;
+  size_t current_;
+
+  uint32_t window_start_usec_;
+  uint32_t window_refreshes_;
+  uint64_t window_usec_;
+
+  uint32_t last_change_usec_;
+  uint32_t holdoff_usec_;  // Before the next step up.
+  bool stepped_up_;        // Last change was a step up.
+};
+
+}  // namespace internal
+}  // namespace rgb_matrix
+
+#endif  // RPI_REFRESH_CONTROLLER_INTERNAL_H
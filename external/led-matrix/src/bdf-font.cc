@@ -25,6 +25,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 // The little question-mark box "�" for unknown code.
 static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
 
@@ -33,20 +36,10 @@ static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
 typedef uint64_t rowbitmap_t;
 
 namespace rgb_matrix {
-struct Font::Glyph {
-  int device_width, device_height;
-  int width, height;
-  int x_offset, y_offset;
-  rowbitmap_t bitmap[0];  // contains 'height' elements.
-};
+static const uint32_t kMaxCodepoint = 0x10FFFF;
 
 Font::Font() : font_height_(-1), base_line_(0) {}
-Font::~Font() {
-  for (CodepointGlyphMap::iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    free(it->second);
-  }
-}
+Font::~Font() {}
 
 // TODO: that might not be working for all input files yet.
 bool Font::LoadFont(const char *path) {
@@ -58,7 +51,8 @@ bool Font::LoadFont(const char *path) {
   char buffer[1024];
   int dummy;
   Glyph tmp;
-  Glyph *current_glyph = NULL;
+  std::vector<rowbitmap_t> rows;
+  bool in_glyph = false;
   int row = 0;
 
   int bitmap_shift = 0;
@@ -76,29 +70,26 @@ bool Font::LoadFont(const char *path) {
     }
     else if (sscanf(buffer, "BBX %d %d %d %d", &tmp.width, &tmp.height,
                     &tmp.x_offset, &tmp.y_offset) == 4) {
-      current_glyph = (Glyph*) malloc(sizeof(Glyph)
-                                      + tmp.height * sizeof(rowbitmap_t));
-      *current_glyph = tmp;
+      rows.assign(tmp.height > 0 ? tmp.height : 0, 0);
+      in_glyph = true;
       // We only get number of bytes large enough holding our width. We want
       // it always left-aligned.
       bitmap_shift =
-        8 * (sizeof(rowbitmap_t) - ((current_glyph->width + 7) / 8))
-        - current_glyph->x_offset;
+        8 * (sizeof(rowbitmap_t) - ((tmp.width + 7) / 8)) - tmp.x_offset;
       row = -1;  // let's not start yet, wait for BITMAP
     }
     else if (strncmp(buffer, "BITMAP", strlen("BITMAP")) == 0) {
       row = 0;
     }
-    else if (current_glyph && row >= 0 && row < current_glyph->height
-             && (sscanf(buffer, "%" PRIx64, &current_glyph->bitmap[row]) == 1)) {
-      current_glyph->bitmap[row] <<= bitmap_shift;
+    else if (in_glyph && row >= 0 && row < tmp.height
+             && (sscanf(buffer, "%" PRIx64, &rows[row]) == 1)) {
+      rows[row] <<= bitmap_shift;
       row++;
     }
     else if (strncmp(buffer, "ENDCHAR", strlen("ENDCHAR")) == 0) {
-      if (current_glyph && row == current_glyph->height) {
-        free(glyphs_[codepoint]);  // just in case there was one.
-        glyphs_[codepoint] = current_glyph;
-        current_glyph = NULL;
+      if (in_glyph && row == tmp.height) {
+        AddGlyph(codepoint, tmp, rows.data());
+        in_glyph = false;
       }
     }
   }
@@ -106,52 +97,80 @@ bool Font::LoadFont(const char *path) {
   return true;
 }
 
+void Font::AddGlyph(uint32_t codepoint, const Glyph &glyph,
+                    const rowbitmap_t *rows) {
+  if (codepoint > kMaxCodepoint) return;  // Unencoded glyphs, for one.
+  const uint32_t page = codepoint >> 8;
+  if (page >= page_index_.size()) page_index_.resize(page + 1, -1);
+  if (page_index_[page] < 0) {
+    page_index_[page] = glyph_index_.size();
+    glyph_index_.resize(glyph_index_.size() + 256, -1);
+  }
+  int32_t &index = glyph_index_[page_index_[page] + (codepoint & 0xff)];
+  if (index < 0) {
+    index = glyphs_.size();
+    glyphs_.push_back(glyph);
+  } else {
+    glyphs_[index] = glyph;  // Defined again; the old rows stay unused.
+  }
+  glyphs_[index].bitmap = bitmaps_.size();
+  bitmaps_.insert(bitmaps_.end(), rows, rows + glyph.height);
+}
+
 Font *Font::CreateOutlineFont() const {
   Font *r = new Font();
   const int kBorder = 1;
   r->font_height_ = font_height_ + 2*kBorder;
   r->base_line_ = base_line_ + kBorder;
-  for (CodepointGlyphMap::const_iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    const Glyph *orig = it->second;
+  r->page_index_ = page_index_;  // Same codepoints, same glyph indices.
+  r->glyph_index_ = glyph_index_;
+  r->glyphs_.reserve(glyphs_.size());
+  std::vector<rowbitmap_t> rows;
+  for (size_t i = 0; i < glyphs_.size(); ++i) {
+    const Glyph *orig = &glyphs_[i];
+    const rowbitmap_t *orig_rows = &bitmaps_[orig->bitmap];
     const int height = orig->height + 2 * kBorder;
-    const size_t alloc_size = sizeof(Glyph) + height * sizeof(rowbitmap_t);
-    Glyph *const tmp_glyph = (Glyph*) calloc(1, alloc_size);
-    tmp_glyph->width  = orig->width  + 2*kBorder;
-    tmp_glyph->height = height;
-    tmp_glyph->device_width  = orig->device_width + 2*kBorder;
-    tmp_glyph->device_height = height;
-    tmp_glyph->y_offset = orig->y_offset - kBorder;
+    Glyph tmp_glyph = *orig;
+    tmp_glyph.width  = orig->width  + 2*kBorder;
+    tmp_glyph.height = height;
+    tmp_glyph.device_width  = orig->device_width + 2*kBorder;
+    tmp_glyph.device_height = height;
+    tmp_glyph.y_offset = orig->y_offset - kBorder;
+    tmp_glyph.bitmap = r->bitmaps_.size();
+    rows.assign(height, 0);
     // TODO: we don't really need bounding box, right ?
     const rowbitmap_t fill_pattern = 0b111;
     const rowbitmap_t start_mask   = 0b010;
     // Fill the border
     for (int h = 0; h < orig->height; ++h) {
       rowbitmap_t fill = fill_pattern;
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
+      rowbitmap_t orig_bitmap = orig_rows[h] >> kBorder;
       for (rowbitmap_t m = start_mask; m; m <<= 1, fill <<= 1) {
         if (orig_bitmap & m) {
-          tmp_glyph->bitmap[h+kBorder-1] |= fill;
-          tmp_glyph->bitmap[h+kBorder+0] |= fill;
-          tmp_glyph->bitmap[h+kBorder+1] |= fill;
+          rows[h+kBorder-1] |= fill;
+          rows[h+kBorder+0] |= fill;
+          rows[h+kBorder+1] |= fill;
         }
       }
     }
     // Remove original font again.
     for (int h = 0; h < orig->height; ++h) {
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
-      tmp_glyph->bitmap[h+kBorder] &= ~orig_bitmap;
+      rowbitmap_t orig_bitmap = orig_rows[h] >> kBorder;
+      rows[h+kBorder] &= ~orig_bitmap;
     }
-    r->glyphs_[it->first] = tmp_glyph;
+    r->glyphs_.push_back(tmp_glyph);
+    r->bitmaps_.insert(r->bitmaps_.end(), rows.begin(), rows.end());
   }
   return r;
 }
 
 const Font::Glyph *Font::FindGlyph(uint32_t unicode_codepoint) const {
-  CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
-  if (found == glyphs_.end())
+  const uint32_t page = unicode_codepoint >> 8;
+  if (page >= page_index_.size() || page_index_[page] < 0)
     return NULL;
-  return found->second;
+  const int32_t index
+    = glyph_index_[page_index_[page] + (unicode_codepoint & 0xff)];
+  return index < 0 ? NULL : &glyphs_[index];
 }
 
 int Font::CharacterWidth(uint32_t unicode_codepoint) const {
@@ -159,6 +178,34 @@ int Font::CharacterWidth(uint32_t unicode_codepoint) const {
   return g ? g->device_width : -1;
 }
 
+// One row of pixels of one color, for SetPixels().
+static const int kSpanPixels = 64;
+struct ColorSpan {
+  explicit ColorSpan(const Color &color) {
+    for (int i = 0; i < kSpanPixels; ++i) {
+      rgba[4*i + 0] = color.r;
+      rgba[4*i + 1] = color.g;
+      rgba[4*i + 2] = color.b;
+      rgba[4*i + 3] = 0xff;
+    }
+  }
+  uint8_t rgba[4 * kSpanPixels];
+};
+
+// Draw each run of set bits in "bits" with one SetPixels() call. The most
+// significant bit is at "x".
+static void DrawRuns(Canvas *c, int x, int y, rowbitmap_t bits,
+                     const ColorSpan &span) {
+  while (bits) {
+    const int start = __builtin_clzll(bits);
+    const rowbitmap_t rest = ~(bits << start);
+    const int length = rest ? __builtin_clzll(rest) : kSpanPixels - start;
+    c->SetPixels(x + start, y, length, 1, span.rgba, 0);
+    bits = (start + length < kSpanPixels)
+      ? bits & (~(rowbitmap_t)0 >> (start + length)) : 0;
+  }
+}
+
 int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
                     const Color &color, const Color *bgcolor,
                     uint32_t unicode_codepoint) const {
@@ -166,16 +213,28 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
   if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
   if (g == NULL) return 0;
   y_pos = y_pos - g->height - g->y_offset;
-  for (int y = 0; y < g->height; ++y) {
-    const rowbitmap_t row = g->bitmap[y];
-    rowbitmap_t x_mask = (1LL<<63);
-    for (int x = 0; x < g->device_width; ++x, x_mask >>= 1) {
-      if (row & x_mask) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
-      } else if (bgcolor) {
-        c->SetPixel(x_pos + x, y_pos + y, bgcolor->r, bgcolor->g, bgcolor->b);
+  // Only the pixels within the advance are drawn.
+  const rowbitmap_t width_mask = (g->device_width >= kSpanPixels)
+    ? ~(rowbitmap_t)0
+    : (g->device_width > 0 ? ~(~(rowbitmap_t)0 >> g->device_width) : 0);
+  const ColorSpan fg(color);
+  if (bgcolor) {
+    const ColorSpan bg(*bgcolor);
+    for (int y = 0; y < g->height; ++y) {
+      const rowbitmap_t row = bitmaps_[g->bitmap + y];
+      DrawRuns(c, x_pos, y_pos + y, row & width_mask, fg);
+      DrawRuns(c, x_pos, y_pos + y, ~row & width_mask, bg);
+      // Wider than a row bitmap: the rest is background.
+      for (int x = kSpanPixels; x < g->device_width; x += kSpanPixels) {
+        c->SetPixels(x_pos + x, y_pos + y,
+                     std::min(kSpanPixels, g->device_width - x), 1,
+                     bg.rgba, 0);
       }
     }
+  } else {
+    for (int y = 0; y < g->height; ++y) {
+      DrawRuns(c, x_pos, y_pos + y, bitmaps_[g->bitmap + y] & width_mask, fg);
+    }
   }
   return g->device_width;
 }
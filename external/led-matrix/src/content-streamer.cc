@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -20,8 +21,9 @@ namespace {
 // the Raspberry Pi, but also x86; so it is possible to create streams easily
 // on a different x86 Linux PC.
 static const uint32_t kFileMagicValue = 0xED0C5A48;
+static const uint32_t kCompressedFileMagicValue = 0xED0C5A49;
 struct FileHeader {
-  uint32_t magic;  // kFileMagicValue
+  uint32_t magic;  // kFileMagicValue or kCompressedFileMagicValue
   uint32_t buf_size;
   uint32_t width;
   uint32_t height;
@@ -34,14 +36,120 @@ struct FrameHeader {
   uint32_t magic;  // kFrameMagic
   uint32_t size;
   uint32_t hold_time_us;  // How long this frame lasts in usec.
-  uint32_t future_use1;
+  uint32_t encoding;      // FrameEncoding; always kEncodingRaw uncompressed.
   uint64_t future_use2;
   uint64_t future_use3;
 };
+
+// At the very end of a compressed stream, right after the offsets of all
+// frames (uint64_t each).
+static const uint32_t kIndexMagicValue = 0x1DE7F00D;
+struct IndexTrailer {
+  uint32_t magic;  // kIndexMagicValue
+  uint32_t frames;
+  uint64_t index_offset;
+  uint64_t future_use1;
+  uint64_t future_use2;
+};
+
+enum FrameEncoding {
+  kEncodingRaw   = 0,  // Serialized frame.
+  kEncodingKey   = 1,  // Runs applied to an empty frame.
+  kEncodingDelta = 2,  // Runs applied to the previous frame.
+};
+
+// Every that many frames there is a key frame, which limits how many frames
+// need to be decoded when seeking.
+static const size_t kKeyFrameInterval = 32;
+
+// Compressed frames are a sequence of 32 bit words: a token with the type of
+// run in the upper two bits and its length in words in the lower 30, followed
+// by the data of the run. Runs are XORed onto the frame they apply to, so
+// words that did not change are just skipped.
+static const uint32_t kRunSkip    = 0u << 30;  // No data.
+static const uint32_t kRunRepeat  = 1u << 30;  // One word for all of the run.
+static const uint32_t kRunLiteral = 2u << 30;  // One word each.
+static const uint32_t kRunTypeMask = 3u << 30;
+static const uint32_t kMaxRunLength = ~kRunTypeMask;
+static const size_t kMinRepeat = 3;  // Shorter ones are cheaper as literals.
+
+static const size_t kNoFrame = ~(size_t)0;
 }
 
-FileStreamIO::FileStreamIO(int fd) : fd_(fd) {}
-FileStreamIO::~FileStreamIO() { close(fd_); }
+// Encode "frame" as runs to be applied to "previous", or to an empty frame
+// if that is NULL.
+static void EncodeRuns(const uint32_t *frame, const uint32_t *previous,
+                       size_t count, std::vector<uint32_t> *out) {
+  auto delta = [frame, previous](size_t i) {
+    return previous ? frame[i] ^ previous[i] : frame[i];
+  };
+  out->clear();
+  size_t i = 0;
+  while (i < count) {
+    const uint32_t value = delta(i);
+    size_t run = 1;
+    while (i + run < count && run < kMaxRunLength && delta(i + run) == value)
+      ++run;
+    if (value == 0) {
+      out->push_back(kRunSkip | run);
+    } else if (run >= kMinRepeat) {
+      out->push_back(kRunRepeat | run);
+      out->push_back(value);
+    } else {
+      // Literals up to the next word that is unchanged or starts a repeat.
+      run = 0;
+      while (i + run < count && run < kMaxRunLength) {
+        const uint32_t v = delta(i + run);
+        if (v == 0) break;
+        if (i + run + kMinRepeat <= count
+            && delta(i + run + 1) == v && delta(i + run + 2) == v)
+          break;
+        ++run;
+      }
+      out->push_back(kRunLiteral | run);
+      for (size_t j = 0; j < run; ++j) out->push_back(delta(i + j));
+    }
+    i += run;
+  }
+}
+
+// Apply runs written by EncodeRuns(). Returns false if they are broken.
+static bool ApplyRuns(const uint32_t *runs, size_t run_words,
+                      uint32_t *frame, size_t count) {
+  const uint32_t *const end = runs + run_words;
+  size_t pos = 0;
+  while (runs < end) {
+    const uint32_t token = *runs++;
+    const size_t length = token & kMaxRunLength;
+    if (length > count - pos) return false;
+    uint32_t *out = frame + pos;
+    switch (token & kRunTypeMask) {
+    case kRunSkip:
+      break;
+    case kRunRepeat: {
+      if (runs >= end) return false;
+      const uint32_t value = *runs++;
+      for (size_t i = 0; i < length; ++i) out[i] ^= value;
+      break;
+    }
+    case kRunLiteral:
+      if (length > (size_t)(end - runs)) return false;
+      for (size_t i = 0; i < length; ++i) out[i] ^= runs[i];
+      runs += length;
+      break;
+    default:
+      return false;
+    }
+    pos += length;
+  }
+  return pos == count;
+}
+
+FileStreamIO::FileStreamIO(int fd) : fd_(fd), map_(NULL), map_len_(0) {}
+FileStreamIO::~FileStreamIO() {
+  Unmap();
+  close(fd_);
+}
 
 void FileStreamIO::Rewind() { lseek(fd_, 0, SEEK_SET); }
 
@@ -53,6 +161,29 @@ ssize_t FileStreamIO::Append(const void *buf, const size_t count) {
   return write(fd_, buf, count);
 }
 
+const char *FileStreamIO::Map(size_t *len) {
+  struct stat st;
+  if (fstat(fd_, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+    return NULL;  // Pipes and the like are read.
+  if (map_ == NULL || (size_t)st.st_size != map_len_) {
+    Unmap();
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+    if (m == MAP_FAILED) return NULL;
+    map_ = m;
+    map_len_ = st.st_size;
+    // Get the file into memory before playing, not while.
+    madvise(map_, map_len_, MADV_WILLNEED);
+  }
+  *len = map_len_;
+  return (const char*)map_;
+}
+
+void FileStreamIO::Unmap() {
+  if (map_) munmap(map_, map_len_);
+  map_ = NULL;
+  map_len_ = 0;
+}
+
 void MemStreamIO::Rewind() { pos_ = 0; }
 ssize_t MemStreamIO::Read(void *buf, size_t count) {
   const size_t amount = std::min(count, buffer_.size() - pos_);
@@ -64,6 +195,10 @@ ssize_t MemStreamIO::Append(const void *buf, size_t count) {
   buffer_.append((const char*)buf, count);
   return count;
 }
+const char *MemStreamIO::Map(size_t *len) {
+  *len = buffer_.size();
+  return buffer_.data();
+}
 
 static ssize_t FullRead(StreamIO *io, void *buf, const size_t count) {
   int remaining = count;
@@ -88,8 +223,19 @@ static ssize_t FullAppend(StreamIO *io, const void *buf, const size_t count) {
   return count;
 }
 
-StreamWriter::StreamWriter(StreamIO *io) : io_(io), header_written_(false) {}
+StreamWriter::StreamWriter(StreamIO *io, bool compress)
+  : io_(io), compress_(compress), header_written_(false), finished_(false),
+    offset_(0) {}
+StreamWriter::~StreamWriter() { Finish(); }
+
+bool StreamWriter::Append(const void *buf, size_t count) {
+  if (FullAppend(io_, buf, count) != (ssize_t)count) return false;
+  offset_ += count;
+  return true;
+}
+
 bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
+  if (finished_) return false;
   const char *data;
   size_t len;
   frame.Serialize(&data, &len);
@@ -99,24 +245,53 @@ bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   }
   FrameHeader h = {};
   h.magic = kFrameMagicValue;
-  h.size = len;
   h.hold_time_us = hold_time_us;
-  FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  if (!compress_) {
+    h.size = len;
+    h.encoding = kEncodingRaw;
+    return Append(&h, sizeof(h)) && Append(data, len);
+  }
+
+  // The serialized frame is an array of gpio_bits_t.
+  const uint32_t *words = (const uint32_t*) data;
+  const size_t count = len / sizeof(uint32_t);
+  const bool key_frame = (index_.size() % kKeyFrameInterval == 0
+                          || previous_.size() != count);
+  EncodeRuns(words, key_frame ? NULL : previous_.data(), count, &encoded_);
+  previous_.assign(words, words + count);
+
+  h.size = encoded_.size() * sizeof(uint32_t);
+  h.encoding = key_frame ? kEncodingKey : kEncodingDelta;
+  index_.push_back(offset_);
+  return Append(&h, sizeof(h)) && Append(encoded_.data(), h.size);
+}
+
+bool StreamWriter::Finish() {
+  if (finished_) return true;
+  finished_ = true;
+  if (!compress_ || !header_written_) return true;
+  IndexTrailer trailer = {};
+  trailer.magic = kIndexMagicValue;
+  trailer.frames = index_.size();
+  trailer.index_offset = offset_;
+  return (Append(index_.data(), index_.size() * sizeof(uint64_t))
+          && Append(&trailer, sizeof(trailer)));
 }
 
 void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
   FileHeader header = {};
-  header.magic = kFileMagicValue;
+  header.magic = compress_ ? kCompressedFileMagicValue : kFileMagicValue;
   header.width = frame.width();
   header.height = frame.height();
   header.buf_size = len;
-  FullAppend(io_, &header, sizeof(header));
+  Append(&header, sizeof(header));
   header_written_ = true;
 }
 
 StreamReader::StreamReader(StreamIO *io)
-  : io_(io), state_(STREAM_AT_BEGIN), buffer_(NULL) {
+  : io_(io), buf_size_(0), width_(0), height_(0), state_(STREAM_AT_BEGIN),
+    buffer_(NULL), map_(NULL), map_len_(0), compressed_(false),
+    next_frame_(0), decoded_frame_(kNoFrame) {
   io_->Rewind();
 }
 StreamReader::~StreamReader() { delete [] buffer_; }
@@ -127,8 +302,17 @@ void StreamReader::Rewind() {
 }
 
 bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
-  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader(*frame)) return false;
+  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader()) return false;
   if (state_ != STREAM_READING) return false;
+  if (width_ != frame->width() || height_ != frame->height()) {
+    fprintf(stderr, "This stream is for %dx%d, can't play on %dx%d. "
+            "Please use the same settings for record/replay\n",
+            width_, height_, frame->width(), frame->height());
+    state_ = STREAM_ERROR;
+    return false;
+  }
+  if (map_) return GetNextMapped(frame, hold_time_us);
+
   FrameHeader h;
   if (FullRead(io_, &h, sizeof(h)) != sizeof(h)) return false;
 
@@ -147,24 +331,152 @@ bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
   return frame->Deserialize(buffer_, buf_size_);
 }
 
-bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
+size_t StreamReader::FrameCount() {
+  if (state_ == STREAM_AT_BEGIN) ReadFileHeader();
+  if (state_ != STREAM_READING || !map_) return 0;
+  if (compressed_) return index_.size();
+  // Uncompressed frames all have the same size.
+  return (map_len_ - sizeof(FileHeader)) / (sizeof(FrameHeader) + buf_size_);
+}
+
+bool StreamReader::Seek(size_t frame_number) {
+  if (frame_number >= FrameCount()) return false;
+  next_frame_ = frame_number;
+  return true;
+}
+
+bool StreamReader::ReadFileHeader() {
   FileHeader header;
-  FullRead(io_, &header, sizeof(header));
-  if (header.magic != kFileMagicValue) {
+  map_ = io_->Map(&map_len_);
+  if (map_) {
+    if (map_len_ < sizeof(header)) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    memcpy(&header, map_, sizeof(header));
+  } else {
+    FullRead(io_, &header, sizeof(header));
+  }
+  compressed_ = (header.magic == kCompressedFileMagicValue);
+  if (header.magic != kFileMagicValue && !compressed_) {
     state_ = STREAM_ERROR;
     return false;
   }
-  if ((int)header.width != frame.width()
-      || (int)header.height != frame.height()) {
-    fprintf(stderr, "This stream is for %dx%d, can't play on %dx%d. "
-            "Please use the same settings for record/replay\n",
-            header.width, header.height, frame.width(), frame.height());
+  if (compressed_ && !map_) {
+    fprintf(stderr, "Compressed streams can only be played from a file.\n");
     state_ = STREAM_ERROR;
     return false;
   }
   state_ = STREAM_READING;
+  width_ = header.width;
+  height_ = header.height;
   buf_size_ = header.buf_size;
   if (!buffer_) buffer_ = new char [ header.buf_size ];
+  next_frame_ = 0;
+  decoded_frame_ = kNoFrame;
+  if (compressed_) ReadIndex();
+  return true;
+}
+
+void StreamReader::ReadIndex() {
+  index_.clear();
+  IndexTrailer trailer;
+  if (map_len_ >= sizeof(FileHeader) + sizeof(trailer)) {
+    memcpy(&trailer, map_ + map_len_ - sizeof(trailer), sizeof(trailer));
+    // In 64 bits, so a crafted frame count can't wrap around on 32 bit
+    // machines; and no more frames than their headers would fit.
+    const uint64_t max_frames
+      = (map_len_ - sizeof(FileHeader)) / sizeof(FrameHeader);
+    const uint64_t index_bytes = (uint64_t)trailer.frames * sizeof(uint64_t);
+    if (trailer.magic == kIndexMagicValue
+        && trailer.frames <= max_frames
+        && trailer.index_offset <= map_len_
+        && (map_len_ - trailer.index_offset
+            == index_bytes + sizeof(trailer))) {
+      index_.resize(trailer.frames);
+      memcpy(index_.data(), map_ + trailer.index_offset, index_bytes);
+      return;
+    }
+  }
+  // Not finished writing: find the frames one by one.
+  uint64_t offset = sizeof(FileHeader);
+  FrameHeader h;
+  while (offset + sizeof(h) <= map_len_) {
+    memcpy(&h, map_ + offset, sizeof(h));
+    if (h.magic != kFrameMagicValue || h.size > map_len_ - offset - sizeof(h))
+      break;
+    index_.push_back(offset);
+    offset += sizeof(h) + h.size;
+  }
+}
+
+// Returns the header of the given frame in the mapping, or NULL if there is
+// no such frame. The header and its data are checked to be in the mapping.
+const char *StreamReader::MappedFrame(size_t frame_number) const {
+  uint64_t offset;
+  if (compressed_) {
+    if (frame_number >= index_.size()) return NULL;
+    offset = index_[frame_number];
+  } else {
+    offset = sizeof(FileHeader)
+      + frame_number * (uint64_t)(sizeof(FrameHeader) + buf_size_);
+  }
+  if (offset > map_len_ || map_len_ - offset < sizeof(FrameHeader))
+    return NULL;
+  FrameHeader h;
+  memcpy(&h, map_ + offset, sizeof(h));
+  if (h.magic != kFrameMagicValue || h.size > map_len_ - offset - sizeof(h))
+    return NULL;
+  return map_ + offset;
+}
+
+bool StreamReader::GetNextMapped(FrameCanvas *frame, uint32_t* hold_time_us) {
+  const char *header = MappedFrame(next_frame_);
+  if (!header) return false;
+  FrameHeader h;
+  memcpy(&h, header, sizeof(h));
+  const char *data = header + sizeof(h);
+  if (compressed_) {
+    if (!DecodeMapped(next_frame_)) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    data = buffer_;
+  } else if (h.size < buf_size_) {
+    return false;
+  }
+  if (hold_time_us) *hold_time_us = h.hold_time_us;
+  ++next_frame_;
+  return frame->Deserialize(data, buf_size_);
+}
+
+// Decode the given frame into buffer_. Differences apply to the frame before,
+// so unless that is what buffer_ has, this starts at the last key frame.
+bool StreamReader::DecodeMapped(size_t frame_number) {
+  if (decoded_frame_ == frame_number) return true;
+  size_t start = frame_number;
+  for (;;) {
+    const char *header = MappedFrame(start);
+    if (!header) return false;
+    FrameHeader h;
+    memcpy(&h, header, sizeof(h));
+    if (h.encoding == kEncodingKey) break;
+    if (h.encoding != kEncodingDelta || start == 0) return false;
+    if (decoded_frame_ == start - 1) break;
+    --start;
+  }
+  for (size_t i = start; i <= frame_number; ++i) {
+    const char *header = MappedFrame(i);
+    FrameHeader h;
+    memcpy(&h, header, sizeof(h));
+    if (h.encoding == kEncodingKey) memset(buffer_, 0, buf_size_);
+    decoded_frame_ = kNoFrame;
+    if (!ApplyRuns((const uint32_t*)(header + sizeof(h)),
+                   h.size / sizeof(uint32_t),
+                   (uint32_t*)buffer_, buf_size_ / sizeof(uint32_t)))
+      return false;
+    decoded_frame_ = i;
+  }
   return true;
 }
 }  // namespace rgb_matrix
@@ -0,0 +1,99 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "encode-pool-internal.h"
+
+#include <assert.h>
+
+namespace rgb_matrix {
+namespace internal {
+class EncodePool::Worker : public Thread {
+public:
+  Worker(EncodePool *pool, int part) : pool_(pool), part_(part) {}
+
+  virtual void Run() {
+    unsigned seen = 0;
+    for (;;) {
+      Job *job;
+      {
+        MutexLock l(&pool_->state_sync_);
+        while (pool_->running_ && pool_->generation_ == seen) {
+          pool_->state_sync_.WaitOn(&pool_->job_start_);
+        }
+        if (!pool_->running_) return;
+        seen = pool_->generation_;
+        job = pool_->job_;
+      }
+
+      job->RunPart(part_);
+
+      MutexLock l(&pool_->state_sync_);
+      if (--pool_->pending_ == 0) {
+        pthread_cond_signal(&pool_->job_done_);
+      }
+    }
+  }
+
+private:
+  EncodePool *const pool_;
+  const int part_;
+};
+
+EncodePool::EncodePool(int threads, uint32_t cpu_affinity_mask)
+  : job_(NULL), generation_(0), pending_(0), running_(true) {
+  assert(threads >= 1);
+  pthread_cond_init(&job_start_, NULL);
+  pthread_cond_init(&job_done_, NULL);
+  for (int part = 1; part < threads; ++part) {
+    Worker *worker = new Worker(this, part);
+    worker->Start(0, cpu_affinity_mask);
+    workers_.push_back(worker);
+  }
+}
+
+EncodePool::~EncodePool() {
+  {
+    MutexLock l(&state_sync_);
+    running_ = false;
+    pthread_cond_broadcast(&job_start_);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i]->WaitStopped();
+    delete workers_[i];
+  }
+  pthread_cond_destroy(&job_start_);
+  pthread_cond_destroy(&job_done_);
+}
+
+void EncodePool::Run(Job *job) {
+  MutexLock run(&run_sync_);
+  {
+    MutexLock l(&state_sync_);
+    job_ = job;
+    pending_ = workers_.size();
+    ++generation_;
+    pthread_cond_broadcast(&job_start_);
+  }
+
+  job->RunPart(0);
+
+  MutexLock l(&state_sync_);
+  while (pending_ > 0) {
+    state_sync_.WaitOn(&job_done_);
+  }
+  job_ = NULL;
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
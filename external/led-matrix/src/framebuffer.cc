@@ -29,6 +29,15 @@
 
 #include <algorithm>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define FB_ENCODE_NEON 1
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#  define FB_ENCODE_SSE2 1
+#endif
+
+#include "encode-pool-internal.h"
 #include "gpio.h"
 
 namespace rgb_matrix {
@@ -37,9 +46,16 @@ enum {
   kBitPlanes = 11  // maximum usable bitplanes.
 };
 
+// Below this many pixels, waking up the encode pool costs more than it saves.
+static const int kMinPoolPixels = 4096;
+
 // We need one global instance of a timing correct pulser. There are different
 // implementations depending on the context.
 static PinPulser *sOutputEnablePulser = NULL;
+// Pulse profiles prepared in InitGPIO(): LSB times and dither bits.
+static int sLsbLevels = 1;
+static int sDitherBits = 0;
+static int sDitherLevels = 1;
 
 #ifdef ONLY_SINGLE_SUB_PANEL
 #  define SUB_PANELS_ 1
@@ -57,10 +73,151 @@ PixelDesignatorMap::PixelDesignatorMap(int width, int height,
                                        const PixelDesignator &fill_bits)
   : width_(width), height_(height), fill_bits_(fill_bits),
     buffer_(new PixelDesignator[width * height]) {
+  memset(&arrays_, 0, sizeof(arrays_));
 }
 
 PixelDesignatorMap::~PixelDesignatorMap() {
   delete [] buffer_;
+  delete [] arrays_.gpio_word;
+  delete [] arrays_.r_bit;
+  delete [] arrays_.g_bit;
+  delete [] arrays_.b_bit;
+  delete [] arrays_.mask;
+  delete [] arrays_.panel;
+}
+
+const PixelDesignatorMap::DesignatorArrays &
+PixelDesignatorMap::GetDesignatorArrays() {
+  if (arrays_.gpio_word != NULL)
+    return arrays_;
+  const int count = width_ * height_;
+  arrays_.gpio_word = new int[count];
+  arrays_.r_bit = new uint32_t[count];
+  arrays_.g_bit = new uint32_t[count];
+  arrays_.b_bit = new uint32_t[count];
+  arrays_.mask = new uint32_t[count];
+  arrays_.panel = new int[count];
+  for (int i = 0; i < count; ++i) {
+    arrays_.gpio_word[i] = buffer_[i].gpio_word;
+    arrays_.r_bit[i] = buffer_[i].r_bit;
+    arrays_.g_bit[i] = buffer_[i].g_bit;
+    arrays_.b_bit[i] = buffer_[i].b_bit;
+    arrays_.mask[i] = buffer_[i].mask;
+    arrays_.panel[i] = buffer_[i].panel;
+  }
+  return arrays_;
+}
+
+const PixelDesignatorMap::Partition &
+PixelDesignatorMap::GetPartition(int parts, int words_per_double_row,
+                                 int double_rows) {
+  if ((int) partition_.size() == parts)
+    return partition_;
+  partition_.assign(parts, std::vector<Run>());
+  for (int y = 0; y < height_; ++y) {
+    int run_part = -1;
+    Run run = { 0, 0 };
+    for (int x = 0; x < width_; ++x) {
+      const int word = buffer_[y * width_ + x].gpio_word;
+      if (word < 0) continue;  // Unused pixels go along with any run.
+      const int part = (word / words_per_double_row) * parts / double_rows;
+      if (part != run_part) {
+        if (run_part >= 0) partition_[run_part].push_back(run);
+        run_part = part;
+        run.index = y * width_ + x;
+      }
+      run.length = y * width_ + x + 1 - run.index;
+    }
+    if (run_part >= 0) partition_[run_part].push_back(run);
+  }
+  return partition_;
+}
+
+namespace {
+// Orders designator indices the way their gpio words are laid out.
+class OutputOrderLess {
+public:
+  OutputOrderLess(const PixelDesignator *designators, int words_per_double_row)
+    : designators_(designators), words_per_double_row_(words_per_double_row) {}
+
+  bool operator()(int a, int b) const {
+    const PixelDesignator &da = designators_[a];
+    const PixelDesignator &db = designators_[b];
+    const int row_a = da.gpio_word / words_per_double_row_;
+    const int row_b = db.gpio_word / words_per_double_row_;
+    if (row_a != row_b) return row_a < row_b;
+    const uint32_t bits_a = da.r_bit | da.g_bit | da.b_bit;
+    const uint32_t bits_b = db.r_bit | db.g_bit | db.b_bit;
+    if (bits_a != bits_b) return bits_a < bits_b;
+    return da.gpio_word < db.gpio_word;
+  }
+
+private:
+  const PixelDesignator *const designators_;
+  const int words_per_double_row_;
+};
+}  // namespace
+
+const PixelDesignatorMap::OutputOrder &
+PixelDesignatorMap::GetOutputOrder(int parts, int words_per_double_row,
+                                   int double_rows) {
+  OutputOrder &o = output_order_;
+  if ((int) o.part_start.size() == parts + 1)
+    return o;
+
+  // How much of the visible order already goes to four consecutive words.
+  int quads = 0, consecutive = 0;
+  for (int y = 0; y < height_; ++y) {
+    const PixelDesignator *const row = buffer_ + y * width_;
+    for (int x = 0; x + 4 <= width_; x += 4) {
+      const int word = row[x].gpio_word;
+      ++quads;
+      if (word >= 0 && row[x + 1].gpio_word == word + 1
+          && row[x + 2].gpio_word == word + 2
+          && row[x + 3].gpio_word == word + 3)
+        ++consecutive;
+    }
+  }
+  o.scattered = (4 * consecutive < 3 * quads);
+
+  std::vector<int> order;
+  for (int i = 0; i < width_ * height_; ++i) {
+    if (buffer_[i].gpio_word >= 0) order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(),
+            OutputOrderLess(buffer_, words_per_double_row));
+
+  const int count = order.size();
+  o.x.resize(count);
+  o.y.resize(count);
+  o.gpio_word.resize(count);
+  o.r_bit.resize(count);
+  o.g_bit.resize(count);
+  o.b_bit.resize(count);
+  o.mask.resize(count);
+  o.panel.resize(count);
+  o.part_start.assign(parts + 1, count);
+  int next_part = 0;
+  for (int i = 0; i < count; ++i) {
+    const PixelDesignator &d = buffer_[order[i]];
+    o.x[i] = order[i] % width_;
+    o.y[i] = order[i] / width_;
+    o.gpio_word[i] = d.gpio_word;
+    o.r_bit[i] = d.r_bit;
+    o.g_bit[i] = d.g_bit;
+    o.b_bit[i] = d.b_bit;
+    o.mask[i] = d.mask;
+    o.panel[i] = d.panel;
+    const int part = (d.gpio_word / words_per_double_row) * parts / double_rows;
+    while (next_part <= part) o.part_start[next_part++] = i;
+  }
+  o.designators.gpio_word = o.gpio_word.data();
+  o.designators.r_bit = o.r_bit.data();
+  o.designators.g_bit = o.g_bit.data();
+  o.designators.b_bit = o.b_bit.data();
+  o.designators.mask = o.mask.data();
+  o.designators.panel = o.panel.data();
+  return o;
 }
 
 // Different panel types use different techniques to set the row address.
@@ -196,7 +353,7 @@ RowAddressSetter *Framebuffer::row_setter_ = NULL;
 Framebuffer::Framebuffer(int rows, int columns, int parallel,
                          int scan_mode,
                          const char *led_sequence, bool inverse_color,
-                         PixelDesignatorMap **mapper)
+                         PixelDesignatorMap **mapper, int panel_columns)
   : rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
@@ -206,7 +363,10 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
     double_rows_(rows / SUB_PANELS_),
     buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
-    shared_mapper_(mapper) {
+    shared_mapper_(mapper),
+    color_clk_mask_(0), output_dirty_(true), encode_pool_(NULL),
+    panel_columns_(panel_columns > 0 ? panel_columns : columns),
+    panels_(parallel * (columns / panel_columns_)) {
   assert(hardware_mapping_ != NULL);   // Called InitHardwareMapping() ?
   assert(shared_mapper_ != NULL);  // Storage should be provided by RGBMatrix.
   assert(rows_ >=4 && rows_ <= 64 && rows_ % 2 == 0);
@@ -220,6 +380,18 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   assert(parallel >= 1 && parallel <= 3);
 
   bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  output_words_ = new gpio_bits_t[2 * double_rows_ * columns_ * kBitPlanes];
+  plane_repeats_ = new bool[double_rows_ * kBitPlanes];
+
+  const struct HardwareMapping &h = *hardware_mapping_;
+  color_clk_mask_ |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
+  if (parallel_ >= 2) {
+    color_clk_mask_ |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+  }
+  if (parallel_ >= 3) {
+    color_clk_mask_ |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+  }
+  color_clk_mask_ |= h.clock;
 
   // If we're the first Framebuffer created, the shared PixelMapper is
   // still NULL, so create one.
@@ -232,7 +404,6 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   if (*shared_mapper_ == NULL) {
     // Gather all the bits for given color for fast Fill()s and use the right
     // bits according to the led sequence
-    const struct HardwareMapping &h = *hardware_mapping_;
     gpio_bits_t r = h.p0_r1 | h.p0_r2 | h.p1_r1 | h.p1_r2 | h.p2_r1 | h.p2_r2;
     gpio_bits_t g = h.p0_g1 | h.p0_g2 | h.p1_g1 | h.p1_g2 | h.p2_g1 | h.p2_g2;
     gpio_bits_t b = h.p0_b1 | h.p0_b2 | h.p1_b1 | h.p1_b2 | h.p2_b1 | h.p2_b2;
@@ -249,10 +420,16 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     }
   }
 
+  WhiteBalance neutral = { { 100, 100, 100 } };
+  white_balance_.assign(panels_, neutral);
+  RebuildColorTables();
+
   Clear();
 }
 
 Framebuffer::~Framebuffer() {
+  delete [] plane_repeats_;
+  delete [] output_words_;
   delete [] bitplane_buffer_;
 }
 
@@ -299,7 +476,9 @@ Framebuffer::~Framebuffer() {
                                         bool allow_hardware_pulsing,
                                         int pwm_lsb_nanoseconds,
                                         int dither_bits,
-                                        int row_address_type) {
+                                        int row_address_type,
+                                        int min_pwm_lsb_nanoseconds,
+                                        int max_dither_bits) {
   if (sOutputEnablePulser != NULL)
     return;  // already initialized.
 
@@ -341,17 +520,43 @@ Framebuffer::~Framebuffer() {
   const uint32_t result = io->InitOutputs(all_used_bits, is_some_adafruit_hat);
   assert(result == all_used_bits);  // Impl: all bits declared in gpio.cc ?
 
+  sLsbLevels = 1;
+  while (min_pwm_lsb_nanoseconds > 0
+         && (pwm_lsb_nanoseconds >> sLsbLevels) >= min_pwm_lsb_nanoseconds) {
+    ++sLsbLevels;
+  }
+  sDitherBits = dither_bits;
+  sDitherLevels = std::max(max_dither_bits - dither_bits, 0) + 1;
+
+  // kBitPlanes timings per profile. The shortest LSB time comes first, as
+  // the hardware pulser derives its clock from the first timing.
   std::vector<int> bitplane_timings;
-  uint32_t timing_ns = pwm_lsb_nanoseconds;
-  for (int b = 0; b < kBitPlanes; ++b) {
-    bitplane_timings.push_back(timing_ns);
-    if (b >= dither_bits) timing_ns *= 2;
+  for (int lsb_step = sLsbLevels - 1; lsb_step >= 0; --lsb_step) {
+    for (int d = dither_bits; d < dither_bits + sDitherLevels; ++d) {
+      uint32_t timing_ns = pwm_lsb_nanoseconds >> lsb_step;
+      for (int b = 0; b < kBitPlanes; ++b) {
+        bitplane_timings.push_back(timing_ns);
+        if (b >= d) timing_ns *= 2;
+      }
+    }
   }
   sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
                                           allow_hardware_pulsing,
                                           bitplane_timings);
 }
 
+/* static */ int Framebuffer::lsb_levels() {
+  return sLsbLevels;
+}
+
+/* static */ int Framebuffer::PulseProfile(int lsb_step, int dither_bits) {
+  assert(lsb_step >= 0 && lsb_step < sLsbLevels);
+  assert(dither_bits >= sDitherBits
+         && dither_bits < sDitherBits + sDitherLevels);
+  return (sLsbLevels - 1 - lsb_step) * sDitherLevels
+    + (dither_bits - sDitherBits);
+}
+
 bool Framebuffer::SetPWMBits(uint8_t value) {
   if (value < 1 || value > kBitPlanes)
     return false;
@@ -365,6 +570,11 @@ inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
                             + column ];
 }
 
+inline gpio_bits_t *Framebuffer::OutputWordsAt(int double_row, int bit) {
+  return &output_words_[2 * (double_row * (columns_ * kBitPlanes)
+                             + bit * columns_)];
+}
+
 void Framebuffer::Clear() {
   if (inverse_color_) {
     Fill(0, 0, 0);
@@ -372,32 +582,28 @@ void Framebuffer::Clear() {
     // Cheaper.
     memset(bitplane_buffer_, 0,
            sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+    MarkModified();
   }
 }
 
-// Do CIE1931 luminance correction and scale to output bitplanes
-static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
-  float out_factor = ((1 << kBitPlanes) - 1);
-  float v = (float) c * brightness / 255.0;
-  return out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
-}
-
-struct ColorLookup {
-  uint16_t color[256];
-};
-static ColorLookup *CreateLuminanceCIE1931LookupTable() {
-  ColorLookup *for_brightness = new ColorLookup[100];
-  for (int c = 0; c < 256; ++c)
-    for (int b = 0; b < 100; ++b)
-      for_brightness[b].color[c] = luminance_cie1931(c, b + 1);
+static constexpr double Cube(double x) { return x * x * x; }
 
-  return for_brightness;
+// Do CIE1931 luminance correction and scale to output bitplanes. Cubing
+// gives exactly what pow(..., 3) did, and can be done by the compiler.
+static constexpr uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
+  const float out_factor = ((1 << kBitPlanes) - 1);
+  const float v = (float) c * brightness / 255.0;
+  return out_factor * ((v <= 8) ? v / 902.3 : Cube((v + 16) / 116.0));
 }
 
-static inline uint16_t CIEMapColor(uint8_t brightness, uint8_t c) {
-  static ColorLookup *luminance_lookup = CreateLuminanceCIE1931LookupTable();
-  return luminance_lookup[brightness - 1].color[c];
-}
+// The table for full brightness, the usual case, built at compile time.
+struct FullBrightnessCIE1931 {
+  constexpr FullBrightnessCIE1931() : value() {
+    for (int c = 0; c < 256; ++c) value[c] = luminance_cie1931(c, 100);
+  }
+  uint16_t value[256];
+};
+static constexpr FullBrightnessCIE1931 kFullBrightnessCIE1931;
 
 // Non luminance correction. TODO: consider getting rid of this.
 static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
@@ -408,30 +614,85 @@ static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
   return (shift > 0) ? (c << shift) : (c >> -shift);
 }
 
-inline void Framebuffer::MapColors(
-  uint8_t r, uint8_t g, uint8_t b,
-  uint16_t *red, uint16_t *green, uint16_t *blue) {
+void Framebuffer::set_luminance_correct(bool on) {
+  do_luminance_correct_ = on;
+  RebuildColorTables();
+}
 
-  if (do_luminance_correct_) {
-    *red   = CIEMapColor(brightness_, r);
-    *green = CIEMapColor(brightness_, g);
-    *blue  = CIEMapColor(brightness_, b);
-  } else {
-    *red   = DirectMapColor(brightness_, r);
-    *green = DirectMapColor(brightness_, g);
-    *blue  = DirectMapColor(brightness_, b);
+void Framebuffer::SetBrightness(uint8_t b) {
+  brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
+  RebuildColorTables();
+}
+
+void Framebuffer::SetWhiteBalance(int panel,
+                                  uint8_t red, uint8_t green, uint8_t blue) {
+  const WhiteBalance balance = { { std::min(red, (uint8_t) 100),
+                                   std::min(green, (uint8_t) 100),
+                                   std::min(blue, (uint8_t) 100) } };
+  if (panel < 0) {
+    white_balance_.assign(panels_, balance);
+  } else if (panel < panels_) {
+    white_balance_[panel] = balance;
   }
+  RebuildColorTables();
+}
 
-  if (inverse_color_) {
-    *red = ~(*red);
-    *green = ~(*green);
-    *blue = ~(*blue);
+bool ParseWhiteBalance(const char *spec, std::vector<uint8_t> *percents) {
+  for (;;) {
+    int r, g, b, consumed = 0;
+    if (sscanf(spec, "%d,%d,%d%n", &r, &g, &b, &consumed) != 3
+        || r < 0 || r > 100 || g < 0 || g > 100 || b < 0 || b > 100)
+      return false;
+    percents->push_back(r);
+    percents->push_back(g);
+    percents->push_back(b);
+    spec += consumed;
+    if (*spec == '\0') return true;
+    if (*spec++ != ';') return false;
+  }
+}
+
+void Framebuffer::RebuildColorTables() {
+  uint16_t base[256];
+  for (int c = 0; c < 256; ++c) {
+    if (!do_luminance_correct_) {
+      base[c] = DirectMapColor(brightness_, c);
+    } else if (brightness_ == 100) {
+      base[c] = kFullBrightnessCIE1931.value[c];
+    } else {
+      base[c] = luminance_cie1931(c, brightness_);
+    }
+  }
+
+  // Panels only need tables of their own if they are balanced differently.
+  bool uniform = true;
+  for (int p = 1; p < panels_; ++p) {
+    uniform &= (memcmp(&white_balance_[p], &white_balance_[0],
+                       sizeof(WhiteBalance)) == 0);
+  }
+
+  std::shared_ptr<std::vector<ColorTable> > next(
+    new std::vector<ColorTable>(uniform ? 1 : panels_));
+  std::vector<ColorTable> &tables = *next;
+  for (size_t p = 0; p < tables.size(); ++p) {
+    for (int ch = 0; ch < 3; ++ch) {
+      const int percent = white_balance_[p].percent[ch];
+      for (int c = 0; c < 256; ++c) {
+        uint16_t value = base[c];
+        if (percent != 100) value = value * percent / 100;
+        tables[p].channel[ch][c] = inverse_color_ ? ~value : value;
+      }
+    }
   }
+  std::atomic_store(&color_tables_, ColorTables(next));
 }
 
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
-  uint16_t red, green, blue;
-  MapColors(r, g, b, &red, &green, &blue);
+  const ColorTables held = color_tables();
+  const std::vector<ColorTable> &tables = *held;
+  const uint16_t red = tables[0].channel[0][r];
+  const uint16_t green = tables[0].channel[1][g];
+  const uint16_t blue = tables[0].channel[2][b];
   const PixelDesignator &fill = (*shared_mapper_)->GetFillColorBits();
 
   for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
@@ -448,19 +709,38 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
       }
     }
   }
+  MarkModified();
+
+  if (tables.size() > 1) {
+    // Panels balanced differently: the fill above was for the first one.
+    PixelDesignatorMap *const mapper = *shared_mapper_;
+    for (int y = 0; y < mapper->height(); ++y) {
+      for (int x = 0; x < mapper->width(); ++x) {
+        SetPixel(tables, x, y, r, g, b);
+      }
+    }
+  }
 }
 
 int Framebuffer::width() const { return (*shared_mapper_)->width(); }
 int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+  const ColorTables held = color_tables();
+  SetPixel(*held, x, y, r, g, b);
+}
+
+void Framebuffer::SetPixel(const std::vector<ColorTable> &tables,
+                           int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
   if (designator == NULL) return;
   const int pos = designator->gpio_word;
   if (pos < 0) return;  // non-used pixel marker.
 
-  uint16_t red, green, blue;
-  MapColors(r, g, b, &red, &green, &blue);
+  const ColorTable &table = tables[tables.size() > 1 ? designator->panel : 0];
+  const uint16_t red = table.channel[0][r];
+  const uint16_t green = table.channel[1][g];
+  const uint16_t blue = table.channel[2][b];
 
   uint32_t *bits = bitplane_buffer_ + pos;
   const int min_bit_plane = kBitPlanes - pwm_bits_;
@@ -477,6 +757,307 @@ void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
     *bits = (*bits & designator_mask) | color_bits;
     bits += columns_;
   }
+  MarkModified();
+}
+
+// Transpose the colors of four pixels into bitplanes: for each bitplane
+// starting at "min_bit_plane", planes[b] receives the gpio bits each of the
+// four pixels needs set in that plane.
+static inline void EncodeQuad(const uint32_t *red, const uint32_t *green,
+                              const uint32_t *blue,
+                              const uint32_t *r_bits, const uint32_t *g_bits,
+                              const uint32_t *b_bits,
+                              int min_bit_plane, uint32_t planes[][4]) {
+#if defined(FB_ENCODE_NEON)
+  const uint32x4_t r = vld1q_u32(red);
+  const uint32x4_t g = vld1q_u32(green);
+  const uint32x4_t b = vld1q_u32(blue);
+  const uint32x4_t rb = vld1q_u32(r_bits);
+  const uint32x4_t gb = vld1q_u32(g_bits);
+  const uint32x4_t bb = vld1q_u32(b_bits);
+  for (int plane = min_bit_plane; plane < kBitPlanes; ++plane) {
+    const uint32x4_t mask = vdupq_n_u32(1 << plane);
+    uint32x4_t bits = vandq_u32(vtstq_u32(r, mask), rb);
+    bits = vorrq_u32(bits, vandq_u32(vtstq_u32(g, mask), gb));
+    bits = vorrq_u32(bits, vandq_u32(vtstq_u32(b, mask), bb));
+    vst1q_u32(planes[plane], bits);
+  }
+#elif defined(FB_ENCODE_SSE2)
+  const __m128i r = _mm_loadu_si128((const __m128i*) red);
+  const __m128i g = _mm_loadu_si128((const __m128i*) green);
+  const __m128i b = _mm_loadu_si128((const __m128i*) blue);
+  const __m128i rb = _mm_loadu_si128((const __m128i*) r_bits);
+  const __m128i gb = _mm_loadu_si128((const __m128i*) g_bits);
+  const __m128i bb = _mm_loadu_si128((const __m128i*) b_bits);
+  for (int plane = min_bit_plane; plane < kBitPlanes; ++plane) {
+    const __m128i mask = _mm_set1_epi32(1 << plane);
+    __m128i bits = _mm_and_si128(
+      _mm_cmpeq_epi32(_mm_and_si128(r, mask), mask), rb);
+    bits = _mm_or_si128(bits, _mm_and_si128(
+      _mm_cmpeq_epi32(_mm_and_si128(g, mask), mask), gb));
+    bits = _mm_or_si128(bits, _mm_and_si128(
+      _mm_cmpeq_epi32(_mm_and_si128(b, mask), mask), bb));
+    _mm_storeu_si128((__m128i*) planes[plane], bits);
+  }
+#else
+  for (int plane = min_bit_plane; plane < kBitPlanes; ++plane) {
+    const uint32_t mask = 1 << plane;
+    for (int i = 0; i < 4; ++i) {
+      uint32_t bits = 0;
+      if (red[i] & mask)   bits |= r_bits[i];
+      if (green[i] & mask) bits |= g_bits[i];
+      if (blue[i] & mask)  bits |= b_bits[i];
+      planes[plane][i] = bits;
+    }
+  }
+#endif
+}
+
+// Merge encoded bitplanes of four pixels that live in consecutive gpio words
+// (the common case without pixel mappers) into the bitplane buffer.
+static inline void MergeQuad(uint32_t *bits, const uint32_t *designator_mask,
+                             const uint32_t planes[][4],
+                             int min_bit_plane, int columns) {
+  bits += columns * min_bit_plane;
+#if defined(FB_ENCODE_NEON)
+  const uint32x4_t mask = vld1q_u32(designator_mask);
+  for (int plane = min_bit_plane; plane < kBitPlanes; ++plane) {
+    const uint32x4_t value = vorrq_u32(vandq_u32(vld1q_u32(bits), mask),
+                                       vld1q_u32(planes[plane]));
+    vst1q_u32(bits, value);
+    bits += columns;
+  }
+#elif defined(FB_ENCODE_SSE2)
+  const __m128i mask = _mm_loadu_si128((const __m128i*) designator_mask);
+  for (int plane = min_bit_plane; plane < kBitPlanes; ++plane) {
+    __m128i value = _mm_loadu_si128((const __m128i*) bits);
+    value = _mm_or_si128(_mm_and_si128(value, mask),
+                         _mm_loadu_si128((const __m128i*) planes[plane]));
+    _mm_storeu_si128((__m128i*) bits, value);
+    bits += columns;
+  }
+#else
+  for (int plane = min_bit_plane; plane < kBitPlanes; ++plane) {
+    for (int i = 0; i < 4; ++i) {
+      bits[i] = (bits[i] & designator_mask[i]) | planes[plane][i];
+    }
+    bits += columns;
+  }
+#endif
+}
+
+// Where EncodeRun() finds the pixel of designator "index": consecutive in a
+// row of the image, starting with designator "first"..
+struct RowPixels {
+  const uint8_t *row;
+  int first;
+  const uint8_t *operator()(int index) const {
+    return row + 4 * (index - first);
+  }
+};
+
+// ..or wherever the mappers put it, for the designators of an OutputOrder.
+struct MappedPixels {
+  const uint8_t *rgba;
+  int stride;
+  const int *x;
+  const int *y;
+  const uint8_t *operator()(int index) const {
+    return rgba + y[index] * stride + 4 * x[index];
+  }
+};
+
+// Encode the pixels of designators "index" .. index + count - 1 into the
+// bitplane buffer.
+// "tables" are one Framebuffer::ColorTable per panel, or a single one for all.
+template <class Pixels>
+static void EncodeRun(gpio_bits_t *buffer, int columns,
+                      const PixelDesignatorMap::DesignatorArrays &d,
+                      const std::vector<Framebuffer::ColorTable> &tables,
+                      int min_bit_plane,
+                      const Pixels &pixels, int index, int count) {
+  const Framebuffer::ColorTable *const table = tables.data();
+  const int *const panel = tables.size() > 1 ? d.panel : NULL;
+  uint32_t red[4] = {0}, green[4] = {0}, blue[4] = {0};
+  uint32_t planes[kBitPlanes][4];
+  for (const int end = index + count; index < end; index += 4) {
+    const int quad = std::min(4, end - index);
+    for (int i = 0; i < quad; ++i) {
+      const uint8_t *const pixel = pixels(index + i);
+      const uint16_t (&lookup)[3][256]
+        = table[panel ? panel[index + i] : 0].channel;
+      red[i]   = lookup[0][pixel[0]];
+      green[i] = lookup[1][pixel[1]];
+      blue[i]  = lookup[2][pixel[2]];
+    }
+    const uint32_t *r_bits = d.r_bit + index;
+    const uint32_t *g_bits = d.g_bit + index;
+    const uint32_t *b_bits = d.b_bit + index;
+    uint32_t tail_bits[3][4];
+    if (quad < 4) {
+      // Don't read past the end of the designator arrays.
+      memset(tail_bits, 0, sizeof(tail_bits));
+      std::copy(r_bits, r_bits + quad, tail_bits[0]);
+      std::copy(g_bits, g_bits + quad, tail_bits[1]);
+      std::copy(b_bits, b_bits + quad, tail_bits[2]);
+      r_bits = tail_bits[0];
+      g_bits = tail_bits[1];
+      b_bits = tail_bits[2];
+    }
+    EncodeQuad(red, green, blue, r_bits, g_bits, b_bits,
+               min_bit_plane, planes);
+
+    const int *const pos = d.gpio_word + index;
+    if (quad == 4 && pos[0] >= 0 && pos[1] == pos[0] + 1
+        && pos[2] == pos[0] + 2 && pos[3] == pos[0] + 3) {
+      MergeQuad(buffer + pos[0], d.mask + index, planes,
+                min_bit_plane, columns);
+      continue;
+    }
+    for (int i = 0; i < quad; ++i) {
+      if (pos[i] < 0) continue;  // non-used pixel marker.
+      const uint32_t designator_mask = d.mask[index + i];
+      uint32_t *bits = buffer + pos[i] + columns * min_bit_plane;
+      for (int plane = min_bit_plane; plane < kBitPlanes; ++plane) {
+        *bits = (*bits & designator_mask) | planes[plane][i];
+        bits += columns;
+      }
+    }
+  }
+}
+
+namespace {
+// SetPixels() of a rectangle, each thread encoding the runs of its part of
+// the double rows.
+class SetPixelsJob : public EncodePool::Job {
+public:
+  SetPixelsJob(gpio_bits_t *buffer, int columns,
+               const PixelDesignatorMap::DesignatorArrays &d,
+               const PixelDesignatorMap::Partition &partition,
+               const std::vector<Framebuffer::ColorTable> &tables,
+               int min_bit_plane, int map_width,
+               int x, int y, int width, int height,
+               const uint8_t *rgba, int stride)
+    : buffer_(buffer), columns_(columns), d_(d), partition_(partition),
+      tables_(tables), min_bit_plane_(min_bit_plane), map_width_(map_width),
+      x_(x), y_(y), width_(width), height_(height),
+      rgba_(rgba), stride_(stride) {}
+
+  virtual void RunPart(int part) {
+    const std::vector<PixelDesignatorMap::Run> &runs = partition_[part];
+    for (size_t i = 0; i < runs.size(); ++i) {
+      const int row = runs[i].index / map_width_;
+      if (row < y_ || row >= y_ + height_) continue;
+      const int run_x = runs[i].index - row * map_width_;
+      const int start = std::max(run_x, x_);
+      const int end = std::min(run_x + runs[i].length, x_ + width_);
+      if (start >= end) continue;
+      const RowPixels pixels = {
+        rgba_ + (row - y_) * stride_ + 4 * (start - x_),
+        row * map_width_ + start
+      };
+      EncodeRun(buffer_, columns_, d_, tables_, min_bit_plane_,
+                pixels, pixels.first, end - start);
+    }
+  }
+
+private:
+  gpio_bits_t *const buffer_;
+  const int columns_;
+  const PixelDesignatorMap::DesignatorArrays &d_;
+  const PixelDesignatorMap::Partition &partition_;
+  const std::vector<Framebuffer::ColorTable> &tables_;
+  const int min_bit_plane_;
+  const int map_width_;
+  const int x_, y_, width_, height_;
+  const uint8_t *const rgba_;
+  const int stride_;
+};
+
+// A whole frame in OutputOrder, each thread encoding its part of it.
+class OutputOrderJob : public EncodePool::Job {
+public:
+  OutputOrderJob(gpio_bits_t *buffer, int columns,
+                 const PixelDesignatorMap::OutputOrder &order,
+                 const std::vector<Framebuffer::ColorTable> &tables,
+                 int min_bit_plane, const uint8_t *rgba, int stride)
+    : buffer_(buffer), columns_(columns), order_(order), tables_(tables),
+      min_bit_plane_(min_bit_plane), rgba_(rgba), stride_(stride) {}
+
+  virtual void RunPart(int part) {
+    const MappedPixels pixels = {
+      rgba_, stride_, order_.x.data(), order_.y.data()
+    };
+    const int first = order_.part_start[part];
+    EncodeRun(buffer_, columns_, order_.designators, tables_, min_bit_plane_,
+              pixels, first, order_.part_start[part + 1] - first);
+  }
+
+private:
+  gpio_bits_t *const buffer_;
+  const int columns_;
+  const PixelDesignatorMap::OutputOrder &order_;
+  const std::vector<Framebuffer::ColorTable> &tables_;
+  const int min_bit_plane_;
+  const uint8_t *const rgba_;
+  const int stride_;
+};
+}  // namespace
+
+void Framebuffer::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgba, int stride) {
+  PixelDesignatorMap *const mapper = *shared_mapper_;
+  // Clip to the visible area.
+  if (x < 0) { rgba -= 4 * x; width += x; x = 0; }
+  if (y < 0) { rgba -= stride * y; height += y; y = 0; }
+  width = std::min(width, mapper->width() - x);
+  height = std::min(height, mapper->height() - y);
+  if (width <= 0 || height <= 0) return;
+
+  const PixelDesignatorMap::DesignatorArrays &d
+    = mapper->GetDesignatorArrays();
+  const ColorTables held = color_tables();
+  const std::vector<ColorTable> &tables = *held;
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+
+  const int parts = (encode_pool_ && width * height >= kMinPoolPixels)
+    ? encode_pool_->threads() : 1;
+
+  if (x == 0 && y == 0
+      && width == mapper->width() && height == mapper->height()) {
+    // A whole frame can be encoded in the order of the bitplane buffer.
+    const PixelDesignatorMap::OutputOrder &order
+      = mapper->GetOutputOrder(parts, columns_ * kBitPlanes, double_rows_);
+    if (order.scattered) {
+      OutputOrderJob job(bitplane_buffer_, columns_, order, tables,
+                         min_bit_plane, rgba, stride);
+      if (parts > 1) {
+        encode_pool_->Run(&job);
+      } else {
+        job.RunPart(0);
+      }
+      MarkModified();
+      return;
+    }
+  }
+
+  if (parts > 1) {
+    const PixelDesignatorMap::Partition &partition
+      = mapper->GetPartition(parts, columns_ * kBitPlanes, double_rows_);
+    SetPixelsJob job(bitplane_buffer_, columns_, d, partition, tables,
+                     min_bit_plane, mapper->width(),
+                     x, y, width, height, rgba, stride);
+    encode_pool_->Run(&job);
+  } else {
+    for (int row = 0; row < height; ++row) {
+      const RowPixels pixels = {
+        rgba + row * stride, (y + row) * mapper->width() + x
+      };
+      EncodeRun(bitplane_buffer_, columns_, d, tables, min_bit_plane,
+                pixels, pixels.first, width);
+    }
+  }
+  MarkModified();
 }
 
 // Strange LED-mappings such as RBG or so are handled here.
@@ -541,6 +1122,7 @@ void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
   }
 
   d->mask = ~(d->r_bit | d->g_bit | d->b_bit);
+  d->panel = (y / rows_) * (columns_ / panel_columns_) + x / panel_columns_;
 }
 
 void Framebuffer::Serialize(const char **data, size_t *len) const {
@@ -551,26 +1133,89 @@ void Framebuffer::Serialize(const char **data, size_t *len) const {
 bool Framebuffer::Deserialize(const char *data, size_t len) {
   if (len != buffer_size_) return false;
   memcpy(bitplane_buffer_, data, len);
+  MarkModified();
   return true;
 }
 
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
   memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+  MarkModified();
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
-  color_clk_mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel_ >= 2) {
-    color_clk_mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+void Framebuffer::BuildOutputWords(int first_double_row,
+                                   int end_double_row) {
+  const gpio_bits_t color_mask = color_clk_mask_ & ~hardware_mapping_->clock;
+  for (int row = first_double_row; row < end_double_row; ++row) {
+    for (int b = 0; b < kBitPlanes; ++b) {
+      const gpio_bits_t *row_data = ValueAt(row, 0, b);
+      gpio_bits_t *words = OutputWordsAt(row, b);
+      // We don't know what is on the wire before the first column, so write
+      // all of it. After that, only flip what changes; the clock is high
+      // from the previous column and always goes low.
+      gpio_bits_t previous = row_data[0] & color_mask;
+      words[0] = ~previous & color_clk_mask_;
+      words[1] = previous;
+      bool same_as_below = (b > 0);
+      const gpio_bits_t *below = same_as_below ? ValueAt(row, 0, b - 1) : NULL;
+      for (int col = 0; col < columns_; ++col) {
+        const gpio_bits_t out = row_data[col] & color_mask;
+        if (col > 0) {
+          words[2*col]     = (previous & ~out) | hardware_mapping_->clock;
+          words[2*col + 1] = out & ~previous;
+        }
+        if (same_as_below && out != (below[col] & color_mask))
+          same_as_below = false;
+        previous = out;
+      }
+      plane_repeats_[row * kBitPlanes + b] = same_as_below;
+    }
   }
-  if (parallel_ >= 3) {
-    color_clk_mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+}
+
+namespace {
+// BuildOutputWords() with each thread doing a range of double rows.
+class OutputWordsJob : public EncodePool::Job {
+public:
+  typedef void (Framebuffer::*Build)(int, int);
+  OutputWordsJob(Framebuffer *framebuffer, Build build,
+                 int double_rows, int parts)
+    : framebuffer_(framebuffer), build_(build),
+      double_rows_(double_rows), parts_(parts) {}
+
+  virtual void RunPart(int part) {
+    (framebuffer_->*build_)(part * double_rows_ / parts_,
+                            (part + 1) * double_rows_ / parts_);
+  }
+
+private:
+  Framebuffer *const framebuffer_;
+  const Build build_;
+  const int double_rows_;
+  const int parts_;
+};
+}  // namespace
+
+void Framebuffer::PrepareOutput() {
+  if (!output_dirty_.exchange(false, std::memory_order_acquire))
+    return;
+  if (encode_pool_ && height_ * columns_ >= kMinPoolPixels) {
+    OutputWordsJob job(this, &Framebuffer::BuildOutputWords,
+                       double_rows_, encode_pool_->threads());
+    encode_pool_->Run(&job);
+  } else {
+    BuildOutputWords(0, double_rows_);
   }
+}
 
-  color_clk_mask |= h.clock;
+void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit, int pulse_profile) {
+  const struct HardwareMapping &h = *hardware_mapping_;
+  // Usually done by PrepareOutput() before the frame was handed over; the
+  // refresh loop shouldn't wait on the encode pool.
+  if (output_dirty_.exchange(false, std::memory_order_acquire)) {
+    BuildOutputWords(0, double_rows_);
+  }
+  const int pulse_base = pulse_profile * kBitPlanes;
 
   // Depending if we do dithering, we might not always show the lowest bits.
   const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
@@ -593,15 +1238,15 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
     for (int b = start_bit; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
-      // While the output enable is still on, we can already clock in the next
-      // data.
-      for (int col = 0; col < columns_; ++col) {
-        const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
-        io->SetBits(h.clock);               // Rising edge: clock color in.
+      // Strobing latches the shift registers, but leaves their content as is.
+      // So if this bitplane looks like the previous one of the same row, it
+      // is already there.
+      if (b == start_bit || !plane_repeats_[d_row * kBitPlanes + b]) {
+        // While the output enable is still on, we can already clock in the
+        // next data.
+        io->ClockOutWords(OutputWordsAt(d_row, b), columns_, h.clock);
+        io->ClearBits(color_clk_mask_);    // clock back to normal.
       }
-      io->ClearBits(color_clk_mask);    // clock back to normal.
 
       // OE of the previous row-data must be finished before strobe.
       sOutputEnablePulser->WaitPulseFinished();
@@ -613,7 +1258,7 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
       io->ClearBits(h.strobe);
 
       // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
+      sOutputEnablePulser->SendPulse(pulse_base + b);
     }
   }
 }
@@ -0,0 +1,178 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "gpio-simulation.h"
+
+#include <assert.h>
+
+namespace rgb_matrix {
+// FNV-1a, one 32 bit word at a time.
+static inline uint32_t HashWord(uint32_t hash, uint32_t value) {
+  for (int i = 0; i < 4; ++i, value >>= 8) {
+    hash = (hash ^ (value & 0xff)) * 16777619u;
+  }
+  return hash;
+}
+static const uint32_t kHashStart = 2166136261u;
+
+bool GPIO::InitSimulation(GPIOSimulation *simulation, int slowdown) {
+  assert(simulation != NULL);
+  slowdown_ = slowdown;
+  simulation_ = simulation;
+  return true;
+}
+
+void GPIO::SimulateSetBits(uint32_t value) {
+  if (value) simulation_->SetBits(value, slowdown_);
+}
+
+void GPIO::SimulateClearBits(uint32_t value) {
+  if (value) simulation_->ClearBits(value, slowdown_);
+}
+
+void GPIO::SimulateClockOutWords(const uint32_t *words, int count,
+                                 uint32_t clock) {
+  for (int i = 0; i < count; ++i, words += 2) {
+    SimulateClearBits(words[0]);
+    SimulateSetBits(words[1]);
+    SimulateSetBits(clock);
+  }
+}
+
+class GPIOSimulation::Pulser : public PinPulser {
+public:
+  Pulser(GPIOSimulation *simulation, GPIO *io, uint32_t bits,
+         bool asynchronous, const std::vector<int> &nano_specs)
+    : simulation_(simulation), io_(io), bits_(bits),
+      asynchronous_(asynchronous), nano_specs_(nano_specs) {}
+
+  virtual void SendPulse(int time_spec_number) {
+    if (asynchronous_) {
+      // Like the PWM hardware: the pin is not touched by the CPU.
+      simulation_->StartPulse(time_spec_number, nano_specs_[time_spec_number],
+                              true);
+    } else {
+      io_->ClearBits(bits_);
+      simulation_->StartPulse(time_spec_number, nano_specs_[time_spec_number],
+                              false);
+      io_->SetBits(bits_);
+    }
+  }
+
+  virtual void WaitPulseFinished() { simulation_->FinishPulse(); }
+
+private:
+  GPIOSimulation *const simulation_;
+  GPIO *const io_;
+  const uint32_t bits_;
+  const bool asynchronous_;
+  const std::vector<int> nano_specs_;
+};
+
+GPIOSimulation::GPIOSimulation(const Signals &signals, int columns,
+                               int write_nanos)
+  : signals_(signals), write_nanos_(write_nanos), state_(0),
+    shift_register_(columns, 0), shift_head_(0),
+    latched_hash_(kHashStart), output_hash_(kHashStart),
+    nanos_(0), pulse_end_nanos_(0), last_pulse_nanos_(0), last_pulse_spec_(-1),
+    writes_(0), clock_edges_(0), strobes_(0), pulses_(0),
+    max_trace_(0) {
+  assert(columns > 0);
+}
+
+void GPIOSimulation::EnableTrace(size_t max_events) {
+  max_trace_ = max_events;
+  trace_.reserve(max_events);
+}
+
+uint64_t GPIOSimulation::plane_nanos(int bit) const {
+  return (bit >= 0 && bit < (int)plane_nanos_.size()) ? plane_nanos_[bit] : 0;
+}
+
+uint64_t GPIOSimulation::plane_pulses(int bit) const {
+  return (bit >= 0 && bit < (int)plane_pulses_.size()) ? plane_pulses_[bit] : 0;
+}
+
+void GPIOSimulation::Record(char op, uint32_t bits) {
+  if (trace_.size() >= max_trace_) return;
+  Event e = { nanos_, op, bits };
+  trace_.push_back(e);
+}
+
+void GPIOSimulation::SetBits(uint32_t value, int slowdown) {
+  ++writes_;
+  nanos_ += (uint64_t)write_nanos_ * (1 + slowdown);
+  Record('S', value);
+
+  const uint32_t rising = value & ~state_;
+  state_ |= value;
+  if (rising & signals_.clock) {
+    // The colors present at the rising edge are shifted in.
+    shift_register_[shift_head_] = state_ & signals_.color;
+    shift_head_ = (shift_head_ + 1) % shift_register_.size();
+    ++clock_edges_;
+  }
+  if (rising & signals_.strobe) {
+    // Shift register to the output latches.
+    uint32_t hash = kHashStart;
+    for (size_t i = 0; i < shift_register_.size(); ++i) {
+      hash = HashWord(hash, shift_register_[(shift_head_ + i)
+                                            % shift_register_.size()]);
+    }
+    latched_hash_ = hash;
+    ++strobes_;
+  }
+}
+
+void GPIOSimulation::ClearBits(uint32_t value, int slowdown) {
+  ++writes_;
+  nanos_ += (uint64_t)write_nanos_ * (1 + slowdown);
+  Record('C', value);
+  state_ &= ~value;
+}
+
+void GPIOSimulation::StartPulse(int spec, int nanos, bool asynchronous) {
+  FinishPulse();  // The hardware would wait for a previous pulse, too.
+  Record('P', spec);
+  if (last_pulse_spec_ >= 0) {
+    plane_nanos_[last_pulse_spec_] += nanos_ - last_pulse_nanos_;
+    ++plane_pulses_[last_pulse_spec_];
+  }
+  ++pulses_;
+
+  output_hash_ = HashWord(output_hash_, latched_hash_);
+  output_hash_ = HashWord(output_hash_, state_ & signals_.address);
+  output_hash_ = HashWord(output_hash_, spec);
+
+  last_pulse_nanos_ = nanos_;
+  last_pulse_spec_ = spec;
+  if (asynchronous) {
+    pulse_end_nanos_ = nanos_ + nanos;
+  } else {
+    nanos_ += nanos;
+  }
+}
+
+void GPIOSimulation::FinishPulse() {
+  if (pulse_end_nanos_ > nanos_) nanos_ = pulse_end_nanos_;
+}
+
+PinPulser *GPIOSimulation::CreatePinPulser(
+  GPIO *io, uint32_t gpio_mask, bool asynchronous,
+  const std::vector<int> &nano_wait_spec) {
+  plane_nanos_.assign(nano_wait_spec.size(), 0);
+  plane_pulses_.assign(nano_wait_spec.size(), 0);
+  return new Pulser(this, io, gpio_mask, asynchronous, nano_wait_spec);
+}
+}  // end namespace rgb_matrix
@@ -17,6 +17,7 @@
 #include <inttypes.h>
 
 #include "gpio.h"
+#include "gpio-simulation.h"
 
 #include <assert.h>
 #include <fcntl.h>
@@ -133,11 +134,17 @@ namespace rgb_matrix {
 );
 
 GPIO::GPIO() : output_bits_(0), input_bits_(0), reserved_bits_(0),
-               slowdown_(1), gpio_port_(NULL) {
+               slowdown_(1), gpio_port_(NULL), simulation_(NULL) {
 }
 
 uint32_t GPIO::InitOutputs(uint32_t outputs,
                            bool adafruit_pwm_transition_hack_needed) {
+  if (simulation_ != NULL) {
+    // Nothing to multiplex; just keep track of what is in use.
+    outputs &= kValidBits & ~(output_bits_ | input_bits_ | reserved_bits_);
+    output_bits_ |= outputs;
+    return outputs;
+  }
   if (gpio_port_ == NULL) {
     fprintf(stderr, "Attempt to init outputs but not yet Init()-ialized.\n");
     return 0;
@@ -174,6 +181,11 @@ uint32_t GPIO::InitOutputs(uint32_t outputs,
 }
 
 uint32_t GPIO::RequestInputs(uint32_t inputs) {
+  if (simulation_ != NULL) {
+    inputs &= kValidBits & ~(output_bits_ | input_bits_ | reserved_bits_);
+    input_bits_ |= inputs;
+    return inputs;
+  }
   if (gpio_port_ == NULL) {
     fprintf(stderr, "Attempt to init inputs but not yet Init()-ialized.\n");
     return 0;
@@ -595,6 +607,11 @@ private:
 PinPulser *PinPulser::Create(GPIO *io, uint32_t gpio_mask,
                              bool allow_hardware_pulsing,
                              const std::vector<int> &nano_wait_spec) {
+  if (io->simulation()) {
+    return io->simulation()->CreatePinPulser(io, gpio_mask,
+                                             allow_hardware_pulsing,
+                                             nano_wait_spec);
+  }
   if (!Timers::Init()) return NULL;
   if (allow_hardware_pulsing && HardwarePinPulser::CanHandle(gpio_mask)) {
     return new HardwarePinPulser(gpio_mask, nano_wait_spec);
@@ -15,7 +15,11 @@
 
 #include "graphics.h"
 #include "utf8-internal.h"
+#include <limits.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <functional>
 
 namespace rgb_matrix {
@@ -59,6 +63,175 @@ int VerticalDrawText(Canvas *c, const Font &font, int x, int y,
   return y - start_y;
 }
 
+namespace {
+// Where TextStrip renders its text. Without pixels, it only finds the extent
+// of what would be drawn.
+class StripCanvas : public Canvas {
+public:
+  StripCanvas(uint8_t *pixels, int left, int top, int width, int height)
+    : pixels_(pixels), left_(left), top_(top), width_(width), height_(height),
+      min_x_(INT_MAX), min_y_(INT_MAX), max_x_(INT_MIN), max_y_(INT_MIN) {}
+
+  virtual int width() const { return width_; }
+  virtual int height() const { return height_; }
+  virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+    const uint8_t rgba[4] = { red, green, blue, 0xff };
+    SetPixels(x, y, 1, 1, rgba, 0);
+  }
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgba, int stride) {
+    if (width <= 0 || height <= 0) return;
+    min_x_ = std::min(min_x_, x);
+    min_y_ = std::min(min_y_, y);
+    max_x_ = std::max(max_x_, x + width);
+    max_y_ = std::max(max_y_, y + height);
+    if (!pixels_) return;
+    // Relative to the strip; within it, as it was measured first.
+    x -= left_;
+    y -= top_;
+    for (int row = 0; row < height; ++row) {
+      memcpy(&pixels_[4 * ((y + row) * width_ + x)], rgba + row * stride,
+             4 * width);
+    }
+  }
+  virtual void Clear() {}
+  virtual void Fill(uint8_t, uint8_t, uint8_t) {}
+
+  bool empty() const { return max_x_ < min_x_; }
+  int min_x() const { return min_x_; }
+  int min_y() const { return min_y_; }
+  int max_x() const { return max_x_; }
+  int max_y() const { return max_y_; }
+
+private:
+  uint8_t *const pixels_;
+  const int left_, top_, width_, height_;
+  int min_x_, min_y_, max_x_, max_y_;
+};
+}  // namespace
+
+TextStrip::TextStrip()
+  : font_(NULL), has_background_(false), kerning_offset_(0),
+    advance_(0), left_(0), top_(0), width_(0), height_(0), opaque_(false) {}
+
+void TextStrip::SetText(const Font &font, const Color &color,
+                        const Color *background_color, const char *utf8_text,
+                        int kerning_offset) {
+  const Color background = background_color ? *background_color : Color();
+  if (font_ == &font && text_ == utf8_text
+      && kerning_offset_ == kerning_offset
+      && color_.r == color.r && color_.g == color.g && color_.b == color.b
+      && has_background_ == (background_color != NULL)
+      && background_color_.r == background.r
+      && background_color_.g == background.g
+      && background_color_.b == background.b) {
+    return;  // Rendered already.
+  }
+  font_ = &font;
+  text_ = utf8_text;
+  color_ = color;
+  background_color_ = background;
+  has_background_ = (background_color != NULL);
+  kerning_offset_ = kerning_offset;
+
+  // Measure, then draw into a strip of just the right size.
+  StripCanvas extent(NULL, 0, 0, 0, 0);
+  advance_ = DrawText(&extent, font, 0, 0, color, background_color,
+                      utf8_text, kerning_offset);
+  spans_.clear();
+  opaque_ = false;
+  if (extent.empty()) {
+    left_ = top_ = width_ = height_ = 0;
+    pixels_.clear();
+    return;
+  }
+  left_ = extent.min_x();
+  top_ = extent.min_y();
+  width_ = extent.max_x() - left_;
+  height_ = extent.max_y() - top_;
+  pixels_.assign(4 * width_ * height_, 0);
+  StripCanvas strip(&pixels_[0], left_, top_, width_, height_);
+  DrawText(&strip, font, 0, 0, color, background_color,
+           utf8_text, kerning_offset);
+
+  for (int y = 0; y < height_; ++y) {
+    const uint8_t *row = &pixels_[4 * y * width_];
+    for (int x = 0; x < width_; ++x) {
+      if (!row[4 * x + 3]) continue;
+      Span span = { x, y, 0 };
+      while (x < width_ && row[4 * x + 3]) ++x;
+      span.length = x - span.x;
+      spans_.push_back(span);
+    }
+  }
+  opaque_ = (spans_.size() == (size_t)height_);
+  for (size_t i = 0; opaque_ && i < spans_.size(); ++i) {
+    opaque_ = (spans_[i].length == width_);
+  }
+}
+
+void TextStrip::Draw(Canvas *c, int x, int y) const {
+  x += left_;
+  y += top_;
+  const int canvas_width = c->width();
+  if (x >= canvas_width || x + width_ <= 0) return;
+  const int stride = 4 * width_;
+  if (opaque_) {
+    // E.g. all glyphs with background color: one call.
+    c->SetPixels(x, y, width_, height_, &pixels_[0], stride);
+    return;
+  }
+  for (size_t i = 0; i < spans_.size(); ++i) {
+    const Span &s = spans_[i];
+    if (x + s.x >= canvas_width || x + s.x + s.length <= 0) continue;
+    c->SetPixels(x + s.x, y + s.y, s.length, 1,
+                 &pixels_[4 * (s.y * width_ + s.x)], stride);
+  }
+}
+
+void TextStrip::BlendRow(int row, int first, int end, int fraction) const {
+  // Column i of row_ is strip column first + i at 256 - "fraction", plus
+  // "fraction" of column first + i - 1 (either is transparent past an edge).
+  const uint8_t *const pixels = &pixels_[4 * row * width_];
+  const int keep = 256 - fraction;
+  for (int x = first; x < end; ++x) {
+    uint8_t *out = &row_[4 * (x - first)];
+    const uint8_t *here = (x < width_) ? &pixels[4 * x] : NULL;
+    const uint8_t *left = (x > 0) ? &pixels[4 * (x - 1)] : NULL;
+    for (int ch = 0; ch < 4; ++ch) {
+      const int value = (here ? here[ch] * keep : 0)
+        + (left ? left[ch] * fraction : 0);
+      out[ch] = (value + 128) >> 8;
+    }
+  }
+}
+
+void TextStrip::DrawSubpixel(Canvas *c, float x, int y) const {
+  const int whole = (int)floorf(x);
+  const int fraction = lrintf((x - whole) * 256);
+  if (fraction == 0 || fraction == 256) {
+    Draw(c, whole + fraction / 256, y);
+    return;
+  }
+  // Moved by a fraction, the strip covers one more column.
+  const int strip_x = whole + left_;
+  y += top_;
+  const int first = std::max(0, -strip_x);
+  const int end = std::min(width_ + 1, c->width() - strip_x);
+  if (first >= end) return;
+  row_.resize(4 * (end - first));
+  for (int row = 0; row < height_; ++row) {
+    BlendRow(row, first, end, fraction);
+    for (int i = 0; i < end - first; ++i) {
+      if (!row_[4 * i + 3]) continue;
+      const int start = i;
+      while (i < end - first && row_[4 * i + 3]) ++i;
+      c->SetPixels(strip_x + first + start, y + row, i - start, 1,
+                   &row_[4 * start], 0);
+    }
+  }
+}
+
 void DrawCircle(Canvas *c, int x0, int y0, int radius, const Color &color) {
   int x = radius, y = 0;
   int radiusError = 1 - x;
@@ -25,10 +25,14 @@
 #include <stdio.h>
 #include <sys/time.h>
 
+#include <atomic>
+
 #include "gpio.h"
 #include "thread.h"
+#include "encode-pool-internal.h"
 #include "framebuffer-internal.h"
 #include "multiplex-mappers-internal.h"
+#include "refresh-controller-internal.h"
 
 // Leave this in here for a while. Setting things from old defines.
 #if defined(ADAFRUIT_RGBMATRIX_HAT)
@@ -54,14 +58,21 @@ uint32_t GetMicrosecondCounter();
 
 using namespace internal;
 
+// The core the refresh thread is tied to: the last one of a Raspberry Pi 2
+// or later. Encode threads keep off it.
+static const int kRefreshCpu = 3;
+static const uint32_t kRefreshCpuMask = 1u << kRefreshCpu;
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::UpdateThread : public Thread {
 public:
   UpdateThread(GPIO *io, FrameCanvas *initial_frame,
-               int pwm_dither_bits, bool show_refresh)
-    : io_(io), show_refresh_(show_refresh), running_(true),
+               int pwm_dither_bits, bool show_refresh,
+               RefreshObserver *observer, RefreshController *controller)
+    : io_(io), show_refresh_(show_refresh), observer_(observer),
+      controller_(controller), running_(true),
       current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
+      requested_frame_multiple_(1), published_frame_(0) {
     pthread_cond_init(&frame_done_, NULL);
     pthread_cond_init(&input_change_, NULL);
     switch (pwm_dither_bits) {
@@ -80,9 +91,16 @@ public:
     }
   }
 
+  virtual ~UpdateThread() {
+    delete controller_;
+  }
+
   void Stop() {
-    MutexLock l(&running_mutex_);
-    running_ = false;
+    running_.store(false, std::memory_order_relaxed);
+  }
+
+  void SetObserver(RefreshObserver *observer) {
+    observer_.store(observer, std::memory_order_release);
   }
 
   virtual void Run() {
@@ -100,8 +118,25 @@ public:
     while (running()) {
       const uint32_t start_time_us = GetMicrosecondCounter();
 
-      current_frame_->framebuffer()
-        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
+      if (controller_) {
+        const RefreshController::Level &level = controller_->level();
+        current_frame_->framebuffer()
+          ->DumpToMatrix(io_, controller_->StartBit(low_bit_sequence),
+                         Framebuffer::PulseProfile(level.lsb_step,
+                                                   level.dither_bits));
+      } else {
+        current_frame_->framebuffer()
+          ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
+      }
+
+      // PublishFrame() exchange: if there is a fresh frame, take it and leave
+      // the one we just showed in its place for the producer to reuse.
+      if (published_frame_.load(std::memory_order_relaxed) & kFreshFrame) {
+        const uintptr_t newest = published_frame_.exchange(
+          reinterpret_cast<uintptr_t>(current_frame_),
+          std::memory_order_acq_rel);
+        current_frame_ = reinterpret_cast<FrameCanvas*>(newest & ~kFreshFrame);
+      }
 
       // SwapOnVSync() exchange.
       {
@@ -138,6 +173,18 @@ public:
       }
 #endif
       const uint32_t end_time_us = GetMicrosecondCounter();
+      RefreshObserver *const observer =
+        observer_.load(std::memory_order_acquire);
+      if (observer) {
+        observer->OnRefresh(end_time_us - start_time_us);
+      }
+      if (controller_
+          && controller_->Update(end_time_us - start_time_us, end_time_us)
+          && show_refresh_) {
+        const RefreshController::Level &level = controller_->level();
+        printf("\n%d PWM bits, %d dither bits, LSB/%d\n",
+               level.pwm_bits, level.dither_bits, 1 << level.lsb_step);
+      }
       if (show_refresh_) {
         uint32_t usec = end_time_us - start_time_us;
         printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
@@ -160,6 +207,17 @@ public:
     return previous;
   }
 
+  // Lock-free triple buffering: "other" becomes the newest published frame.
+  // Returns the frame it replaced, which is not on screen: either an older
+  // published frame the refresh thread never picked up, or the frame it
+  // showed before the latest pick-up. NULL the first time.
+  FrameCanvas *PublishFrame(FrameCanvas *other) {
+    const uintptr_t previous = published_frame_.exchange(
+      reinterpret_cast<uintptr_t>(other) | kFreshFrame,
+      std::memory_order_acq_rel);
+    return reinterpret_cast<FrameCanvas*>(previous & ~kFreshFrame);
+  }
+
   uint32_t AwaitInputChange(int timeout_ms) {
     MutexLock l(&input_sync_);
     input_sync_.WaitOn(&input_change_, timeout_ms);
@@ -168,16 +226,20 @@ public:
 
 private:
   inline bool running() {
-    MutexLock l(&running_mutex_);
-    return running_;
+    return running_.load(std::memory_order_relaxed);
   }
 
+  // Tag in published_frame_ telling that the frame was not picked up yet.
+  // FrameCanvas pointers are aligned, so the lowest bit is free.
+  static const uintptr_t kFreshFrame = 1;
+
   GPIO *const io_;
   const bool show_refresh_;
+  std::atomic<RefreshObserver*> observer_;
+  RefreshController *const controller_;  // NULL: fixed settings.
   uint32_t start_bit_[4];
 
-  Mutex running_mutex_;
-  bool running_;
+  std::atomic<bool> running_;
 
   Mutex input_sync_;
   pthread_cond_t input_change_;
@@ -188,6 +250,8 @@ private:
   FrameCanvas *current_frame_;
   FrameCanvas *next_frame_;
   unsigned requested_frame_multiple_;
+
+  std::atomic<uintptr_t> published_frame_;
 };
 
 // Some defaults. See options-initialize.cc for the command line parsing.
@@ -210,7 +274,11 @@ RGBMatrix::Options::Options() :
 #endif
 
   pwm_dither_bits(0),
+  refresh_target_hz(0), min_pwm_bits(7), max_pwm_dither_bits(2),
+  min_pwm_lsb_nanoseconds(0),
+  encode_threads(1),
   brightness(100),
+  white_balance(NULL),
 
 #ifdef RGB_SCAN_INTERLACED
     scan_mode(1),
@@ -245,8 +313,13 @@ RGBMatrix::Options::Options() :
 }
 
 RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(options), io_(NULL), updater_(NULL), refresh_observer_(NULL),
+    shared_pixel_mapper_(NULL), encode_pool_(NULL) {
   assert(params_.Validate(NULL));
+  if (params_.encode_threads > 1) {
+    // Anywhere but the core the refresh thread is tied to.
+    encode_pool_ = new EncodePool(params_.encode_threads, ~kRefreshCpuMask);
+  }
   const MultiplexMapper *multiplex_mapper = NULL;
   if (params_.multiplexing > 0) {
     const MuxMapperList &multiplexers = GetRegisteredMultiplexMappers();
@@ -263,7 +336,19 @@ RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
   }
 
   Framebuffer::InitHardwareMapping(params_.hardware_mapping);
+  white_balance_.assign(3 * params_.parallel * params_.chain_length, 100);
   active_ = CreateFrameCanvas();
+  if (params_.white_balance != NULL) {
+    std::vector<uint8_t> percents;
+    internal::ParseWhiteBalance(params_.white_balance, &percents);
+    if (percents.size() == 3) {
+      SetWhiteBalance(-1, percents[0], percents[1], percents[2]);
+    } else {
+      for (size_t i = 0; i + 2 < percents.size(); i += 3) {
+        SetWhiteBalance(i / 3, percents[i], percents[i+1], percents[i+2]);
+      }
+    }
+  }
   Clear();
   SetGPIO(io, true);
 
@@ -277,12 +362,14 @@ RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
 
 RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
                      int parallel_displays)
-  : params_(Options()), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(Options()), io_(NULL), updater_(NULL), refresh_observer_(NULL),
+    shared_pixel_mapper_(NULL), encode_pool_(NULL) {
   params_.rows = rows;
   params_.chain_length = chained_displays;
   params_.parallel = parallel_displays;
   assert(params_.Validate(NULL));
   Framebuffer::InitHardwareMapping(params_.hardware_mapping);
+  white_balance_.assign(3 * params_.parallel * params_.chain_length, 100);
   active_ = CreateFrameCanvas();
   Clear();
   SetGPIO(io, true);
@@ -301,6 +388,7 @@ RGBMatrix::~RGBMatrix() {
     delete created_frames_[i];
   }
   delete shared_pixel_mapper_;
+  delete encode_pool_;
 }
 
 void RGBMatrix::ApplyNamedPixelMappers(const char *pixel_mapper_config,
@@ -331,10 +419,14 @@ void RGBMatrix::ApplyNamedPixelMappers(const char *pixel_mapper_config,
 void RGBMatrix::SetGPIO(GPIO *io, bool start_thread) {
   if (io != NULL && io_ == NULL) {
     io_ = io;
+    // With a refresh target, prepare the pulses it may switch to.
+    const bool adaptive = params_.refresh_target_hz > 0;
     Framebuffer::InitGPIO(io_, params_.rows, params_.parallel,
                           !params_.disable_hardware_pulsing,
                           params_.pwm_lsb_nanoseconds, params_.pwm_dither_bits,
-                          params_.row_address_type);
+                          params_.row_address_type,
+                          adaptive ? params_.min_pwm_lsb_nanoseconds : 0,
+                          adaptive ? params_.max_pwm_dither_bits : 0);
   }
   if (start_thread) {
     StartRefresh();
@@ -343,8 +435,18 @@ void RGBMatrix::SetGPIO(GPIO *io, bool start_thread) {
 
 bool RGBMatrix::StartRefresh() {
   if (updater_ == NULL && io_ != NULL) {
+    RefreshController *controller = NULL;
+    if (params_.refresh_target_hz > 0) {
+      controller = new RefreshController(params_.refresh_target_hz,
+                                         params_.pwm_bits,
+                                         params_.min_pwm_bits,
+                                         params_.pwm_dither_bits,
+                                         params_.max_pwm_dither_bits,
+                                         Framebuffer::lsb_levels());
+    }
     updater_ = new UpdateThread(io_, active_, params_.pwm_dither_bits,
-                                params_.show_refresh_rate);
+                                params_.show_refresh_rate, refresh_observer_,
+                                controller);
     // If we have multiple processors, the kernel
     // jumps around between these, creating some global flicker.
     // So let's tie it to the last CPU available.
@@ -352,7 +454,7 @@ bool RGBMatrix::StartRefresh() {
     //   core #3 will succeed.
     // The Raspberry Pi1 only has one core, so this affinity
     //   call will simply fail and we keep using the only core.
-    updater_->Start(99, (1<<3));  // Prio: high. Also: put on last CPU.
+    updater_->Start(99, kRefreshCpuMask);  // Prio: high. Also: put on last CPU.
   }
   return updater_ != NULL;
 }
@@ -365,7 +467,8 @@ FrameCanvas *RGBMatrix::CreateFrameCanvas() {
                                     params_.scan_mode,
                                     params_.led_rgb_sequence,
                                     params_.inverse_colors,
-                                    &shared_pixel_mapper_));
+                                    &shared_pixel_mapper_,
+                                    params_.cols));
   if (created_frames_.empty()) {
     // First time. Get defaults from initial Framebuffer.
     do_luminance_correct_ = result->framebuffer()->luminance_correct();
@@ -374,6 +477,15 @@ FrameCanvas *RGBMatrix::CreateFrameCanvas() {
   result->framebuffer()->SetPWMBits(params_.pwm_bits);
   result->framebuffer()->set_luminance_correct(do_luminance_correct_);
   result->framebuffer()->SetBrightness(params_.brightness);
+  for (size_t i = 0; i + 2 < white_balance_.size(); i += 3) {
+    if (white_balance_[i] != 100 || white_balance_[i+1] != 100
+        || white_balance_[i+2] != 100) {
+      result->framebuffer()->SetWhiteBalance(i / 3, white_balance_[i],
+                                             white_balance_[i+1],
+                                             white_balance_[i+2]);
+    }
+  }
+  result->framebuffer()->set_encode_pool(encode_pool_);
 
   created_frames_.push_back(result);
   return result;
@@ -382,11 +494,28 @@ FrameCanvas *RGBMatrix::CreateFrameCanvas() {
 FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
                                     unsigned frame_fraction) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
+  if (other && other != active_) other->framebuffer()->PrepareOutput();
   FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction);
   if (other) active_ = other;
   return previous;
 }
 
+FrameCanvas *RGBMatrix::PublishFrame(FrameCanvas *other) {
+  if (other != active_) other->framebuffer()->PrepareOutput();
+  FrameCanvas *free_frame = updater_->PublishFrame(other);
+  active_ = other;
+  if (free_frame == NULL) {
+    // First time around: this is where the third buffer comes from.
+    free_frame = CreateFrameCanvas();
+  }
+  return free_frame;
+}
+
+void RGBMatrix::SetRefreshObserver(RefreshObserver *observer) {
+  refresh_observer_ = observer;
+  if (updater_) updater_->SetObserver(observer);
+}
+
 uint32_t RGBMatrix::AwaitInputChange(int timeout_ms) {
   if (!updater_) return 0;
   return updater_->AwaitInputChange(timeout_ms);
@@ -421,6 +550,21 @@ uint8_t RGBMatrix::brightness() {
   return params_.brightness;
 }
 
+void RGBMatrix::SetWhiteBalance(int panel,
+                                uint8_t red, uint8_t green, uint8_t blue) {
+  const int panels = white_balance_.size() / 3;
+  if (panel >= panels) return;
+  for (int p = (panel < 0 ? 0 : panel); p < (panel < 0 ? panels : panel + 1);
+       ++p) {
+    white_balance_[3*p] = red;
+    white_balance_[3*p + 1] = green;
+    white_balance_[3*p + 2] = blue;
+  }
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    created_frames_[i]->framebuffer()->SetWhiteBalance(panel, red, green, blue);
+  }
+}
+
 // -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
 int RGBMatrix::width() const {
   return active_->width();
@@ -434,6 +578,11 @@ void RGBMatrix::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue)
   active_->SetPixel(x, y, red, green, blue);
 }
 
+void RGBMatrix::SetPixels(int x, int y, int width, int height,
+                          const uint8_t *rgba, int stride) {
+  active_->SetPixels(x, y, width, height, rgba, stride);
+}
+
 void RGBMatrix::Clear() {
   active_->Clear();
 }
@@ -557,6 +706,10 @@ void FrameCanvas::SetPixel(int x, int y,
                          uint8_t red, uint8_t green, uint8_t blue) {
   frame_->SetPixel(x, y, red, green, blue);
 }
+void FrameCanvas::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgba, int stride) {
+  frame_->SetPixels(x, y, width, height, rgba, stride);
+}
 void FrameCanvas::Clear() { return frame_->Clear(); }
 void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
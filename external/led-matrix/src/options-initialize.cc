@@ -25,6 +25,7 @@
 
 #include <vector>
 
+#include "framebuffer-internal.h"
 #include "multiplex-mappers-internal.h"
 
 namespace rgb_matrix {
@@ -150,6 +151,9 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeStringFlag("pixel-mapper", it, end,
                             &mopts->pixel_mapper_config, &err))
         continue;
+      if (ConsumeStringFlag("white-balance", it, end,
+                            &mopts->white_balance, &err))
+        continue;
       if (ConsumeIntFlag("rows", it, end, &mopts->rows, &err))
         continue;
       if (ConsumeIntFlag("cols", it, end, &mopts->cols, &err))
@@ -172,6 +176,21 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeIntFlag("pwm-dither-bits", it, end,
                          &mopts->pwm_dither_bits, &err))
         continue;
+      if (ConsumeIntFlag("refresh-target", it, end,
+                         &mopts->refresh_target_hz, &err))
+        continue;
+      if (ConsumeIntFlag("min-pwm-bits", it, end,
+                         &mopts->min_pwm_bits, &err))
+        continue;
+      if (ConsumeIntFlag("max-pwm-dither-bits", it, end,
+                         &mopts->max_pwm_dither_bits, &err))
+        continue;
+      if (ConsumeIntFlag("min-pwm-lsb-nanoseconds", it, end,
+                         &mopts->min_pwm_lsb_nanoseconds, &err))
+        continue;
+      if (ConsumeIntFlag("encode-threads", it, end,
+                         &mopts->encode_threads, &err))
+        continue;
       if (ConsumeIntFlag("row-addr-type", it, end,
                          &mopts->row_address_type, &err))
         continue;
@@ -330,6 +349,10 @@ RGBMatrix *CreateMatrixFromOptions(const RGBMatrix::Options &options,
   return result;
 }
 
+bool DropPrivileges() {
+  return drop_privs("daemon", "daemon");
+}
+
 static std::string CreateAvailableMultiplexString(
   const internal::MuxMapperList &m) {
   std::string result;
@@ -386,6 +409,8 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "\t                            Available: %s. Default: \"\"\n"
           "\t--led-pwm-bits=<1..11>    : PWM bits (Default: %d).\n"
           "\t--led-brightness=<percent>: Brightness in percent (Default: %d).\n"
+          "\t--led-white-balance=<r>,<g>,<b>[;...] : Percent per color, for "
+          "all panels or one per panel.\n"
           "\t--led-scan-mode=<0..1>    : 0 = progressive; 1 = interlaced "
           "(Default: %d).\n"
           "\t--led-row-addr-type=<0..2>: 0 = default; 1 = AB-addressed panels; 2 = direct row select"
@@ -399,6 +424,16 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "(Default: %d)\n"
           "\t--led-pwm-dither-bits=<0..2> : Time dithering of lower bits "
           "(Default: 0)\n"
+          "\t--led-refresh-target=<Hz> : Refresh rate to hold by lowering the "
+          "settings below (Default: 0, off)\n"
+          "\t--led-min-pwm-bits=<1..11> : ..down to these PWM bits "
+          "(Default: %d)\n"
+          "\t--led-max-pwm-dither-bits=<0..2> : ..up to these dither bits "
+          "(Default: %d)\n"
+          "\t--led-min-pwm-lsb-nanoseconds : ..halving the LSB time down to this "
+          "(Default: 0, keep)\n"
+          "\t--led-encode-threads=<1..4> : Threads converting large frames "
+          "into bitplanes (Default: %d)\n"
           "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n",
           d.hardware_mapping,
           d.rows, d.cols, d.chain_length, d.parallel,
@@ -408,6 +443,7 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           d.show_refresh_rate ? "no-" : "", d.show_refresh_rate ? "Don't s" : "S",
           d.inverse_colors ? "no-" : "",    d.inverse_colors ? "off" : "on",
           d.pwm_lsb_nanoseconds,
+          d.min_pwm_bits, d.max_pwm_dither_bits, d.encode_threads,
           !d.disable_hardware_pulsing ? "no-" : "",
           !d.disable_hardware_pulsing ? "Don't u" : "U");
 
@@ -474,6 +510,18 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  if (white_balance != NULL) {
+    std::vector<uint8_t> percents;
+    if (!internal::ParseWhiteBalance(white_balance, &percents)) {
+      err->append("Invalid white-balance; expected percentages "
+                  "<r>,<g>,<b>[;<r>,<g>,<b>...].\n");
+      success = false;
+    } else if (percents.size() > 3 * (size_t) (chain_length * parallel)) {
+      err->append("More white-balance entries than panels.\n");
+      success = false;
+    }
+  }
+
   if (pwm_bits <= 0 || pwm_bits > 11) {
     err->append("Invalid range of pwm-bits (1..11 allowed).\n");
     success = false;
@@ -494,6 +542,33 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  if (refresh_target_hz < 0 || refresh_target_hz > 100000) {
+    err->append("Invalid refresh target (0..100000 Hz allowed).\n");
+    success = false;
+  }
+
+  if (min_pwm_bits <= 0 || min_pwm_bits > 11) {
+    err->append("Invalid range of min-pwm-bits (1..11 allowed).\n");
+    success = false;
+  }
+
+  if (max_pwm_dither_bits < 0 || max_pwm_dither_bits > 2) {
+    err->append("Invalid range of max-pwm-dither-bits (0..2 allowed).\n");
+    success = false;
+  }
+
+  if (min_pwm_lsb_nanoseconds != 0
+      && (min_pwm_lsb_nanoseconds < 50 || min_pwm_lsb_nanoseconds > 3000)) {
+    err->append("Invalid range of min-pwm-lsb-nanoseconds "
+                "(0 or 50..3000 allowed).\n");
+    success = false;
+  }
+
+  if (encode_threads < 1 || encode_threads > 4) {
+    err->append("Invalid range of encode-threads (1..4 allowed).\n");
+    success = false;
+  }
+
   if (led_rgb_sequence == NULL || strlen(led_rgb_sequence) != 3) {
     err->append("led-sequence needs to be three characters long.\n");
     success = false;
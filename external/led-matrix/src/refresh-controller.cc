@@ -0,0 +1,112 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "refresh-controller-internal.h"
+
+#include <assert.h>
+
+#include <algorithm>
+
+namespace rgb_matrix {
+namespace internal {
+static const int kMaxPWMBits = 11;
+
+// Lowest bitplane shown, per dither bits and refresh modulo 4.
+static const int kDitherStartBits[3][4] = {
+  { 0, 0, 0, 0 },
+  { 0, 1, 0, 1 },
+  { 0, 1, 2, 2 },
+};
+
+static const uint32_t kWindowUsec = 250 * 1000;
+// Step up only if refreshes are this much faster than the target: the next
+// level up is slower.
+static const uint32_t kHeadroomPercent = 80;
+static const uint32_t kMinHoldoffUsec = 2 * 1000 * 1000;
+static const uint32_t kMaxHoldoffUsec = 64 * 1000 * 1000;
+
+RefreshController::RefreshController(int target_hz,
+                                     int pwm_bits, int min_pwm_bits,
+                                     int dither_bits, int max_dither_bits,
+                                     int lsb_levels)
+  : target_usec_(1000000 / target_hz), current_(0),
+    window_start_usec_(0), window_refreshes_(0), window_usec_(0),
+    last_change_usec_(0), holdoff_usec_(kMinHoldoffUsec), stepped_up_(false) {
+  assert(target_hz > 0);
+  min_pwm_bits = std::min(min_pwm_bits, pwm_bits);
+  max_dither_bits = std::max(std::min(max_dither_bits, 2), dither_bits);
+
+  Level level = { pwm_bits, dither_bits, 0 };
+  ladder_.push_back(level);
+  while (level.dither_bits < max_dither_bits) {
+    ++level.dither_bits;
+    ladder_.push_back(level);
+  }
+  while (level.pwm_bits > min_pwm_bits) {
+    --level.pwm_bits;
+    ladder_.push_back(level);
+  }
+  while (level.lsb_step < lsb_levels - 1) {
+    ++level.lsb_step;
+    ladder_.push_back(level);
+  }
+}
+
+int RefreshController::StartBit(unsigned sequence) const {
+  const Level &l = level();
+  return std::max(kDitherStartBits[l.dither_bits][sequence % 4],
+                  kMaxPWMBits - l.pwm_bits);
+}
+
+bool RefreshController::Update(uint32_t refresh_usec, uint32_t now_usec) {
+  if (window_refreshes_ == 0) window_start_usec_ = now_usec;
+  ++window_refreshes_;
+  window_usec_ += refresh_usec;
+  if (now_usec - window_start_usec_ < kWindowUsec) return false;
+
+  const uint64_t mean_usec = window_usec_ / window_refreshes_;
+  window_refreshes_ = 0;
+  window_usec_ = 0;
+
+  const size_t before = current_;
+  if (mean_usec > target_usec_) {
+    Step(+1, now_usec);
+  } else if (mean_usec * 100 < (uint64_t)target_usec_ * kHeadroomPercent
+             && now_usec - last_change_usec_ >= holdoff_usec_) {
+    Step(-1, now_usec);
+  } else if (now_usec - last_change_usec_ >= kMaxHoldoffUsec) {
+    holdoff_usec_ = kMinHoldoffUsec;  // Settled; be quick again next time.
+  }
+  return current_ != before;
+}
+
+void RefreshController::Step(int direction, uint32_t now_usec) {
+  if (direction > 0) {
+    if (current_ + 1 >= ladder_.size()) return;  // As fast as allowed.
+    ++current_;
+    // The step up before this one didn't hold: wait longer next time.
+    if (stepped_up_ && now_usec - last_change_usec_ < holdoff_usec_) {
+      holdoff_usec_ = std::min(2 * holdoff_usec_, kMaxHoldoffUsec);
+    }
+    stepped_up_ = false;
+  } else {
+    if (current_ == 0) return;  // Configured quality.
+    --current_;
+    stepped_up_ = true;
+  }
+  last_change_usec_ = now_usec;
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
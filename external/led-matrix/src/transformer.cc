@@ -154,6 +154,130 @@ void LinkedTransformer::DeleteTransformers() {
   list_.clear();
 }
 
+/************************/
+/* Compiled Transformer */
+/************************/
+namespace {
+// Remembers where the last SetPixel() went.
+class LocationRecorder : public Canvas {
+public:
+  LocationRecorder(int width, int height) : width_(width), height_(height) {}
+
+  virtual int width() const { return width_; }
+  virtual int height() const { return height_; }
+  virtual void SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+    if (x < 0 || y < 0 || x >= width_ || y >= height_) return;
+    last_x_ = x;
+    last_y_ = y;
+  }
+  virtual void Clear() {}
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {}
+
+  int last_x_, last_y_;  // -1 if none.
+
+private:
+  const int width_;
+  const int height_;
+};
+}  // anonymous namespace
+
+class CompiledTransformer::TransformCanvas : public Canvas {
+public:
+  TransformCanvas() : delegatee_(NULL), width_(0), height_(0),
+                      output_width_(-1), output_height_(-1) {}
+
+  void SetDelegatee(Canvas *delegatee, CanvasTransformer *transformer);
+  void Invalidate() { output_width_ = output_height_ = -1; }
+
+  virtual int width() const { return width_; }
+  virtual int height() const { return height_; }
+  virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgba, int stride);
+  virtual void Clear() { delegatee_->Clear(); }
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {
+    delegatee_->Fill(red, green, blue);
+  }
+
+private:
+  Canvas *delegatee_;
+  int width_;
+  int height_;
+  int output_width_;
+  int output_height_;
+  // Per pixel of this canvas, where it goes on the output; x = -1 if nowhere.
+  struct Target {
+    int x, y;
+  };
+  std::vector<Target> table_;
+};
+
+void CompiledTransformer::TransformCanvas::SetDelegatee(
+  Canvas *delegatee, CanvasTransformer *transformer) {
+  delegatee_ = delegatee;
+  if (delegatee->width() == output_width_
+      && delegatee->height() == output_height_)
+    return;
+
+  output_width_ = delegatee->width();
+  output_height_ = delegatee->height();
+  LocationRecorder recorder(output_width_, output_height_);
+  Canvas *mapped = transformer->Transform(&recorder);
+  width_ = mapped->width();
+  height_ = mapped->height();
+  table_.resize(width_ * height_);
+  for (int y = 0; y < height_; ++y) {
+    for (int x = 0; x < width_; ++x) {
+      recorder.last_x_ = recorder.last_y_ = -1;
+      mapped->SetPixel(x, y, 0, 0, 0);
+      table_[y * width_ + x].x = recorder.last_x_;
+      table_[y * width_ + x].y = recorder.last_y_;
+    }
+  }
+}
+
+void CompiledTransformer::TransformCanvas::SetPixel(
+  int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+  if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+  const Target &target = table_[y * width_ + x];
+  if (target.x < 0) return;
+  delegatee_->SetPixel(target.x, target.y, red, green, blue);
+}
+
+void CompiledTransformer::TransformCanvas::SetPixels(
+  int x, int y, int width, int height, const uint8_t *rgba, int stride) {
+  for (int row = 0; row < height; ++row) {
+    if (y + row < 0 || y + row >= height_) continue;
+    const uint8_t *pixel = rgba + row * stride;
+    for (int col = 0; col < width; ++col, pixel += 4) {
+      if (x + col < 0 || x + col >= width_) continue;
+      const Target &target = table_[(y + row) * width_ + x + col];
+      if (target.x < 0) continue;
+      delegatee_->SetPixel(target.x, target.y, pixel[0], pixel[1], pixel[2]);
+    }
+  }
+}
+
+CompiledTransformer::CompiledTransformer(CanvasTransformer *transformer)
+  : transformer_(transformer), canvas_(new TransformCanvas()) {
+  assert(transformer != NULL);
+}
+
+CompiledTransformer::~CompiledTransformer() {
+  delete canvas_;
+}
+
+void CompiledTransformer::Recompile() {
+  canvas_->Invalidate();
+}
+
+Canvas *CompiledTransformer::Transform(Canvas *output) {
+  assert(output != NULL);
+
+  canvas_->SetDelegatee(output, transformer_);
+  return canvas_;
+}
+
 // U-Arrangement Transformer.
 class UArrangementTransformer::TransformCanvas : public Canvas {
 public:
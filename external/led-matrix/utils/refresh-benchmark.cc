@@ -0,0 +1,309 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Measures the output path of the framebuffer on any Linux machine: the
+// GPIO is simulated (see gpio-simulation.h), so the refresh rate, writes and
+// time per bitplane are modeled from the writes DumpToMatrix() does. The
+// host time of SetPixel(), SetPixels() and DumpToMatrix() is measured for
+// real.
+//
+// Each configuration runs in its own process, as the output setup of the
+// framebuffer is global.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "framebuffer-internal.h"
+#include "gpio-simulation.h"
+#include "hardware-mapping.h"
+
+using rgb_matrix::GPIO;
+using rgb_matrix::GPIOSimulation;
+using rgb_matrix::internal::Framebuffer;
+using rgb_matrix::internal::PixelDesignatorMap;
+
+struct Config {
+  int rows;
+  int cols;
+  int chain;
+  int parallel;
+  int pwm_bits;
+};
+
+struct Options {
+  const char *hardware_mapping = "regular";
+  int frames = 200;
+  int write_nanos = 10;
+  int slowdown = 1;
+  int pwm_lsb_nanoseconds = 130;
+  bool hardware_pulse = true;
+  bool animate = false;
+  const char *pattern = "gradient";
+  const char *trace_file = NULL;
+};
+
+static const Config kDefaultConfigs[] = {
+  { 16, 32, 1, 1, 11 },
+  { 32, 32, 1, 1, 11 },
+  { 32, 64, 1, 1, 11 },
+  { 32, 32, 4, 1, 11 },
+  { 32, 64, 4, 1, 11 },
+  { 32, 32, 4, 3, 11 },
+  { 32, 64, 4, 1,  7 },
+  { 64, 64, 2, 1, 11 },
+};
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] [<config>...]\n", progname);
+  fprintf(stderr,
+          "Simulated refresh benchmark. Each <config> is\n"
+          "ROWSxCOLSxCHAINxPARALLELxPWMBITS, e.g. 32x64x4x1x11; without, a "
+          "default\nset of configurations is run.\n"
+          "Options:\n"
+          "\t-f <frames>    : Frames to run per configuration. Default 200\n"
+          "\t-w <nanos>     : Modeled time of one GPIO register write. "
+          "Default 10\n"
+          "\t-s <slowdown>  : GPIO slowdown. Default 1\n"
+          "\t-l <nanos>     : PWM LSB nanoseconds. Default 130\n"
+          "\t-m <mapping>   : Hardware mapping. Default 'regular'\n"
+          "\t-n             : No hardware pulse; OE timing blocks the CPU.\n"
+          "\t-x <pattern>   : black, gradient or noise. Default gradient\n"
+          "\t-a             : Animate: new content every frame.\n"
+          "\t-T <file>      : Write trace of first frame of first config.\n");
+  return 1;
+}
+
+static bool ParseConfig(const char *str, Config *c) {
+  return sscanf(str, "%dx%dx%dx%dx%d", &c->rows, &c->cols, &c->chain,
+                &c->parallel, &c->pwm_bits) == 5
+    && c->rows > 0 && c->cols > 0 && c->chain > 0 && c->parallel > 0
+    && c->pwm_bits > 0;
+}
+
+static double NowMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void CreateImage(const char *pattern, int width, int height,
+                        int frame, std::vector<uint8_t> *rgba) {
+  rgba->resize(4 * width * height);
+  uint8_t *pixel = rgba->data();
+  unsigned seed = 1 + frame;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x, pixel += 4) {
+      if (strcmp(pattern, "black") == 0) {
+        pixel[0] = pixel[1] = pixel[2] = 0;
+      } else if (strcmp(pattern, "noise") == 0) {
+        seed = seed * 1103515245 + 12345;
+        pixel[0] = seed >> 24;
+        pixel[1] = seed >> 16;
+        pixel[2] = seed >> 8;
+      } else {
+        pixel[0] = 255 * ((x + frame) % width) / width;
+        pixel[1] = 255 * y / height;
+        pixel[2] = 255 - pixel[0];
+      }
+      pixel[3] = 0xff;
+    }
+  }
+}
+
+static const HardwareMapping *FindMapping(const char *name) {
+  for (HardwareMapping *it = matrix_hardware_mappings; it->name; ++it) {
+    if (strcasecmp(it->name, name) == 0) return it;
+  }
+  return NULL;
+}
+
+static int RunConfig(const Config &c, const Options &opt, bool trace) {
+  const HardwareMapping *h = FindMapping(opt.hardware_mapping);
+  if (h == NULL) {
+    fprintf(stderr, "Unknown hardware mapping '%s'\n", opt.hardware_mapping);
+    return 1;
+  }
+  const int columns = c.cols * c.chain;
+
+  GPIOSimulation::Signals signals;
+  signals.clock = h->clock;
+  signals.strobe = h->strobe;
+  signals.address = h->a | h->b | h->c | h->d | h->e;
+  signals.color = h->p0_r1 | h->p0_g1 | h->p0_b1 | h->p0_r2 | h->p0_g2 | h->p0_b2
+    | h->p1_r1 | h->p1_g1 | h->p1_b1 | h->p1_r2 | h->p1_g2 | h->p1_b2
+    | h->p2_r1 | h->p2_g1 | h->p2_b1 | h->p2_r2 | h->p2_g2 | h->p2_b2;
+  GPIOSimulation simulation(signals, columns, opt.write_nanos);
+  GPIO io;
+  io.InitSimulation(&simulation, opt.slowdown);
+
+  Framebuffer::InitHardwareMapping(opt.hardware_mapping);
+  Framebuffer::InitGPIO(&io, c.rows, c.parallel, opt.hardware_pulse,
+                        opt.pwm_lsb_nanoseconds, 0, 0);
+  PixelDesignatorMap *mapper = NULL;
+  Framebuffer fb(c.rows, columns, c.parallel, 0, "RGB", false, &mapper);
+  if (!fb.SetPWMBits(c.pwm_bits)) {
+    fprintf(stderr, "Invalid pwm bits %d\n", c.pwm_bits);
+    return 1;
+  }
+  const int width = fb.width(), height = fb.height();
+  const int stride = 4 * width;
+
+  std::vector<std::vector<uint8_t> > images(opt.animate ? 16 : 1);
+  for (size_t i = 0; i < images.size(); ++i) {
+    CreateImage(opt.pattern, width, height, i, &images[i]);
+  }
+
+  // Host time to fill the framebuffer, pixel by pixel and in bulk.
+  const double set_pixel_start = NowMicros();
+  for (int f = 0; f < opt.frames; ++f) {
+    const uint8_t *pixel = images[f % images.size()].data();
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x, pixel += 4) {
+        fb.SetPixel(x, y, pixel[0], pixel[1], pixel[2]);
+      }
+    }
+  }
+  const double set_pixel_us = (NowMicros() - set_pixel_start) / opt.frames;
+
+  const double set_pixels_start = NowMicros();
+  for (int f = 0; f < opt.frames; ++f) {
+    fb.SetPixels(0, 0, width, height, images[f % images.size()].data(),
+                 stride);
+  }
+  const double set_pixels_us = (NowMicros() - set_pixels_start) / opt.frames;
+
+  // Warm up, so that one-time work is not part of the measurement.
+  fb.SetPixels(0, 0, width, height, images[0].data(), stride);
+  fb.DumpToMatrix(&io, 0);
+  if (trace) simulation.EnableTrace(10 * 1000 * 1000);
+
+  const uint64_t start_nanos = simulation.nanos();
+  const uint64_t start_writes = simulation.writes();
+  static const int kMaxPlanes = 16;
+  uint64_t start_plane_nanos[kMaxPlanes], start_plane_pulses[kMaxPlanes];
+  for (int b = 0; b < kMaxPlanes; ++b) {
+    start_plane_nanos[b] = simulation.plane_nanos(b);
+    start_plane_pulses[b] = simulation.plane_pulses(b);
+  }
+
+  const double dump_start = NowMicros();
+  for (int f = 0; f < opt.frames; ++f) {
+    if (opt.animate) {
+      fb.SetPixels(0, 0, width, height, images[f % images.size()].data(),
+                   stride);
+    }
+    fb.DumpToMatrix(&io, 0);
+    if (trace && f == 0) {
+      trace = false;
+      FILE *out = fopen(opt.trace_file, "w");
+      if (out == NULL) {
+        perror("Writing trace");
+      } else {
+        const std::vector<GPIOSimulation::Event> &events = simulation.trace();
+        for (size_t i = 0; i < events.size(); ++i) {
+          fprintf(out, "%llu %c %08x\n", (unsigned long long)events[i].nanos,
+                  events[i].op, events[i].bits);
+        }
+        fclose(out);
+      }
+    }
+  }
+  const double dump_us = (NowMicros() - dump_start) / opt.frames;
+
+  const double frame_nanos = (double)(simulation.nanos() - start_nanos)
+    / opt.frames;
+  printf("%3dx%-3d chain %d parallel %d pwm %2d: %8.1fHz %9.0f writes/frame"
+         "  host: SetPixel %7.1fus SetPixels %7.1fus Dump %7.1fus"
+         "  output %08x\n",
+         c.rows, c.cols, c.chain, c.parallel, c.pwm_bits,
+         1e9 / frame_nanos,
+         (double)(simulation.writes() - start_writes) / opt.frames,
+         set_pixel_us, set_pixels_us, dump_us, simulation.output_hash());
+  printf("    us per bitplane:");
+  for (int b = 0; b < kMaxPlanes; ++b) {
+    const uint64_t pulses = simulation.plane_pulses(b) - start_plane_pulses[b];
+    if (pulses == 0) continue;
+    printf(" %d:%.1f", b,
+           (simulation.plane_nanos(b) - start_plane_nanos[b]) / 1e3 / pulses);
+  }
+  printf("\n");
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  Options opt;
+  int c;
+  while ((c = getopt(argc, argv, "f:w:s:l:m:nx:aT:")) != -1) {
+    switch (c) {
+    case 'f': opt.frames = atoi(optarg); break;
+    case 'w': opt.write_nanos = atoi(optarg); break;
+    case 's': opt.slowdown = atoi(optarg); break;
+    case 'l': opt.pwm_lsb_nanoseconds = atoi(optarg); break;
+    case 'm': opt.hardware_mapping = optarg; break;
+    case 'n': opt.hardware_pulse = false; break;
+    case 'x': opt.pattern = optarg; break;
+    case 'a': opt.animate = true; break;
+    case 'T': opt.trace_file = optarg; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (opt.frames < 1 || opt.write_nanos < 0 || opt.slowdown < 0)
+    return usage(argv[0]);
+
+  std::vector<Config> configs;
+  for (int i = optind; i < argc; ++i) {
+    Config config;
+    if (!ParseConfig(argv[i], &config)) {
+      fprintf(stderr, "Invalid config '%s'\n", argv[i]);
+      return usage(argv[0]);
+    }
+    configs.push_back(config);
+  }
+  if (configs.empty()) {
+    configs.assign(kDefaultConfigs, kDefaultConfigs
+                   + sizeof(kDefaultConfigs) / sizeof(kDefaultConfigs[0]));
+  }
+
+  printf("Modeled %dns per GPIO write, slowdown %d, %s pulses\n",
+         opt.write_nanos, opt.slowdown,
+         opt.hardware_pulse ? "hardware" : "timer");
+  int failures = 0;
+  for (size_t i = 0; i < configs.size(); ++i) {
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      const bool trace = (i == 0 && opt.trace_file != NULL);
+      const int result = RunConfig(configs[i], opt, trace);
+      fflush(stdout);
+      _exit(result);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ++failures;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -58,6 +58,27 @@ extern void get_position (rotator *rot,
                           double *x_ret, double *y_ret, double *z_ret,
                           int update_p);
 
+/* Advances the motion by `dt' seconds.  Internally the rotator steps at a
+   fixed rate of ROTATOR_STEPS_PER_SECOND, the frame rate the step sizes of
+   get_rotation() and get_position() were tuned for; time left over is
+   carried into the next call.  After a long stall, at most a quarter
+   second is caught up.
+ */
+#define ROTATOR_STEPS_PER_SECOND 60
+extern void advance_rotator (rotator *rot, double dt);
+
+/* Return the rotation and position as of the last advance_rotator() call,
+   interpolated between the two most recent fixed steps, so that motion is
+   smooth at any render rate.  Ranges are as for get_rotation() and
+   get_position().
+ */
+extern void get_rotation_interpolated (rotator *rot,
+                                       double *x_ret, double *y_ret,
+                                       double *z_ret);
+extern void get_position_interpolated (rotator *rot,
+                                       double *x_ret, double *y_ret,
+                                       double *z_ret);
+
 /* Destroys and frees a `rotator' object. */
 extern void free_rotator (rotator *r);
 
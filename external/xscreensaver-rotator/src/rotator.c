@@ -37,6 +37,10 @@ struct rotator {
   double d_max;			/* max rotational velocity, > 0. */
 
   int wander_frame;		/* position in the wander cycle, >= 0. */
+
+  /* For advance_rotator(): */
+  double prev_rotx, prev_roty, prev_rotz; /* rotation one step ago, 0-1. */
+  double step_time;		/* time since the last step, seconds. */
 };
 
 
@@ -58,6 +62,9 @@ struct rotator {
 #undef EPSILON
 #define EPSILON 0.000001
 
+#define STEP_SECONDS (1.0 / ROTATOR_STEPS_PER_SECOND)
+#define MAX_CATCH_UP_SECONDS 0.25
+
 
 static void
 rotate_1 (double *pos, double *v, double *dv, double speed, double max_v)
@@ -201,6 +208,8 @@ make_rotator (double spin_x_speed,
   r->ddy = (dd + frand(dd+dd)) * r->spin_y_speed * spin_accel;
   r->ddz = (dd + frand(dd+dd)) * r->spin_z_speed * spin_accel;
 
+  get_rotation (r, &r->prev_rotx, &r->prev_roty, &r->prev_rotz, 0);
+
 # if 0
   fprintf (stderr, "rotator:\n");
   fprintf (stderr, "   wander: %3d %6.2f\n", r->wander_frame, r->wander_speed);
@@ -250,18 +259,15 @@ get_rotation (rotator *rot, double *x_ret, double *y_ret, double *z_ret,
 }
 
 
-void
-get_position (rotator *rot, double *x_ret, double *y_ret, double *z_ret,
-              int update_p)
+static void
+position_at (rotator *rot, double frame,
+             double *x_ret, double *y_ret, double *z_ret)
 {
   double x = 0.5, y = 0.5, z = 0.5;
 
   if (rot->wander_speed != 0)
     {
-      if (update_p)
-        rot->wander_frame++;
-
-# define SINOID(F) ((1 + sin((rot->wander_frame * (F)) / 2 * M_PI)) / 2.0)
+# define SINOID(F) ((1 + sin((frame * (F)) / 2 * M_PI)) / 2.0)
       x = SINOID (0.71 * rot->wander_speed);
       y = SINOID (0.53 * rot->wander_speed);
       z = SINOID (0.37 * rot->wander_speed);
@@ -272,3 +278,72 @@ get_position (rotator *rot, double *x_ret, double *y_ret, double *z_ret,
   if (y_ret) *y_ret = y;
   if (z_ret) *z_ret = z;
 }
+
+
+void
+get_position (rotator *rot, double *x_ret, double *y_ret, double *z_ret,
+              int update_p)
+{
+  if (rot->wander_speed != 0 && update_p)
+    rot->wander_frame++;
+
+  position_at (rot, rot->wander_frame, x_ret, y_ret, z_ret);
+}
+
+
+void
+advance_rotator (rotator *rot, double dt)
+{
+  if (dt < 0) dt = 0;
+  rot->step_time += dt;
+  if (rot->step_time > MAX_CATCH_UP_SECONDS)
+    rot->step_time = MAX_CATCH_UP_SECONDS;
+
+  while (rot->step_time >= STEP_SECONDS)
+    {
+      get_rotation (rot, &rot->prev_rotx, &rot->prev_roty, &rot->prev_rotz, 0);
+      get_rotation (rot, 0, 0, 0, 1);
+      get_position (rot, 0, 0, 0, 1);
+      rot->step_time -= STEP_SECONDS;
+    }
+}
+
+
+/* Blend between two fractions of a circle the short way around. */
+static double
+lerp_circle (double from, double to, double t)
+{
+  double d = to - from;
+  if (d >  0.5) d -= 1;
+  if (d < -0.5) d += 1;
+  from += d * t;
+  CLAMP (from);
+  return from;
+}
+
+
+void
+get_rotation_interpolated (rotator *rot,
+                           double *x_ret, double *y_ret, double *z_ret)
+{
+  double t = rot->step_time / STEP_SECONDS;
+  double x, y, z;
+
+  get_rotation (rot, &x, &y, &z, 0);
+
+  if (x_ret) *x_ret = lerp_circle (rot->prev_rotx, x, t);
+  if (y_ret) *y_ret = lerp_circle (rot->prev_roty, y, t);
+  if (z_ret) *z_ret = lerp_circle (rot->prev_rotz, z, t);
+}
+
+
+void
+get_position_interpolated (rotator *rot,
+                           double *x_ret, double *y_ret, double *z_ret)
+{
+  double frame = rot->wander_frame;
+  if (rot->wander_speed != 0)
+    frame += rot->step_time / STEP_SECONDS - 1;
+
+  position_at (rot, frame, x_ret, y_ret, z_ret);
+}
@@ -0,0 +1,81 @@
+#ifndef PICUBE_BOUNDED_QUEUE_H
+#define PICUBE_BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+// Fixed capacity FIFO for handing items between threads. Push() blocks while
+// the queue is full and Pop() while it is empty, until Close() is called.
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+	// Returns false if the queue was closed.
+	bool Push(const T &item) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		notFull_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+		if (closed_) {
+			return false;
+		}
+		items_.push_back(item);
+		notEmpty_.notify_one();
+		return true;
+	}
+
+	// Returns false if the queue is full or closed.
+	bool TryPush(const T &item) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (closed_ || items_.size() >= capacity_) {
+			return false;
+		}
+		items_.push_back(item);
+		notEmpty_.notify_one();
+		return true;
+	}
+
+	// Returns false once the queue is closed and drained.
+	bool Pop(T *item) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		notEmpty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+		if (items_.empty()) {
+			return false;
+		}
+		*item = items_.front();
+		items_.pop_front();
+		notFull_.notify_one();
+		return true;
+	}
+
+	// Returns false if the queue is empty.
+	bool TryPop(T *item) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (items_.empty()) {
+			return false;
+		}
+		*item = items_.front();
+		items_.pop_front();
+		notFull_.notify_one();
+		return true;
+	}
+
+	// Wake up all waiters; further pushes fail, pops drain what is left.
+	void Close() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		notEmpty_.notify_all();
+		notFull_.notify_all();
+	}
+
+private:
+	const size_t capacity_;
+	bool closed_;
+	std::deque<T> items_;
+	std::mutex mutex_;
+	std::condition_variable notEmpty_;
+	std::condition_variable notFull_;
+};
+
+#endif // PICUBE_BOUNDED_QUEUE_H
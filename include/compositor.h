@@ -0,0 +1,80 @@
+#ifndef PICUBE_COMPOSITOR_H
+#define PICUBE_COMPOSITOR_H
+
+#include <cstdint>
+#include <vector>
+
+
+// Stacks RGBA layers into the frame sent to the panel.
+//
+// Each layer is a frame of its own with an opacity and a blend mode, drawn
+// over the ones below it: NORMAL blends by the layer's alpha times its
+// opacity, ADD adds the layer scaled the same way, saturating at white.
+// Opacities can be faded over time, and Crossfade() moves a layer to the top
+// and fades it in over the others.
+//
+// Layers keep their pixels between frames, so only the ones that change need
+// redrawing, through Draw(). The blend of everything below the lowest layer
+// that changed is cached, and a frame where nothing changed isn't composed at
+// all. Blending runs on four (SSE2) or eight (NEON) pixels at a time when
+// available.
+class Compositor {
+public:
+	enum class Blend {
+		NORMAL,
+		ADD
+	};
+
+	Compositor(unsigned width, unsigned height);
+
+	// A new layer on top, transparent until drawn. Returns its index.
+	unsigned AddLayer(Blend blend = Blend::NORMAL, float opacity = 1.0f);
+
+	// The pixels of "layer" to draw into; the next Compose() redoes that layer.
+	unsigned char* Draw(unsigned layer);
+
+	void SetOpacity(unsigned layer, float opacity);
+
+	// Fade "layer" from its current opacity to "opacity" over "seconds".
+	void FadeTo(unsigned layer, float opacity, float seconds);
+
+	// Raise "layer" to the top and fade it in from transparent over "seconds";
+	// once it is fully there, every other layer is hidden. 0 cuts over at once.
+	void Crossfade(unsigned layer, float seconds);
+
+	// Step the fades.
+	void Advance(float deltaSeconds);
+
+	// Whether "layer" shows in the frame, i.e. needs drawing.
+	bool Visible(unsigned layer) const;
+
+	// No fades running.
+	bool Settled() const;
+
+	// Blend the layers into "frame". Returns false, leaving "frame" alone, when
+	// nothing changed since the previous call.
+	bool Compose(unsigned char* frame);
+
+private:
+	struct Layer {
+		std::vector<unsigned char> pixels;
+		Blend blend;
+		float opacity;
+		float target;		// of the fade
+		float rate;			// opacity per second towards target, 0 for no fade
+		bool hideOthers;	// at the end of the fade
+		bool changed;		// since the last Compose(); pixels or opacity
+	};
+
+	void BlendLayer(const Layer& layer, unsigned char* frame) const;
+
+	const unsigned width_;
+	const unsigned height_;
+	std::vector<Layer> layers_;
+	std::vector<unsigned> order_;		// layer indices, bottom to top
+	std::vector<unsigned char> below_;	// blend of the bottom belowCount_ layers of order_
+	unsigned belowCount_;
+	bool composed_;						// a frame was composed since the last change of order_
+};
+
+#endif // PICUBE_COMPOSITOR_H
@@ -0,0 +1,29 @@
+#ifndef PICUBE_DOWNSAMPLE_H
+#define PICUBE_DOWNSAMPLE_H
+
+#include <cstdint>
+#include <vector>
+
+
+// Shrinks RGBA frames by an integer factor with a box filter: each output
+// pixel is the rounded average of a factor x factor block of input pixels.
+// Used to bring a supersampled frame down to the panel resolution. The rows
+// of a block are summed four pixels at a time (SSE2 or NEON when available).
+class Downsampler {
+public:
+	// Output size "width" x "height", input "factor" times that; factor 1..16.
+	Downsampler(unsigned width, unsigned height, unsigned factor);
+
+	// "src" is (width * factor) x (height * factor), "dst" width x height.
+	void Reduce(const unsigned char* src, unsigned char* dst);
+
+	unsigned Factor() const { return factor_; }
+
+private:
+	const unsigned width_;
+	const unsigned height_;
+	const unsigned factor_;
+	std::vector<uint16_t> sums_; // one input row of channels, summed over a block's rows
+};
+
+#endif // PICUBE_DOWNSAMPLE_H
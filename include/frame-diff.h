@@ -0,0 +1,34 @@
+#ifndef PICUBE_FRAME_DIFF_H
+#define PICUBE_FRAME_DIFF_H
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+
+// Finds what changed between RGBA frames written to a set of rotating targets
+// (e.g. the canvases of a double or triple buffered display). It keeps a copy
+// of what each target was last given, so each target only gets the pixels it
+// doesn't already hold, whichever frames it skipped in between.
+class FrameDiff {
+public:
+	// A run of changed pixels within row "y". "rgba" points at pixel x of that
+	// row of the new frame.
+	typedef std::function<void(unsigned x, unsigned y, unsigned width, const unsigned char* rgba)> Span;
+
+	FrameDiff(unsigned width, unsigned height);
+
+	// Calls "span" for every run of pixels where "frame" differs from what
+	// "target" holds, then records "frame" as target's content. A target
+	// seen for the first time gets the whole frame. Returns false, without
+	// calling "span", if the frame is the same as in the previous call.
+	bool Update(const void* target, const unsigned char* frame, const Span& span);
+
+private:
+	const unsigned width_;
+	const unsigned height_;
+	std::unordered_map<const void*, std::vector<unsigned char>> targets_;
+	const std::vector<unsigned char>* last_;
+};
+
+#endif // PICUBE_FRAME_DIFF_H
@@ -0,0 +1,127 @@
+#ifndef PICUBE_FRAME_INGEST_H
+#define PICUBE_FRAME_INGEST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+// Frames from other processes, through a POSIX shared memory segment.
+//
+// The process driving the panel creates the segment with FrameIngest. Each
+// producer (a ticker, an alert daemon...) opens it with IngestProducer and
+// gets a slot of its own: three frame buffers passed around as a lock-free
+// triple buffer, so the producer always has one to fill, the panel side always
+// has the newest complete frame, and neither ever waits for the other. Frames
+// are either width x height RGBA or the panel's own bitplane encoding (what
+// FrameCanvas::Serialize() gives, for the same --led-* flags), and are read
+// straight out of the segment.
+//
+// Of the producers that published recently, the one with the highest
+// priority is shown; a producer that stops publishing for the hold time, or
+// dies, gives the panel back to the others. Publishing is a few atomic
+// operations, plus a futex wake only while the panel side is waiting for one.
+enum class IngestFormat : uint32_t {
+	RGBA = 1,
+	BITPLANES = 2
+};
+
+struct IngestSegment; // the layout in shared memory
+
+// A frame picked by FrameIngest::Next(). Format and length are copied out of
+// the segment as they are checked, so a producer can't change them afterwards.
+struct IngestView {
+	IngestFormat format;
+	size_t length;				// bytes at data
+	const unsigned char* data;	// in the segment
+};
+
+// A frame in the segment. The data follows the header.
+struct IngestFrame {
+	uint32_t sequence;		// counts the frames published into the slot, 0 for none yet
+	IngestFormat format;
+	uint32_t length;		// bytes of data
+	uint32_t reserved;
+
+	const unsigned char* Data() const { return reinterpret_cast<const unsigned char*>(this + 1); }
+	unsigned char* Data() { return reinterpret_cast<unsigned char*>(this + 1); }
+};
+
+
+// The panel side: owns the segment and picks the frames to show.
+class FrameIngest {
+public:
+	// "name" as for shm_open(), e.g. "/picube". "bitplaneBytes" is the size of a
+	// serialized FrameCanvas, 0 to only take RGBA.
+	FrameIngest(const std::string& name, unsigned width, unsigned height, size_t bitplaneBytes, unsigned slots, float holdSeconds);
+	~FrameIngest();
+
+	// Create the segment, or reuse one with the same geometry so producers
+	// stay attached across restarts.
+	bool Open();
+
+	// Wait up to "timeoutSeconds" for a frame to show. Returns true and fills
+	// in "frame" if it differs from what the previous call returned: a new
+	// frame, or the last one of another producer taking over. Its data stays
+	// valid until the next call. Returns false on timeout, when nothing
+	// changed, or when the producer handed over something malformed.
+	bool Next(float timeoutSeconds, IngestView* frame);
+
+	// Whether any producer is being shown.
+	bool Active() const { return shownSlot_ >= 0; }
+
+private:
+	int ChooseSlot(uint32_t nowMillis);
+	// By our own geometry, not what the segment says, which producers could overwrite.
+	const IngestFrame* FrameAt(unsigned slot, unsigned buffer) const;
+
+	const std::string name_;
+	const unsigned width_;
+	const unsigned height_;
+	const size_t bitplaneBytes_;
+	const unsigned slots_;
+	const size_t frameStride_;
+	const uint32_t holdMillis_;
+	IngestSegment* segment_;
+	size_t size_;
+	uint32_t doorbell_;		// value at the previous wait
+	int shownSlot_;			// -1 for none
+	uint32_t shownSequence_;
+};
+
+
+// A producer: claims a slot of the segment and publishes frames into it.
+class IngestProducer {
+public:
+	// Higher priorities win over lower ones.
+	IngestProducer(const std::string& name, int priority);
+	~IngestProducer();
+
+	// Map the segment and claim a free slot.
+	bool Open();
+
+	unsigned Width() const;
+	unsigned Height() const;
+	size_t BitplaneBytes() const;	// 0 if the panel side doesn't take bitplanes
+	size_t MaxFrameBytes() const;
+
+	// The buffer to fill next; Publish() hands it over and makes another one
+	// current.
+	unsigned char* Frame();
+
+	// Show the filled Frame(). False if the panel side has replaced the
+	// segment (Open() again) or the frame doesn't fit the format.
+	bool Publish(IngestFormat format, size_t length);
+
+	// Give up the slot now rather than at the hold time.
+	void Release();
+
+private:
+	const std::string name_;
+	const int priority_;
+	IngestSegment* segment_;
+	size_t size_;
+	int slot_;				// -1 while not claimed
+};
+
+#endif // PICUBE_FRAME_INGEST_H
@@ -0,0 +1,34 @@
+#ifndef PICUBE_FRAME_SCHEDULER_H
+#define PICUBE_FRAME_SCHEDULER_H
+
+#include <ctime>
+
+
+// Paces the render loop. Frames are due at fixed deadlines 1/maxFPS apart and
+// the thread sleeps until the next one instead of spinning. A frame that is
+// late by more than a whole period doesn't cause a burst to catch up; the
+// schedule restarts from now.
+class FrameScheduler {
+public:
+	explicit FrameScheduler(float maxFPS);
+
+	// Below one frame an hour (or NaN), one frame an hour.
+	void SetMaxFPS(float maxFPS);
+	float MaxFPS() const { return maxFPS_; }
+
+	// Sleep until the next frame is due. Returns the seconds since the
+	// previous frame.
+	double WaitForFrame();
+
+	// Restart the schedule from now, e.g. after idling, so the idle time
+	// isn't reported as one long frame.
+	void Reset();
+
+private:
+	float maxFPS_;
+	long long periodNanos_;	// 64 bit: a long is 32 on armhf, under 2.2 s
+	timespec next_;
+	timespec last_;
+};
+
+#endif // PICUBE_FRAME_SCHEDULER_H
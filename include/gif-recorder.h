@@ -0,0 +1,64 @@
+#ifndef PICUBE_GIF_RECORDER_H
+#define PICUBE_GIF_RECORDER_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded-queue.h"
+
+
+// Records RGBA snapshots to an animated GIF. Capture() only copies the frame
+// into a preallocated pool; building palettes and LZW encoding happen on a
+// background thread, so the render loop never waits for the encoder.
+// Frames are captured at most at maxFPS and dropped while the encoder is
+// behind. Each frame's delay comes from the capture times, so a dropped frame
+// just leaves the previous one up longer.
+class GifRecorder {
+public:
+	GifRecorder(unsigned width, unsigned height, float maxFPS, unsigned poolSize);
+	~GifRecorder();
+
+	// Open the file and start the encoder thread.
+	bool Start(const std::string& fileName);
+
+	// Copy a frame for recording, unless it's too soon after the previous one
+	// or the pool is used up. Never blocks.
+	void Capture(const unsigned char* rgba);
+
+	// Encode what is queued, finish the file and stop the thread.
+	void Stop();
+
+	unsigned Captured() const { return captured_; }
+	unsigned Dropped() const { return dropped_; }
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Frame {
+		std::vector<unsigned char> rgba;
+		Clock::time_point time;
+	};
+
+	struct Encoder; // gif.h state, only in gif-recorder.cc
+
+	void Run();
+	void Encode(const Frame& frame, Clock::time_point until);
+
+	const unsigned width_;
+	const unsigned height_;
+	const Clock::duration minInterval_;
+	std::vector<Frame> frames_;
+	BoundedQueue<Frame*> free_;
+	BoundedQueue<Frame*> ready_;
+	Clock::time_point lastCapture_;
+	std::atomic<unsigned> captured_;
+	std::atomic<unsigned> dropped_;
+	std::unique_ptr<Encoder> encoder_;
+	std::thread thread_;
+};
+
+#endif // PICUBE_GIF_RECORDER_H
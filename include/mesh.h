@@ -0,0 +1,44 @@
+#ifndef PICUBE_MESH_H
+#define PICUBE_MESH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// 20 bytes per vertex instead of three vec3s: normals as signed normalized
+// bytes, colors as unsigned normalized bytes.
+struct MeshVertex {
+	float position[3];
+	int8_t normal[4];	// xyz, w is padding
+	uint8_t color[4];	// rgba
+};
+
+// An indexed triangle mesh. Indices are 16 bit, which is all GLES2 class GPUs
+// like the Pi's can draw, so a mesh has at most 65536 vertices.
+class Mesh {
+public:
+	// the picube cube, unit size, purple top and bottom, green sides, blue front and back
+	static Mesh Cube();
+
+	// Wavefront OBJ: v (optionally followed by r g b), vn and f lines. Faces
+	// are triangulated as fans; without normals they get their face normal.
+	bool LoadOBJ(const std::string& path);
+
+	// the binary format: a header and the vertex and index arrays as they are in memory
+	bool LoadBinary(const std::string& path);
+	bool SaveBinary(const std::string& path) const;
+
+	// LoadOBJ() with a binary copy at path + ".mesh", which is loaded instead
+	// while it's newer than the OBJ file.
+	bool Load(const std::string& path);
+
+	const std::vector<MeshVertex>& Vertices() const { return vertices_; }
+	const std::vector<uint16_t>& Indices() const { return indices_; }
+
+private:
+	std::vector<MeshVertex> vertices_;
+	std::vector<uint16_t> indices_;
+};
+
+#endif // PICUBE_MESH_H
@@ -0,0 +1,127 @@
+#ifndef PICUBE_METRICS_H
+#define PICUBE_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// A histogram of durations in microseconds. Buckets are log-linear: four per
+// power of two, so quantiles are within 25% up to about an hour. Record() is
+// a single relaxed atomic increment, cheap enough for every frame and safe
+// from any thread.
+class Histogram {
+public:
+	static constexpr unsigned SUB_BUCKETS = 4; // per power of two
+	static constexpr unsigned BUCKETS = SUB_BUCKETS * 31;
+
+	// Counts copied out of a Histogram at one point in time.
+	struct Snapshot {
+		uint64_t buckets[BUCKETS];
+		uint64_t sum; // microseconds
+
+		uint64_t Count() const;
+
+		// Interpolated within the bucket; 0 if empty.
+		double Quantile(double q) const;
+
+		// What was recorded since "earlier".
+		Snapshot Since(const Snapshot& earlier) const;
+	};
+
+	Histogram();
+
+	void Record(uint32_t micros);
+	Snapshot Read() const;
+
+	// Microseconds in "bucket" are >= LowerBound(bucket) and < LowerBound(bucket + 1).
+	static uint64_t LowerBound(unsigned bucket);
+
+private:
+	std::atomic<uint64_t> buckets_[BUCKETS];
+	std::atomic<uint64_t> sum_;
+};
+
+
+// The stages of a frame, each with its histogram.
+class FrameMetrics {
+public:
+	enum Stage : unsigned {
+		RENDER,		// scene update and drawing, up to the finished frame on the GPU or CPU
+		READBACK,	// getting the pixels out of GL
+		COMPOSE,	// blending the layers into the frame for the panel
+		CONVERT,	// changed pixels into the LED canvas
+		SWAP_WAIT,	// waiting on buffer swaps and the frame scheduler
+		REFRESH,	// one refresh of the panels by the LED matrix thread
+		STAGES
+	};
+
+	static const char* Name(Stage stage);
+
+	Histogram& operator[](Stage stage) { return stages_[stage]; }
+	const Histogram& operator[](Stage stage) const { return stages_[stage]; }
+
+private:
+	Histogram stages_[STAGES];
+};
+
+
+// Times the stages of one frame on one thread. Each Lap() charges the time
+// since the previous Start() or Lap() to a stage, so a stage can be lapped
+// more than once per frame (e.g. waiting for the scheduler and for the swap);
+// Finish() records one total per stage that was lapped.
+class FrameTimer {
+public:
+	explicit FrameTimer(FrameMetrics* metrics);
+
+	void Start();
+	void Lap(FrameMetrics::Stage stage);
+	void Finish();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	FrameMetrics* const metrics_;
+	Clock::time_point last_;
+	Clock::duration totals_[FrameMetrics::STAGES];
+	bool lapped_[FrameMetrics::STAGES];
+};
+
+
+// Publishes FrameMetrics in the Prometheus text exposition format: all-time
+// histograms per stage plus p50/p90/p99/max since the previous export.
+// "target" is either a file, rewritten every "interval" seconds (e.g. for
+// node_exporter's textfile collector), or "unix:PATH", a Unix socket that
+// answers every connection with the current metrics.
+class MetricsExporter {
+public:
+	MetricsExporter(const FrameMetrics& metrics, const std::string& target, float interval);
+	~MetricsExporter();
+
+	// Start the exporter thread. Returns false if the socket can't be set up.
+	bool Start();
+
+	// Write the file one last time, then stop the thread.
+	void Stop();
+
+	// The exposition text; updates what counts as the previous export.
+	std::string Export();
+
+private:
+	void Run();
+	void WriteFile();
+	void ServeSocket();
+
+	const FrameMetrics& metrics_;
+	const std::string target_;
+	const std::chrono::milliseconds interval_;
+	std::vector<Histogram::Snapshot> previous_;
+	int listenFD_;
+	std::atomic<bool> running_;
+	std::thread thread_;
+};
+
+#endif // PICUBE_METRICS_H
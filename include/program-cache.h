@@ -0,0 +1,59 @@
+#ifndef PICUBE_PROGRAM_CACHE_H
+#define PICUBE_PROGRAM_CACHE_H
+
+#include <string>
+#include <vector>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+
+// Linked GL programs kept on disk, so later starts skip compiling and
+// linking the shaders. Needs a driver that hands out program binaries
+// (ARB_get_program_binary with at least one format); otherwise, or with an
+// empty directory, it does nothing and programs are built from source.
+//
+// Entries are keyed by the shader sources and the GL renderer and version
+// strings, so changed shaders or a driver update just miss. A driver may
+// still refuse a binary it wrote itself, in which case Load() fails and the
+// caller links from source again.
+class ProgramCache {
+public:
+	// Call with a current GL context.
+	explicit ProgramCache(const std::string& dir);
+
+	bool Enabled() const { return !dir_.empty(); }
+
+	// A new program linked from the stored binary for these sources, 0 if
+	// there is none or the driver rejects it.
+	GLuint Load(const std::string& vertexSource, const std::string& fragmentSource);
+
+	// Call before glLinkProgram() on a program that will be saved.
+	void PrepareForSave(GLuint program);
+
+	// Keep the binary of the linked "program" for Load() next time. It is only
+	// written out by Flush().
+	void Save(const std::string& vertexSource, const std::string& fragmentSource, GLuint program);
+
+	// Write what Save() kept. Call once root is given up, so the files belong
+	// to the user picube runs as rather than to root.
+	void Flush();
+
+	// The default directory, $XDG_CACHE_HOME/picube or ~/.cache/picube.
+	static std::string DefaultDir();
+
+private:
+	struct Entry {
+		std::string path;
+		GLenum format;
+		std::vector<char> binary;
+	};
+
+	std::string EntryPath(const std::string& vertexSource, const std::string& fragmentSource) const;
+
+	std::string dir_;		// empty if disabled or binaries aren't supported
+	std::string driver_;	// renderer and version, part of the key
+	std::vector<Entry> unsaved_;	// from Save(), for Flush()
+};
+
+#endif // PICUBE_PROGRAM_CACHE_H
@@ -0,0 +1,58 @@
+#ifndef PICUBE_RASTERIZER_H
+#define PICUBE_RASTERIZER_H
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+
+
+// Renders meshes on the CPU the way shaders/scene.vert and scene.frag do on
+// the GPU: positions go through projection * view * model, the vertex color
+// is interpolated and written as is. Depth test like GL_LESS, no culling.
+// Meant for tiny targets like the 64x32 panel, where setting up GL and reading
+// the pixels back costs more than drawing them.
+//
+// Anti-aliasing is like MSAA: coverage and depth per sample, color once per
+// pixel, averaged by Resolve(). Edge functions are evaluated for four samples
+// at a time (SSE2 or NEON when available).
+class Rasterizer {
+public:
+	// "samples" per pixel: 1, 4, 8 or 16 (others are rounded up to those).
+	Rasterizer(unsigned width, unsigned height, unsigned samples);
+
+	void Clear(const glm::vec3& color);
+
+	// "mvp" is projection * view * model. Each vertex is transformed once.
+	void DrawMesh(const Mesh& mesh, const glm::mat4& mvp);
+
+	// Write the averaged samples as RGBA, bottom row first like glReadPixels().
+	void Resolve(unsigned char* rgba) const;
+
+	unsigned Width() const { return width_; }
+	unsigned Height() const { return height_; }
+	unsigned Samples() const { return samples_; }
+
+private:
+	struct ClipVertex {
+		glm::vec4 position;
+		glm::vec3 color;
+	};
+
+	void DrawClipped(const ClipVertex* v, unsigned count);
+	void DrawTriangle(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c);
+
+	const unsigned width_;
+	const unsigned height_;
+	const unsigned samples_;
+	const unsigned groups_; // of four samples
+	std::vector<float> sampleX_; // offsets within the pixel, padded to groups_ * 4
+	std::vector<float> sampleY_;
+	std::vector<uint32_t> color_; // per sample, RGBA
+	std::vector<float> depth_;    // per sample, 0..1
+	std::vector<ClipVertex> transformed_;
+};
+
+#endif // PICUBE_RASTERIZER_H
@@ -0,0 +1,70 @@
+#ifndef PICUBE_RENDER_TARGET_H
+#define PICUBE_RENDER_TARGET_H
+
+#include <vector>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+
+// An offscreen framebuffer object with color and depth storage, used instead
+// of the window's framebuffer when rendering headless or supersampled. If
+// multisampling is requested, rendering goes to a multisampled FBO which
+// Resolve() blits into a single sampled one for readback.
+//
+// With supersampling the scene is drawn at a multiple of the output size and
+// Resolve() halves it step by step with linear filtered blits. Each step
+// averages 2x2 pixels exactly, so the result is a box filter over the whole
+// block, and only the output size is ever read back.
+class RenderTarget {
+public:
+	RenderTarget();
+	~RenderTarget();
+
+	// Create the framebuffer(s) for a "width" x "height" output; "samples" is
+	// clamped to what the driver supports, 0 or 1 disables multisampling.
+	// "supersample" is rounded down to a power of two. Returns false if
+	// framebuffer objects are unsupported or incomplete.
+	bool Create(unsigned width, unsigned height, unsigned samples, unsigned supersample = 1);
+
+	// Direct rendering into this target. The viewport is up to the caller,
+	// see RenderWidth() and RenderHeight().
+	void Bind();
+
+	// Finish the frame: resolve multisampling, downsample to the output size
+	// and make the result the read framebuffer for glReadPixels().
+	void Resolve();
+
+	// After Resolve(): show the output in the window, scaled to its
+	// framebuffer size.
+	void Present(unsigned windowWidth, unsigned windowHeight);
+
+	unsigned Width() const { return width_; }
+	unsigned Height() const { return height_; }
+	unsigned RenderWidth() const { return width_ * supersample_; }
+	unsigned RenderHeight() const { return height_ * supersample_; }
+
+private:
+	// A single sampled color buffer the frame is blitted into.
+	struct Stage {
+		GLuint fbo;
+		GLuint colorRB;
+		unsigned width;
+		unsigned height;
+	};
+
+	bool AddStage(unsigned width, unsigned height);
+	GLuint OutputFBO() const { return stages_.empty() ? drawFBO_ : stages_.back().fbo; }
+	void Destroy();
+
+	unsigned width_;
+	unsigned height_;
+	unsigned samples_;
+	unsigned supersample_;
+	GLuint drawFBO_;
+	GLuint colorRB_;
+	GLuint depthRB_;
+	std::vector<Stage> stages_; // multisample resolve, then each halving
+};
+
+#endif // PICUBE_RENDER_TARGET_H
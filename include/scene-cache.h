@@ -0,0 +1,56 @@
+#ifndef PICUBE_SCENE_CACHE_H
+#define PICUBE_SCENE_CACHE_H
+
+#include <csignal>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace rgb_matrix {
+class FileStreamIO;
+class FrameCanvas;
+class RGBMatrix;
+class StreamWriter;
+}
+
+
+// Pre-rendered frames of a scene, stored as an LED matrix content stream
+// (compressed format) in a directory. The file name is a hash of the key, which
+// must describe everything the frames depend on: scene, frame rate, panel
+// options. Once baked, the frames are replayed straight into FrameCanvases,
+// without any rendering.
+class SceneCache {
+public:
+	// Frames are width x height RGBA, like the snapshots uploaded to the panel.
+	SceneCache(const std::string& dir, const std::string& key, unsigned width, unsigned height);
+	~SceneCache();
+
+	bool Enabled() const { return !dir_.empty(); }
+	const std::string& Path() const { return path_; }
+	bool Exists() const;
+
+	// Bake the next "frames" frames passed to Record(). They go to a temporary
+	// file that replaces Path() once all of them are in, so an interrupted bake
+	// is never played.
+	bool StartRecording(rgb_matrix::RGBMatrix* matrix, unsigned frames);
+	bool Recording() const { return writer_ != nullptr; }
+	void Record(const unsigned char* rgba, uint32_t holdMicros);
+
+	// Show the baked frames in a loop, each for as long as it was recorded,
+	// until "quit" is set.
+	bool Play(rgb_matrix::RGBMatrix* matrix, const volatile sig_atomic_t& quit);
+
+private:
+	void FinishRecording();
+
+	const std::string dir_;
+	const std::string path_;
+	const unsigned width_;
+	const unsigned height_;
+	std::unique_ptr<rgb_matrix::FileStreamIO> io_;
+	std::unique_ptr<rgb_matrix::StreamWriter> writer_;
+	rgb_matrix::FrameCanvas* canvas_;
+	unsigned framesLeft_;
+};
+
+#endif // PICUBE_SCENE_CACHE_H
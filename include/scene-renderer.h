@@ -0,0 +1,47 @@
+#ifndef PICUBE_SCENE_RENDERER_H
+#define PICUBE_SCENE_RENDERER_H
+
+#include <vector>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "scene.h"
+
+
+// Draws a Scene with shaders/scene.vert. GL 2.1 has no instancing, so each
+// mesh is uploaded as a batch of copies, every vertex tagged with its copy;
+// the shader picks that copy's model matrix from a uniform array. All objects
+// of a mesh then take one draw call per batch, however many rotators move them.
+class SceneRenderer {
+public:
+	SceneRenderer();
+	~SceneRenderer();
+
+	// Upload the meshes of "scene" and find the attributes and uniforms of "program".
+	bool Create(const Scene& scene, GLuint program);
+
+	// Draw all objects; "program" must be in use.
+	void Draw(const Scene& scene);
+
+private:
+	struct Batch {
+		GLuint vbo;
+		GLuint ibo;
+		unsigned copies;		// of the mesh in the buffers
+		unsigned indexCount;	// of one copy
+	};
+
+	void Destroy();
+
+	std::vector<Batch> batches_; // per mesh
+	std::vector<glm::mat4> models_;
+	GLint vPos_;
+	GLint vNorm_;
+	GLint vColor_;
+	GLint vCopy_;
+	GLint modelsLoc_;
+};
+
+#endif // PICUBE_SCENE_RENDERER_H
@@ -0,0 +1,54 @@
+#ifndef PICUBE_SCENE_H
+#define PICUBE_SCENE_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "rotator.h"
+
+
+// Meshes and the objects made of them, each moving on its own rotator.
+// Drawing is up to a backend (SceneRenderer for GL, Rasterizer on the CPU);
+// both draw all objects of a mesh together.
+class Scene {
+public:
+	struct Object {
+		unsigned mesh;
+		rotator* motion;
+		float scale;
+	};
+
+	// "wander" scales the rotator's position, which is 0..1 on each axis,
+	// around the origin.
+	explicit Scene(const glm::vec3& wander);
+	~Scene();
+
+	unsigned AddMesh(const Mesh& mesh);
+
+	// Takes ownership of "motion".
+	void AddObject(unsigned mesh, rotator* motion, float scale);
+
+	// Step all rotators.
+	void Advance(double seconds);
+
+	const std::vector<Mesh>& Meshes() const { return meshes_; }
+	const std::vector<Object>& Objects() const { return objects_; }
+
+	// Where the object is now, interpolated between rotator steps.
+	glm::mat4 Model(const Object& object) const;
+
+	// The models of all objects made of "mesh", in object order.
+	void Models(unsigned mesh, std::vector<glm::mat4>* models) const;
+
+private:
+	Scene(const Scene&) = delete;
+	Scene& operator=(const Scene&) = delete;
+
+	const glm::vec3 wander_;
+	std::vector<Mesh> meshes_;
+	std::vector<Object> objects_;
+};
+
+#endif // PICUBE_SCENE_H
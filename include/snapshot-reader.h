@@ -0,0 +1,44 @@
+#ifndef PICUBE_SNAPSHOT_READER_H
+#define PICUBE_SNAPSHOT_READER_H
+
+#include <vector>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+
+// Reads back the rendered frame through a ring of pixel buffer objects, so
+// glReadPixels() returns immediately and the copy finishes on the GPU while
+// the next frame renders. Read() hands out the oldest finished readback,
+// which makes the snapshots (numBuffers - 1) frames late.
+//
+// Falls back to a synchronous glReadPixels() if pixel buffer objects are
+// not supported.
+class SnapshotReader {
+public:
+	SnapshotReader(unsigned width, unsigned height, unsigned numBuffers);
+	~SnapshotReader();
+
+	// Start reading back the current read framebuffer.
+	void Request();
+
+	// Copy the oldest requested snapshot (RGBA) into "snapshot". Returns
+	// false while the ring is still filling up.
+	bool Read(unsigned char* snapshot);
+
+	// Drop the readbacks still in flight, e.g. after requests were paused and
+	// what they hold is out of date. Read() returns false until the ring has
+	// filled up again.
+	void Reset();
+
+private:
+	const unsigned width_;
+	const unsigned height_;
+	const unsigned numBuffers_;
+	bool usePBO_;
+	std::vector<GLuint> pbos_;
+	unsigned head_; // next buffer to read into
+	unsigned pending_; // readbacks in flight
+};
+
+#endif // PICUBE_SNAPSHOT_READER_H
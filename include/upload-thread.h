@@ -0,0 +1,45 @@
+#ifndef PICUBE_UPLOAD_THREAD_H
+#define PICUBE_UPLOAD_THREAD_H
+
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "bounded-queue.h"
+
+
+// Runs the LED upload stage on its own thread. The render loop fills frames
+// from a small preallocated pool and submits them; the thread hands each one
+// to the upload function. If the upload stage falls behind, the oldest queued
+// frame is recycled, so the render loop never waits and the panel always gets
+// the newest frame.
+class UploadThread {
+public:
+	typedef std::function<void(const unsigned char* frame)> Upload;
+
+	UploadThread(size_t frameSize, unsigned queueDepth, Upload upload);
+	~UploadThread();
+
+	// Returns a frame to fill. Never blocks.
+	unsigned char* AcquireFrame();
+
+	// Queue a frame returned by AcquireFrame() for upload.
+	void SubmitFrame(unsigned char* frame);
+
+	// Give back a frame returned by AcquireFrame() without uploading it.
+	void ReleaseFrame(unsigned char* frame);
+
+	// Upload what is queued, then stop the thread.
+	void Stop();
+
+private:
+	void Run();
+
+	const Upload upload_;
+	std::vector<std::vector<unsigned char>> frames_;
+	BoundedQueue<unsigned char*> free_;
+	BoundedQueue<unsigned char*> ready_;
+	std::thread thread_;
+};
+
+#endif // PICUBE_UPLOAD_THREAD_H
@@ -1,22 +1,24 @@
 #version 110
 
-uniform mat4 model;
+uniform mat4 models[16]; // one per copy of the mesh in the batch
 uniform mat4 view;
 uniform mat4 projection;
 
 attribute vec3 vPos;
 attribute vec3 vNorm;
-attribute vec3 vColor;
+attribute vec4 vColor;
+attribute float vCopy;
 
 varying vec3 color;
 varying vec3 norm;
 
 void main()
 {
+	mat4 model = models[int(vCopy)];
 	vec3 vPosition_eye = vec3(view * model * vec4(vPos, 1.0));
 
 	gl_Position = projection * vec4(vPosition_eye, 1.0);
 
-    color = vColor;
+    color = vColor.rgb;
 	norm = vNorm; // not used, but compiler was optimizing it out
 }
@@ -0,0 +1,288 @@
+#include "compositor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define COMPOSITOR_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define COMPOSITOR_SSE2
+#endif
+
+
+constexpr unsigned BYTES_PER_PIXEL = 4;
+constexpr unsigned OPAQUE = 256; // weights and opacities are fixed point, 256 for 1.0
+
+
+// how much of a pixel with "alpha" a layer at "opacity" lets through, 0..OPAQUE
+static inline unsigned Weight(unsigned alpha, unsigned opacity) {
+	return ((alpha + (alpha >> 7)) * opacity) >> 8;
+}
+
+#if defined(COMPOSITOR_SSE2)
+// the weights of four pixels, each repeated for its four channels: pixels 0 and 1 in "lo", 2 and 3 in "hi"
+static inline void Weights(__m128i pixels, __m128i opacity2, __m128i* lo, __m128i* hi) {
+	__m128i alpha = _mm_srli_epi32(pixels, 24);
+	alpha = _mm_add_epi16(alpha, _mm_srli_epi16(alpha, 7));
+	// (alpha << 7) * (opacity << 1) >> 16, as alpha * opacity can reach 65536
+	__m128i weight = _mm_mulhi_epu16(_mm_slli_epi16(alpha, 7), opacity2);
+	__m128i pairs = _mm_unpacklo_epi32(weight, weight);
+	*lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pairs, 0), 0);
+	pairs = _mm_unpackhi_epi32(weight, weight);
+	*hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pairs, 0), 0);
+}
+#endif
+
+// dst = src * weight + dst * (1 - weight), per channel
+static void BlendNormal(unsigned char* dst, const unsigned char* src, size_t count, unsigned opacity) {
+
+	size_t i = 0;
+#if defined(COMPOSITOR_NEON)
+	const uint16x4_t scale = vdup_n_u16(opacity);
+	const uint16x8_t full = vdupq_n_u16(OPAQUE);
+	for (; i + 8 <= count; i += 8) {
+		uint8x8x4_t s = vld4_u8(src + i * BYTES_PER_PIXEL);
+		uint8x8x4_t d = vld4_u8(dst + i * BYTES_PER_PIXEL);
+		uint16x8_t alpha = vmovl_u8(s.val[3]);
+		alpha = vaddq_u16(alpha, vshrq_n_u16(alpha, 7));
+		uint16x8_t weight = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(alpha), scale), 8),
+										 vshrn_n_u32(vmull_u16(vget_high_u16(alpha), scale), 8));
+		uint16x8_t inverse = vsubq_u16(full, weight);
+		for (unsigned c = 0; c < BYTES_PER_PIXEL; ++c) {
+			uint16x8_t sum = vmlaq_u16(vmulq_u16(vmovl_u8(s.val[c]), weight), vmovl_u8(d.val[c]), inverse);
+			d.val[c] = vshrn_n_u16(sum, 8);
+		}
+		vst4_u8(dst + i * BYTES_PER_PIXEL, d);
+	}
+#elif defined(COMPOSITOR_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opacity2 = _mm_set1_epi16(opacity << 1);
+	const __m128i full = _mm_set1_epi16(OPAQUE);
+	for (; i + 4 <= count; i += 4) {
+		__m128i* out = (__m128i*)(dst + i * BYTES_PER_PIXEL);
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i * BYTES_PER_PIXEL));
+		__m128i d = _mm_loadu_si128(out);
+		__m128i weightLo, weightHi;
+		Weights(s, opacity2, &weightLo, &weightHi);
+		// both products are at most 255 * 256 together, so the 16 bit sums don't overflow
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), weightLo),
+								   _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, weightLo)));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), weightHi),
+								   _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, weightHi)));
+		_mm_storeu_si128(out, _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+#endif
+	for (; i < count; ++i, src += BYTES_PER_PIXEL, dst += BYTES_PER_PIXEL) {
+		unsigned weight = Weight(src[3], opacity);
+		for (unsigned c = 0; c < BYTES_PER_PIXEL; ++c) {
+			dst[c] = (src[c] * weight + dst[c] * (OPAQUE - weight)) >> 8;
+		}
+	}
+}
+
+// dst = dst + src * weight, per channel, saturating
+static void BlendAdd(unsigned char* dst, const unsigned char* src, size_t count, unsigned opacity) {
+
+	size_t i = 0;
+#if defined(COMPOSITOR_NEON)
+	const uint16x4_t scale = vdup_n_u16(opacity);
+	for (; i + 8 <= count; i += 8) {
+		uint8x8x4_t s = vld4_u8(src + i * BYTES_PER_PIXEL);
+		uint8x8x4_t d = vld4_u8(dst + i * BYTES_PER_PIXEL);
+		uint16x8_t alpha = vmovl_u8(s.val[3]);
+		alpha = vaddq_u16(alpha, vshrq_n_u16(alpha, 7));
+		uint16x8_t weight = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(alpha), scale), 8),
+										 vshrn_n_u32(vmull_u16(vget_high_u16(alpha), scale), 8));
+		for (unsigned c = 0; c < BYTES_PER_PIXEL; ++c) {
+			d.val[c] = vqadd_u8(d.val[c], vshrn_n_u16(vmulq_u16(vmovl_u8(s.val[c]), weight), 8));
+		}
+		vst4_u8(dst + i * BYTES_PER_PIXEL, d);
+	}
+#elif defined(COMPOSITOR_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opacity2 = _mm_set1_epi16(opacity << 1);
+	for (; i + 4 <= count; i += 4) {
+		__m128i* out = (__m128i*)(dst + i * BYTES_PER_PIXEL);
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i * BYTES_PER_PIXEL));
+		__m128i weightLo, weightHi;
+		Weights(s, opacity2, &weightLo, &weightHi);
+		__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), weightLo), 8);
+		__m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), weightHi), 8);
+		_mm_storeu_si128(out, _mm_adds_epu8(_mm_loadu_si128(out), _mm_packus_epi16(lo, hi)));
+	}
+#endif
+	for (; i < count; ++i, src += BYTES_PER_PIXEL, dst += BYTES_PER_PIXEL) {
+		unsigned weight = Weight(src[3], opacity);
+		for (unsigned c = 0; c < BYTES_PER_PIXEL; ++c) {
+			dst[c] = std::min(dst[c] + ((src[c] * weight) >> 8), 255u);
+		}
+	}
+}
+
+
+Compositor::Compositor(unsigned width, unsigned height)
+	: width_(width),
+	  height_(height),
+	  below_(width * height * BYTES_PER_PIXEL, 0),
+	  belowCount_(0),
+	  composed_(false) {
+}
+
+unsigned Compositor::AddLayer(Blend blend, float opacity) {
+
+	Layer layer;
+	layer.pixels.assign(width_ * height_ * BYTES_PER_PIXEL, 0);
+	layer.blend = blend;
+	layer.opacity = std::min(std::max(opacity, 0.0f), 1.0f);
+	layer.target = layer.opacity;
+	layer.rate = 0.0f;
+	layer.hideOthers = false;
+	layer.changed = true;
+	layers_.push_back(layer);
+
+	order_.push_back(layers_.size() - 1);
+	return layers_.size() - 1;
+}
+
+unsigned char* Compositor::Draw(unsigned layer) {
+	layers_[layer].changed = true;
+	return layers_[layer].pixels.data();
+}
+
+void Compositor::SetOpacity(unsigned layer, float opacity) {
+
+	Layer& l = layers_[layer];
+	opacity = std::min(std::max(opacity, 0.0f), 1.0f);
+	l.changed |= l.opacity != opacity;
+	l.opacity = l.target = opacity;
+	l.rate = 0.0f;
+	l.hideOthers = false;
+}
+
+void Compositor::FadeTo(unsigned layer, float opacity, float seconds) {
+
+	Layer& l = layers_[layer];
+	opacity = std::min(std::max(opacity, 0.0f), 1.0f);
+	if (seconds <= 0.0f || opacity == l.opacity) {
+		SetOpacity(layer, opacity);
+		return;
+	}
+	l.target = opacity;
+	l.rate = std::fabs(opacity - l.opacity) / seconds;
+	l.hideOthers = false;
+}
+
+void Compositor::Crossfade(unsigned layer, float seconds) {
+
+	if (order_.back() != layer) {
+		order_.erase(std::find(order_.begin(), order_.end(), layer));
+		order_.push_back(layer);
+		composed_ = false;
+		SetOpacity(layer, 0.0f);
+	}
+
+	FadeTo(layer, 1.0f, seconds);
+	if (layers_[layer].rate > 0.0f) {
+		layers_[layer].hideOthers = true;
+		return;
+	}
+	for (unsigned other = 0; other < layers_.size(); ++other) {
+		if (other != layer) {
+			SetOpacity(other, 0.0f);
+		}
+	}
+}
+
+void Compositor::Advance(float deltaSeconds) {
+
+	for (unsigned i = 0; i < layers_.size(); ++i) {
+		Layer& l = layers_[i];
+		if (l.rate == 0.0f) {
+			continue;
+		}
+
+		float step = l.rate * deltaSeconds;
+		l.changed = true;
+		if (std::fabs(l.target - l.opacity) > step) {
+			l.opacity += l.target > l.opacity ? step : -step;
+			continue;
+		}
+
+		bool hideOthers = l.hideOthers;
+		SetOpacity(i, l.target);
+		if (hideOthers) {
+			for (unsigned other = 0; other < layers_.size(); ++other) {
+				if (other != i) {
+					SetOpacity(other, 0.0f);
+				}
+			}
+		}
+	}
+}
+
+bool Compositor::Visible(unsigned layer) const {
+	const Layer& l = layers_[layer];
+	return l.opacity > 0.0f || (l.rate > 0.0f && l.target > 0.0f);
+}
+
+bool Compositor::Settled() const {
+	for (const Layer& l : layers_) {
+		if (l.rate > 0.0f) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Compositor::BlendLayer(const Layer& layer, unsigned char* frame) const {
+
+	unsigned opacity = std::lround(layer.opacity * OPAQUE);
+	if (opacity == 0) {
+		return;
+	}
+
+	switch (layer.blend) {
+	case Blend::NORMAL:
+		BlendNormal(frame, layer.pixels.data(), width_ * height_, opacity);
+		break;
+	case Blend::ADD:
+		BlendAdd(frame, layer.pixels.data(), width_ * height_, opacity);
+		break;
+	}
+}
+
+bool Compositor::Compose(unsigned char* frame) {
+
+	// position in order_ of the lowest layer to redo; the ones below come from below_
+	size_t lowest = 0;
+	if (composed_) {
+		while (lowest < order_.size() && !layers_[order_[lowest]].changed) {
+			++lowest;
+		}
+		if (lowest == order_.size()) {
+			return false;
+		}
+	}
+
+	if (lowest < belowCount_) {
+		std::fill(below_.begin(), below_.end(), 0);
+		belowCount_ = 0;
+	}
+	for (; belowCount_ < lowest; ++belowCount_) {
+		BlendLayer(layers_[order_[belowCount_]], below_.data());
+	}
+
+	memcpy(frame, below_.data(), below_.size());
+	for (size_t i = lowest; i < order_.size(); ++i) {
+		BlendLayer(layers_[order_[i]], frame);
+	}
+
+	for (Layer& l : layers_) {
+		l.changed = false;
+	}
+	composed_ = true;
+	return true;
+}
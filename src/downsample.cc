@@ -0,0 +1,85 @@
+#include "downsample.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DOWNSAMPLE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define DOWNSAMPLE_SSE2
+#endif
+
+
+constexpr unsigned BYTES_PER_PIXEL = 4;
+constexpr unsigned MAX_FACTOR = 16; // the 16 bit sums hold factor * 255 per channel; block totals are unsigned
+
+
+// sums[i] += bytes[i] for "count" channels
+static void AccumulateRow(uint16_t* sums, const unsigned char* bytes, size_t count) {
+
+	size_t i = 0;
+#if defined(DOWNSAMPLE_NEON)
+	for (; i + 16 <= count; i += 16) {
+		uint8x16_t b = vld1q_u8(bytes + i);
+		vst1q_u16(sums + i, vaddw_u8(vld1q_u16(sums + i), vget_low_u8(b)));
+		vst1q_u16(sums + i + 8, vaddw_u8(vld1q_u16(sums + i + 8), vget_high_u8(b)));
+	}
+#elif defined(DOWNSAMPLE_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= count; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i*)(bytes + i));
+		__m128i* lo = (__m128i*)(sums + i);
+		__m128i* hi = (__m128i*)(sums + i + 8);
+		_mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo), _mm_unpacklo_epi8(b, zero)));
+		_mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi), _mm_unpackhi_epi8(b, zero)));
+	}
+#endif
+	for (; i < count; ++i) {
+		sums[i] += bytes[i];
+	}
+}
+
+
+Downsampler::Downsampler(unsigned width, unsigned height, unsigned factor)
+	: width_(width),
+	  height_(height),
+	  factor_(std::min(std::max(factor, 1u), MAX_FACTOR)),
+	  sums_(width * factor_ * BYTES_PER_PIXEL) {
+}
+
+void Downsampler::Reduce(const unsigned char* src, unsigned char* dst) {
+
+	const size_t srcRowSize = width_ * factor_ * BYTES_PER_PIXEL;
+
+	if (factor_ == 1) {
+		memcpy(dst, src, srcRowSize * height_);
+		return;
+	}
+
+	// (total + area / 2) / area as a multiplication; exact for totals below 2^24
+	const unsigned area = factor_ * factor_;
+	const uint64_t reciprocal = ((1ull << 32) + area - 1) / area;
+
+	for (unsigned y = 0; y < height_; ++y) {
+
+		std::fill(sums_.begin(), sums_.end(), 0);
+		for (unsigned row = 0; row < factor_; ++row) {
+			AccumulateRow(sums_.data(), src + (y * factor_ + row) * srcRowSize, srcRowSize);
+		}
+
+		const uint16_t* block = sums_.data();
+		for (unsigned x = 0; x < width_; ++x, dst += BYTES_PER_PIXEL) {
+			unsigned total[BYTES_PER_PIXEL] = { 0, 0, 0, 0 };
+			for (unsigned column = 0; column < factor_; ++column, block += BYTES_PER_PIXEL) {
+				for (unsigned c = 0; c < BYTES_PER_PIXEL; ++c) {
+					total[c] += block[c];
+				}
+			}
+			for (unsigned c = 0; c < BYTES_PER_PIXEL; ++c) {
+				dst[c] = ((total[c] + area / 2) * reciprocal) >> 32;
+			}
+		}
+	}
+}
@@ -0,0 +1,107 @@
+#include "frame-diff.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FRAME_DIFF_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define FRAME_DIFF_SSE2
+#endif
+
+
+constexpr unsigned BYTES_PER_PIXEL = 4;
+constexpr unsigned MERGE_GAP = 4; // pixels; closer runs are sent as one, a call costs more than a few pixels
+
+
+// bit i is set if pixel i of the four differs
+static inline unsigned DiffMask4(const uint32_t* a, const uint32_t* b) {
+#if defined(FRAME_DIFF_NEON)
+	static const uint32_t bits[4] = { 1, 2, 4, 8 };
+	uint32x4_t differ = vmvnq_u32(vceqq_u32(vld1q_u32(a), vld1q_u32(b)));
+	uint32x4_t masked = vandq_u32(differ, vld1q_u32(bits));
+	uint32x2_t sum = vpadd_u32(vget_low_u32(masked), vget_high_u32(masked));
+	return vget_lane_u32(vpadd_u32(sum, sum), 0);
+#elif defined(FRAME_DIFF_SSE2)
+	__m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+	return ~_mm_movemask_ps(_mm_castsi128_ps(equal)) & 0xf;
+#else
+	return (a[0] != b[0]) | (a[1] != b[1]) << 1 | (a[2] != b[2]) << 2 | (a[3] != b[3]) << 3;
+#endif
+}
+
+
+FrameDiff::FrameDiff(unsigned width, unsigned height)
+	: width_(width),
+	  height_(height),
+	  last_(nullptr) {
+}
+
+bool FrameDiff::Update(const void* target, const unsigned char* frame, const Span& span) {
+
+	const size_t rowSize = width_ * BYTES_PER_PIXEL;
+	const size_t frameSize = rowSize * height_;
+
+	if (last_ && memcmp(last_->data(), frame, frameSize) == 0) {
+		return false;
+	}
+
+	std::vector<unsigned char>& held = targets_[target];
+	last_ = &held;
+
+	if (held.empty()) {
+		for (unsigned y = 0; y < height_; ++y) {
+			span(0, y, width_, frame + y * rowSize);
+		}
+		held.assign(frame, frame + frameSize);
+		return true;
+	}
+
+	for (unsigned y = 0; y < height_; ++y) {
+
+		const unsigned char* row = frame + y * rowSize;
+		unsigned char* heldRow = held.data() + y * rowSize;
+
+		if (memcmp(row, heldRow, rowSize) == 0) {
+			continue;
+		}
+
+		const uint32_t* a = reinterpret_cast<const uint32_t*>(row);
+		const uint32_t* b = reinterpret_cast<const uint32_t*>(heldRow);
+		int runStart = -1;
+		int lastChanged = 0;
+
+		for (unsigned x = 0; x < width_; x += 4) {
+
+			unsigned mask;
+			if (x + 4 <= width_) {
+				mask = DiffMask4(a + x, b + x);
+			}
+			else {
+				mask = 0;
+				for (unsigned i = 0; x + i < width_; ++i) {
+					mask |= (a[x + i] != b[x + i]) << i;
+				}
+			}
+
+			for (; mask; mask &= mask - 1) {
+				int changed = x + __builtin_ctz(mask);
+				if (runStart < 0) {
+					runStart = changed;
+				}
+				else if (changed - lastChanged > (int)MERGE_GAP) {
+					span(runStart, y, lastChanged - runStart + 1, row + runStart * BYTES_PER_PIXEL);
+					runStart = changed;
+				}
+				lastChanged = changed;
+			}
+		}
+
+		span(runStart, y, lastChanged - runStart + 1, row + runStart * BYTES_PER_PIXEL);
+		memcpy(heldRow, row, rowSize);
+	}
+
+	return true;
+}
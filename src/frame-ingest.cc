@@ -0,0 +1,410 @@
+#include "frame-ingest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+
+constexpr uint32_t INGEST_MAGIC =	0x50434946; // "FICP"
+constexpr uint32_t INGEST_VERSION =	1;
+constexpr size_t ALIGNMENT =		64; // cache line; slots and frames don't share one
+constexpr unsigned BUFFERS =		3; // per slot: one being filled, one handed over, one being shown
+constexpr uint32_t INDEX_MASK =		0x3;
+constexpr uint32_t FRESH =			0x4; // the handed over buffer hasn't been taken yet
+#ifndef __linux__
+constexpr float FALLBACK_POLL =		0.002; // seconds between looks at the doorbell without futexes
+#endif
+
+
+// One producer's slot. The three buffer indices are always a permutation of
+// 0, 1, 2: the producer fills "back", the panel side shows "front", and they
+// swap theirs with "middle".
+struct alignas(ALIGNMENT) IngestSlot {
+	atomic<int32_t> owner;				// pid, 0 for a free slot
+	atomic<int32_t> priority;
+	atomic<uint32_t> sequence;			// frames published into the slot
+	atomic<uint32_t> publishedMillis;	// monotonic clock at the last one
+	atomic<uint32_t> middle;			// index | FRESH
+	uint32_t back;						// only touched by the owner
+	uint32_t front;						// only touched by the panel side
+};
+
+struct alignas(ALIGNMENT) IngestSegment {
+	atomic<uint32_t> magic;				// set last, once the rest is initialized
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t slots;
+	uint32_t bitplaneBytes;
+	uint32_t frameStride;				// bytes from one IngestFrame to the next
+	uint32_t holdMillis;
+	atomic<uint32_t> stale;				// replaced by a new segment, producers must reopen
+	atomic<uint32_t> doorbell;			// incremented with every frame
+	atomic<uint32_t> waiters;			// panel side waiting on the doorbell
+};
+
+static_assert(sizeof(atomic<uint32_t>) == sizeof(uint32_t), "futex on an atomic");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "atomics in shared memory must be lock-free");
+
+
+static size_t AlignUp(size_t bytes) {
+	return (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+static size_t FrameStride(unsigned width, unsigned height, size_t bitplaneBytes) {
+	return AlignUp(sizeof(IngestFrame) + max<size_t>(size_t(width) * height * 4, bitplaneBytes));
+}
+
+static size_t SegmentSize(unsigned slots, size_t frameStride) {
+	return sizeof(IngestSegment) + slots * (sizeof(IngestSlot) + BUFFERS * frameStride);
+}
+
+static IngestSlot* SlotAt(IngestSegment* segment, unsigned slot) {
+	return reinterpret_cast<IngestSlot*>(segment + 1) + slot;
+}
+
+static IngestFrame* FrameAt(IngestSegment* segment, unsigned slot, unsigned buffer) {
+	unsigned char* frames = reinterpret_cast<unsigned char*>(SlotAt(segment, segment->slots));
+	return reinterpret_cast<IngestFrame*>(frames + (slot * BUFFERS + buffer) * size_t(segment->frameStride));
+}
+
+static uint32_t MonotonicMillis() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return uint32_t(now.tv_sec) * 1000u + uint32_t(now.tv_nsec / 1000000);
+}
+
+static bool ProcessGone(int32_t pid) {
+	return kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+static void WaitForDoorbell(atomic<uint32_t>* doorbell, uint32_t seen, float seconds) {
+#ifdef __linux__
+	timespec timeout;
+	timeout.tv_sec = time_t(seconds);
+	timeout.tv_nsec = long((seconds - timeout.tv_sec) * 1e9f);
+	// not FUTEX_PRIVATE_FLAG: the producers are other processes
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(doorbell), FUTEX_WAIT, seen, &timeout, nullptr, 0);
+#else
+	for (float waited = 0; waited < seconds && doorbell->load() == seen; waited += FALLBACK_POLL) {
+		usleep(FALLBACK_POLL * 1e6f);
+	}
+#endif
+}
+
+static void RingDoorbell(IngestSegment* segment) {
+	segment->doorbell.fetch_add(1);
+#ifdef __linux__
+	// the panel side counts itself in before it checks the doorbell, so either it sees this ring or we see it waiting
+	if (segment->waiters.load() > 0) {
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&segment->doorbell), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	}
+#endif
+}
+
+static IngestSegment* Map(int fd, size_t size) {
+	void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return mapped == MAP_FAILED ? nullptr : static_cast<IngestSegment*>(mapped);
+}
+
+
+FrameIngest::FrameIngest(const string& name, unsigned width, unsigned height, size_t bitplaneBytes, unsigned slots, float holdSeconds)
+	: name_(name),
+	  width_(width),
+	  height_(height),
+	  bitplaneBytes_(bitplaneBytes),
+	  slots_(slots),
+	  frameStride_(FrameStride(width, height, bitplaneBytes)),
+	  holdMillis_(uint32_t(holdSeconds * 1000)),
+	  segment_(nullptr),
+	  size_(SegmentSize(slots, frameStride_)),
+	  doorbell_(0),
+	  shownSlot_(-1),
+	  shownSequence_(0) {
+}
+
+FrameIngest::~FrameIngest() {
+	// the segment stays, so producers can keep publishing into it while this restarts
+	if (segment_) {
+		munmap(segment_, size_);
+	}
+}
+
+bool FrameIngest::Open() {
+
+	int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT, 0660);
+	if (fd < 0) {
+		cout << "Couldn't open ingest segment " << name_ << ": " << strerror(errno) << endl;
+		return false;
+	}
+
+	struct stat status;
+	size_t existing = fstat(fd, &status) == 0 ? status.st_size : 0;
+	if (existing >= sizeof(IngestSegment)) {
+		segment_ = Map(fd, existing);
+	}
+	if (segment_ && existing == size_ && segment_->magic.load() == INGEST_MAGIC && segment_->version == INGEST_VERSION
+		&& segment_->width == width_ && segment_->height == height_ && segment_->slots == slots_
+		&& segment_->bitplaneBytes == bitplaneBytes_ && segment_->holdMillis == holdMillis_ && !segment_->stale.load()) {
+		close(fd);
+		doorbell_ = segment_->doorbell.load() - 1; // look at the slots right away
+		cout << "Reusing ingest segment " << name_ << endl;
+		return true;
+	}
+
+	// left over from a run with other settings: send its producers to the new one
+	if (segment_) {
+		segment_->stale.store(1);
+		RingDoorbell(segment_);
+		munmap(segment_, existing);
+		segment_ = nullptr;
+	}
+	close(fd);
+	shm_unlink(name_.c_str());
+
+	fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (fd < 0 || fchmod(fd, 0660) != 0 || ftruncate(fd, size_) != 0 || !(segment_ = Map(fd, size_))) {
+		cout << "Couldn't create ingest segment " << name_ << ": " << strerror(errno) << endl;
+		if (fd >= 0) {
+			close(fd);
+			shm_unlink(name_.c_str());
+		}
+		return false;
+	}
+	close(fd);
+
+	// fresh from ftruncate(), so all zero
+	segment_->version = INGEST_VERSION;
+	segment_->width = width_;
+	segment_->height = height_;
+	segment_->slots = slots_;
+	segment_->bitplaneBytes = bitplaneBytes_;
+	segment_->frameStride = frameStride_;
+	segment_->holdMillis = holdMillis_;
+	for (unsigned i = 0; i < slots_; ++i) {
+		IngestSlot* slot = SlotAt(segment_, i);
+		slot->back = 0;
+		slot->middle.store(1);
+		slot->front = 2;
+	}
+	segment_->magic.store(INGEST_MAGIC);
+	doorbell_ = segment_->doorbell.load() - 1;
+	return true;
+}
+
+// the highest priority among the producers that published within the hold time; the most recent one on a tie
+int FrameIngest::ChooseSlot(uint32_t nowMillis) {
+
+	int chosen = -1;
+	int32_t chosenPriority = 0;
+	uint32_t chosenAge = 0;
+	for (unsigned i = 0; i < slots_; ++i) {
+		IngestSlot* slot = SlotAt(segment_, i);
+		int32_t owner = slot->owner.load();
+		if (!owner) {
+			continue;
+		}
+		uint32_t age = nowMillis - slot->publishedMillis.load();
+		if (age >= holdMillis_) {
+			// quiet for a while: free the slot if its producer died without releasing it
+			if (ProcessGone(owner)) {
+				slot->owner.compare_exchange_strong(owner, 0);
+			}
+			continue;
+		}
+		int32_t priority = slot->priority.load();
+		if (chosen < 0 || priority > chosenPriority || (priority == chosenPriority && age < chosenAge)) {
+			chosen = i;
+			chosenPriority = priority;
+			chosenAge = age;
+		}
+	}
+	return chosen;
+}
+
+const IngestFrame* FrameIngest::FrameAt(unsigned slot, unsigned buffer) const {
+	const unsigned char* frames = reinterpret_cast<const unsigned char*>(SlotAt(segment_, slots_));
+	return reinterpret_cast<const IngestFrame*>(frames + (slot * BUFFERS + buffer) * frameStride_);
+}
+
+bool FrameIngest::Next(float timeoutSeconds, IngestView* view) {
+
+	uint32_t doorbell = segment_->doorbell.load();
+	if (doorbell == doorbell_) {
+		segment_->waiters.fetch_add(1);
+		WaitForDoorbell(&segment_->doorbell, doorbell, timeoutSeconds);
+		segment_->waiters.fetch_sub(1);
+		doorbell = segment_->doorbell.load();
+	}
+	doorbell_ = doorbell;
+
+	int chosen = ChooseSlot(MonotonicMillis());
+	if (chosen < 0) {
+		shownSlot_ = -1;
+		return false;
+	}
+
+	// everything in the segment is writable by producers: indices, format and length are
+	// copied once, checked, and only the copies used from there on
+	IngestSlot* slot = SlotAt(segment_, chosen);
+	if (slot->middle.load(memory_order_acquire) & FRESH) {
+		slot->front = slot->middle.exchange(slot->front, memory_order_acq_rel) & INDEX_MASK;
+	}
+	const uint32_t front = slot->front;
+	if (front >= BUFFERS) {
+		return false; // not a buffer of ours; skip the slot
+	}
+	const IngestFrame* frame = FrameAt(chosen, front);
+	const uint32_t sequence = frame->sequence;
+	if (sequence == 0 || (chosen == shownSlot_ && sequence == shownSequence_)) {
+		return false;
+	}
+	shownSlot_ = chosen;
+	shownSequence_ = sequence;
+
+	const IngestFormat format = frame->format;
+	const size_t length = frame->length;
+	bool valid = (format == IngestFormat::RGBA && length == size_t(width_) * height_ * 4)
+		|| (format == IngestFormat::BITPLANES && bitplaneBytes_ && length == bitplaneBytes_);
+	if (!valid) {
+		return false;
+	}
+	view->format = format;
+	view->length = length;
+	view->data = frame->Data();
+	return true;
+}
+
+
+IngestProducer::IngestProducer(const string& name, int priority)
+	: name_(name),
+	  priority_(priority),
+	  segment_(nullptr),
+	  size_(0),
+	  slot_(-1) {
+}
+
+IngestProducer::~IngestProducer() {
+	Release();
+	if (segment_) {
+		munmap(segment_, size_);
+	}
+}
+
+bool IngestProducer::Open() {
+
+	Release();
+	if (segment_) {
+		munmap(segment_, size_);
+		segment_ = nullptr;
+	}
+
+	int fd = shm_open(name_.c_str(), O_RDWR, 0);
+	if (fd < 0) {
+		return false; // not running yet
+	}
+	struct stat status;
+	if (fstat(fd, &status) == 0 && size_t(status.st_size) >= sizeof(IngestSegment)) {
+		size_ = status.st_size;
+		segment_ = Map(fd, size_);
+	}
+	close(fd);
+
+	if (!segment_ || segment_->magic.load() != INGEST_MAGIC || segment_->version != INGEST_VERSION
+		|| size_ < SegmentSize(segment_->slots, segment_->frameStride)) {
+		if (segment_) {
+			munmap(segment_, size_);
+			segment_ = nullptr;
+		}
+		return false;
+	}
+
+	const int32_t pid = getpid();
+	for (unsigned i = 0; i < segment_->slots && slot_ < 0; ++i) {
+		IngestSlot* slot = SlotAt(segment_, i);
+		int32_t owner = slot->owner.load();
+		if ((owner == 0 || ProcessGone(owner)) && slot->owner.compare_exchange_strong(owner, pid)) {
+			slot->priority.store(priority_);
+			slot->publishedMillis.store(MonotonicMillis() - segment_->holdMillis); // not shown before it publishes
+			slot_ = i;
+		}
+	}
+	if (slot_ < 0) {
+		cout << "No free ingest slot in " << name_ << endl;
+	}
+	return slot_ >= 0;
+}
+
+unsigned IngestProducer::Width() const {
+	return segment_ ? segment_->width : 0;
+}
+
+unsigned IngestProducer::Height() const {
+	return segment_ ? segment_->height : 0;
+}
+
+size_t IngestProducer::BitplaneBytes() const {
+	return segment_ ? segment_->bitplaneBytes : 0;
+}
+
+size_t IngestProducer::MaxFrameBytes() const {
+	return segment_ ? segment_->frameStride - sizeof(IngestFrame) : 0;
+}
+
+unsigned char* IngestProducer::Frame() {
+	return slot_ >= 0 ? FrameAt(segment_, slot_, SlotAt(segment_, slot_)->back)->Data() : nullptr;
+}
+
+bool IngestProducer::Publish(IngestFormat format, size_t length) {
+
+	if (slot_ < 0 || segment_->stale.load()) {
+		return false;
+	}
+	bool fits = (format == IngestFormat::RGBA && length == size_t(segment_->width) * segment_->height * 4)
+		|| (format == IngestFormat::BITPLANES && segment_->bitplaneBytes && length == segment_->bitplaneBytes);
+	if (!fits) {
+		return false;
+	}
+
+	IngestSlot* slot = SlotAt(segment_, slot_);
+	IngestFrame* frame = FrameAt(segment_, slot_, slot->back);
+	uint32_t sequence = slot->sequence.fetch_add(1) + 1;
+	frame->sequence = sequence ? sequence : slot->sequence.fetch_add(1) + 1; // 0 means none
+	frame->format = format;
+	frame->length = length;
+
+	slot->back = slot->middle.exchange(slot->back | FRESH, memory_order_acq_rel) & INDEX_MASK;
+	slot->publishedMillis.store(MonotonicMillis());
+	RingDoorbell(segment_);
+	return true;
+}
+
+void IngestProducer::Release() {
+
+	if (slot_ < 0) {
+		return;
+	}
+	IngestSlot* slot = SlotAt(segment_, slot_);
+	slot->publishedMillis.store(MonotonicMillis() - segment_->holdMillis);
+	int32_t pid = getpid();
+	slot->owner.compare_exchange_strong(pid, 0);
+	RingDoorbell(segment_); // so the panel moves on right away
+	slot_ = -1;
+}
@@ -0,0 +1,73 @@
+#include "frame-scheduler.h"
+
+#include <cerrno>
+
+
+constexpr long NANOS_PER_SECOND = 1000000000L;
+constexpr float MIN_FPS = 1.0f / 3600; // keeps the period well inside 64 bits
+
+static timespec Now() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now;
+}
+
+static long long ToNanos(const timespec& t) {
+	return (long long)t.tv_sec * NANOS_PER_SECOND + t.tv_nsec;
+}
+
+static timespec FromNanos(long long nanos) {
+	timespec t;
+	t.tv_sec = nanos / NANOS_PER_SECOND;
+	t.tv_nsec = nanos % NANOS_PER_SECOND;
+	return t;
+}
+
+static void SleepUntil(const timespec& deadline) {
+#ifdef MACOS
+	// no clock_nanosleep(): sleep for the remaining time instead
+	long long remaining = ToNanos(deadline) - ToNanos(Now());
+	if (remaining > 0) {
+		timespec t = FromNanos(remaining);
+		while (nanosleep(&t, &t) == -1 && errno == EINTR) {}
+	}
+#else
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR) {}
+#endif
+}
+
+
+FrameScheduler::FrameScheduler(float maxFPS) {
+	SetMaxFPS(maxFPS);
+	Reset();
+}
+
+void FrameScheduler::SetMaxFPS(float maxFPS) {
+	maxFPS_ = maxFPS >= MIN_FPS ? maxFPS : MIN_FPS; // false for NaN too
+	periodNanos_ = (long long)(NANOS_PER_SECOND / (double)maxFPS_);
+}
+
+double FrameScheduler::WaitForFrame() {
+
+	long long now = ToNanos(Now());
+	long long next = ToNanos(next_);
+
+	if (now < next) {
+		SleepUntil(next_);
+		now = ToNanos(Now());
+	}
+	else if (now - next > periodNanos_) {
+		next = now; // too late to keep the schedule, start over
+	}
+
+	next_ = FromNanos(next + periodNanos_);
+
+	double delta = (now - ToNanos(last_)) / (double)NANOS_PER_SECOND;
+	last_ = FromNanos(now);
+	return delta;
+}
+
+void FrameScheduler::Reset() {
+	last_ = Now();
+	next_ = last_;
+}
@@ -0,0 +1,178 @@
+#include "gif-recorder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include "gif.h"
+
+using namespace std;
+
+
+constexpr int GIF_BIT_DEPTH = 8;
+constexpr int GIF_MIN_DELAY = 2; // centiseconds; many viewers slow down anything shorter
+constexpr float PALETTE_DRIFT = 1.25; // rebuild once a reused palette's mean error is this many times what it was when built...
+constexpr float PALETTE_DRIFT_SLACK = 1.0; // ...plus this, so palettes that were exact don't go at the first miss
+constexpr unsigned PALETTE_MAX_AGE = 250; // frames before the palette is rebuilt anyway
+
+struct GifRecorder::Encoder {
+	GifWriter writer;
+	GifPalette palette;
+	bool havePalette = false;
+	unsigned paletteAge = 0;
+	float paletteError = 0; // mean error of the frame the palette was built for
+	std::vector<unsigned char> quantized; // frame being encoded, palette index in alpha
+	Clock::time_point start;
+	long emittedDelay = 0; // centiseconds since start
+};
+
+
+GifRecorder::GifRecorder(unsigned width, unsigned height, float maxFPS, unsigned poolSize)
+	: width_(width),
+	  height_(height),
+	  minInterval_(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(1.0f / maxFPS))),
+	  frames_(poolSize),
+	  free_(poolSize),
+	  ready_(poolSize),
+	  captured_(0),
+	  dropped_(0) {
+
+	for (auto &frame : frames_) {
+		frame.rgba.resize(width * height * 4);
+		free_.TryPush(&frame);
+	}
+}
+
+GifRecorder::~GifRecorder() {
+	Stop();
+}
+
+bool GifRecorder::Start(const std::string& fileName) {
+
+	if (thread_.joinable()) {
+		return false;
+	}
+
+	encoder_.reset(new Encoder);
+	if (!GifBegin(&encoder_->writer, fileName.c_str(), width_, height_, GIF_MIN_DELAY, GIF_BIT_DEPTH)) {
+		cout << "Error opening " << fileName << " for recording." << endl;
+		encoder_.reset();
+		return false;
+	}
+
+	lastCapture_ = Clock::time_point();
+	thread_ = std::thread(&GifRecorder::Run, this);
+	return true;
+}
+
+void GifRecorder::Capture(const unsigned char* rgba) {
+
+	if (!thread_.joinable()) {
+		return;
+	}
+
+	Clock::time_point now = Clock::now();
+	if (now - lastCapture_ < minInterval_) {
+		return;
+	}
+
+	Frame* frame;
+	if (!free_.TryPop(&frame)) {
+		++dropped_; // encoder is behind
+		return;
+	}
+
+	memcpy(frame->rgba.data(), rgba, frame->rgba.size());
+	frame->time = now;
+	lastCapture_ = now;
+	++captured_;
+
+	if (!ready_.TryPush(frame)) {
+		free_.TryPush(frame); // stopped
+	}
+}
+
+void GifRecorder::Stop() {
+	if (thread_.joinable()) {
+		ready_.Close();
+		thread_.join();
+		GifEnd(&encoder_->writer);
+		encoder_.reset();
+		cout << "GIF recording: " << captured_ << " frames captured, " << dropped_ << " dropped." << endl;
+	}
+}
+
+void GifRecorder::Run() {
+
+	// each frame is written once the next one arrives, as that says how long it was up
+	Frame* held = nullptr;
+	Frame* frame;
+
+	while (ready_.Pop(&frame)) {
+		if (held && held->rgba == frame->rgba) {
+			free_.TryPush(frame); // nothing new, the held frame just stays up longer
+			continue;
+		}
+		if (held) {
+			Encode(*held, frame->time);
+			free_.TryPush(held);
+		}
+		else {
+			encoder_->start = frame->time;
+		}
+		held = frame;
+	}
+
+	if (held) {
+		Encode(*held, held->time + minInterval_);
+	}
+}
+
+void GifRecorder::Encode(const Frame& frame, Clock::time_point until) {
+
+	Encoder& e = *encoder_;
+	const unsigned numPixels = width_ * height_;
+	const uint8_t* image = frame.rgba.data();
+
+	// delays are rounded to centiseconds; keep the total in step with the capture times
+	long total = lround(std::chrono::duration<double>(until - e.start).count() * 100.0);
+	long delay = max<long>(total - e.emittedDelay, GIF_MIN_DELAY);
+	e.emittedDelay += delay;
+
+	const uint8_t* oldImage = e.writer.firstFrame ? nullptr : e.writer.oldImage;
+	e.writer.firstFrame = false;
+	e.quantized.resize(numPixels * 4);
+
+	auto makePalette = [&]() {
+		GifMakePalette(oldImage, image, width_, height_, GIF_BIT_DEPTH, false, &e.palette);
+		GifClearColorCache(e.writer.colorCache);
+		e.havePalette = true;
+		e.paletteAge = 0;
+	};
+	auto quantize = [&]() {
+		return GifThresholdImage(oldImage, image, e.quantized.data(), width_, height_, &e.palette, e.writer.colorCache);
+	};
+
+	// building the palette is the expensive part, so keep using the last one while it still fits the colors
+	bool reused = e.havePalette && e.paletteAge < PALETTE_MAX_AGE;
+	if (!reused) {
+		makePalette();
+	}
+	float error = quantize();
+	if (reused && error > e.paletteError * PALETTE_DRIFT + PALETTE_DRIFT_SLACK) {
+		makePalette(); // drifted off
+		error = quantize();
+		reused = false;
+	}
+	if (reused) {
+		++e.paletteAge;
+	}
+	else {
+		e.paletteError = error;
+	}
+
+	// same as GifWriteFrame(), with our palette
+	memcpy(e.writer.oldImage, e.quantized.data(), e.quantized.size());
+	GifWriteLzwImage(e.writer.f, e.writer.oldImage, 0, 0, width_, height_, delay, &e.palette);
+}
@@ -1,10 +1,15 @@
 
 
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
 #include <ctime>
-#include <fstream>
 #include <iostream>
 #include <math.h>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -16,8 +21,27 @@
 #include "rotator.h"
 #include "yarandom.h"
 
-
-
+#include "compositor.h"
+#include "downsample.h"
+#include "embedded-shaders.h"
+#include "frame-diff.h"
+#include "frame-ingest.h"
+#include "frame-scheduler.h"
+#include "gif-recorder.h"
+#include "mesh.h"
+#include "metrics.h"
+#include "program-cache.h"
+#include "rasterizer.h"
+#include "render-target.h"
+#include "scene.h"
+#include "scene-cache.h"
+#include "scene-renderer.h"
+#include "snapshot-reader.h"
+#include "upload-thread.h"
+
+
+
+#include <sys/stat.h>
 #include <unistd.h>
 
 
@@ -33,8 +57,10 @@
 using rgb_matrix::GPIO;
 using rgb_matrix::RGBMatrix;
 using rgb_matrix::Canvas;
+using rgb_matrix::FrameCanvas;
 
-Canvas *led_canvas = nullptr;
+RGBMatrix *led_matrix = nullptr;
+FrameCanvas *led_canvas = nullptr; // off-screen, handed to the refresh thread with PublishFrame()
 
 #endif
 
@@ -55,31 +81,38 @@ constexpr unsigned	FB_SCALE = 			16.0;
 #endif
 constexpr unsigned  FB_WIDTH =      	64 * FB_SCALE;
 constexpr unsigned  FB_HEIGHT =     	32 * FB_SCALE;
-constexpr unsigned  MSAA_SAMPLES =      16;
-constexpr float		TARGET_FPS =		140.0; // FPS
+constexpr unsigned  MSAA_SAMPLES =      16; // default; --msaa=N
+constexpr unsigned	MAX_MSAA =			16; // the most either renderer takes
+constexpr unsigned	SUPERSAMPLE =		1; // render at this multiple of FB_WIDTH x FB_HEIGHT, box filtered down; --supersample=N
+constexpr unsigned	MAX_SUPERSAMPLE =	16;
+constexpr float		TARGET_FPS =		140.0; // FPS, default cap; --fps=N
+constexpr double	IDLE_POLL_INTERVAL = 0.1; // seconds between event checks while idle
 constexpr float     FOV =               30.0; // degrees
 constexpr float		CAM_DISTANCE =		4.0; // units
 constexpr float		FPS_SAMPLE_RATE = 	0.5; // seconds
+constexpr unsigned	BYTES_PER_COMP =	4; // RGBA snapshots
+constexpr unsigned	SNAPSHOT_BUFFERS =	2; // PBO ring size; snapshots lag (SNAPSHOT_BUFFERS - 1) frames
+constexpr unsigned	UPLOAD_QUEUE_DEPTH = 2; // frames
+constexpr float		CROSSFADE_SECONDS =	0.5; // fade between modes on the panel; --crossfade=SECONDS, 0 cuts
+constexpr float		RECORD_FPS =		25.0; // max frames per second in --record GIFs
+constexpr unsigned	RECORD_POOL_FRAMES = 8; // frames waiting for the GIF encoder before dropping
+constexpr float		CACHE_SECONDS =		60.0; // length of the loop baked by --cache; --cache-seconds=N
+constexpr float		METRICS_INTERVAL =	10.0; // seconds between rewrites of the --metrics file
+constexpr const char* INGEST_NAME =	"/picube"; // shared memory segment of --ingest; --ingest=NAME
+constexpr unsigned	INGEST_SLOTS =		4; // producers publishing to --ingest at once
+constexpr float		INGEST_HOLD_SECONDS = 2.0; // a producer that doesn't publish for this long gives up the panel
 
 // configure the random movement of the object
 
-// since xscreensaver's 'rotator' is time-independent, and it was tuned for 60fps, scale to our target fps.
-constexpr float 	SPIN_SPEED = 		0.15 * (60.0 / TARGET_FPS);
-constexpr float 	WANDER_SPEED = 		0.0035 * (60.0 / TARGET_FPS);
-constexpr float 	SPIN_ACCEL = 		0.2;// * (60.0 / TARGET_FPS);
+// the rotator steps at a fixed rate internally (see advance_rotator()), so these don't depend on TARGET_FPS.
+constexpr float 	SPIN_SPEED = 		0.15;
+constexpr float 	WANDER_SPEED = 		0.0035;
+constexpr float 	SPIN_ACCEL = 		0.2;
 constexpr float		WANDER_X =			3.0;
 constexpr float		WANDER_Y =			1.0;
 constexpr float		WANDER_Z =			1.0;
 
 
-typedef struct {
-	glm::vec3 position;
-	glm::vec3 normal;
-	glm::vec3 color;
-} Vertex;
-
-
-
 enum class MODE : unsigned {
 
 	BLANK,
@@ -90,6 +123,206 @@ enum class MODE : unsigned {
 
 MODE g_mode = MODE::EMISSIVE_CUBE;
 
+// each mode draws into a layer of its own; switching modes crossfades between them
+unsigned ModeLayer(MODE mode) {
+	return static_cast<unsigned>(mode);
+}
+
+// one layer per mode, showing g_mode. BLANK is opaque black and never redrawn.
+void AddModeLayers(Compositor* compositor) {
+	for (unsigned mode = 0; mode < static_cast<unsigned>(MODE::END); ++mode) {
+		compositor->AddLayer(Compositor::Blend::NORMAL, 0.0f);
+	}
+	unsigned char* blank = compositor->Draw(ModeLayer(MODE::BLANK));
+	for (unsigned i = 0; i < FB_WIDTH * FB_HEIGHT; ++i) {
+		blank[i * BYTES_PER_COMP + 3] = 255;
+	}
+	compositor->Crossfade(ModeLayer(g_mode), 0.0f);
+}
+
+volatile sig_atomic_t g_quit = 0;
+
+FrameMetrics g_metrics; // stage timings of every frame, exported with --metrics
+
+const chrono::steady_clock::time_point g_startTime = chrono::steady_clock::now();
+
+// how long after launch "what" was done
+void LogStartup(const string& what) {
+	auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - g_startTime);
+	cout << (what + " after " + to_string(elapsed.count()) + " ms\n") << flush; // one write, other threads log too
+}
+
+
+enum class HEADLESS : unsigned {
+
+	OFF,		// render into a GLFW window
+	OSMESA,		// no window system, software GL (e.g. llvmpipe)
+	EGL			// no window system, EGL surfaceless context on the GPU
+};
+
+enum class RENDERER : unsigned {
+
+	GL,			// OpenGL, in a window or headless
+	CPU			// Rasterizer, no GL at all
+};
+
+// command line options of picube itself. everything else is left for the LED matrix (--led-*).
+struct AppOptions {
+	HEADLESS headless = HEADLESS::OFF;		// --headless[=osmesa|egl]
+	RENDERER renderer = RENDERER::GL;		// --renderer=gl|cpu
+	float maxFPS = TARGET_FPS;				// --fps=N
+	float crossfadeSeconds = CROSSFADE_SECONDS; // --crossfade=SECONDS
+	unsigned msaa = MSAA_SAMPLES;			// --msaa=N
+	unsigned supersample = SUPERSAMPLE;		// --supersample=N
+	string recordFile;						// --record=FILE.gif
+	string meshFile;						// --mesh=FILE.obj
+	unsigned objects = 1;					// --objects=N
+	string cacheDir;						// --cache=DIR
+	float cacheSeconds = CACHE_SECONDS;		// --cache-seconds=N
+	string metricsTarget;					// --metrics=FILE|unix:PATH
+	string ingestName;						// --ingest[=NAME]
+	string programCacheDir = ProgramCache::DefaultDir(); // --program-cache=DIR, empty to turn it off
+};
+
+AppOptions ParseAppOptions(int* argc, char* argv[]) {
+
+	AppOptions options;
+	int kept = 1;
+
+	for (int i = 1; i < *argc; ++i) {
+		string arg = argv[i];
+
+		if (arg == "--headless" || arg == "--headless=osmesa") {
+			options.headless = HEADLESS::OSMESA;
+		}
+		else if (arg == "--headless=egl") {
+			options.headless = HEADLESS::EGL;
+		}
+		else if (arg == "--renderer=gl") {
+			options.renderer = RENDERER::GL;
+		}
+		else if (arg == "--renderer=cpu") {
+			options.renderer = RENDERER::CPU;
+		}
+		else if (arg.compare(0, 9, "--record=") == 0) {
+			options.recordFile = arg.substr(9);
+		}
+		else if (arg.compare(0, 7, "--mesh=") == 0) {
+			options.meshFile = arg.substr(7);
+		}
+		else if (arg.compare(0, 10, "--objects=") == 0) {
+			int objects = atoi(arg.c_str() + 10);
+			if (objects > 0) {
+				options.objects = objects;
+			}
+			else {
+				cout << "Ignoring invalid " << arg << endl;
+			}
+		}
+		else if (arg.compare(0, 10, "--metrics=") == 0) {
+			options.metricsTarget = arg.substr(10);
+		}
+		else if (arg == "--ingest") {
+			options.ingestName = INGEST_NAME;
+		}
+		else if (arg.compare(0, 9, "--ingest=") == 0) {
+			options.ingestName = arg.substr(9);
+		}
+		else if (arg.compare(0, 16, "--program-cache=") == 0) {
+			options.programCacheDir = arg.substr(16);
+		}
+		else if (arg.compare(0, 8, "--cache=") == 0) {
+			options.cacheDir = arg.substr(8);
+		}
+		else if (arg.compare(0, 16, "--cache-seconds=") == 0) {
+			float seconds = atof(arg.c_str() + 16);
+			if (seconds > 0) {
+				options.cacheSeconds = seconds;
+			}
+			else {
+				cout << "Ignoring invalid " << arg << endl;
+			}
+		}
+		else if (arg.compare(0, 12, "--crossfade=") == 0) {
+			float seconds = atof(arg.c_str() + 12);
+			if (seconds >= 0) {
+				options.crossfadeSeconds = seconds;
+			}
+			else {
+				cout << "Ignoring invalid " << arg << endl;
+			}
+		}
+		else if (arg.compare(0, 7, "--msaa=") == 0) {
+			char* end;
+			long samples = strtol(arg.c_str() + 7, &end, 10); // 0 is valid, so garbage mustn't read as 0
+			if (end != arg.c_str() + 7 && *end == '\0' && samples >= 0 && samples <= (long)MAX_MSAA) {
+				options.msaa = samples;
+			}
+			else {
+				cout << "Ignoring invalid " << arg << endl;
+			}
+		}
+		else if (arg.compare(0, 14, "--supersample=") == 0) {
+			int factor = atoi(arg.c_str() + 14);
+			if (factor >= 1 && factor <= (int)MAX_SUPERSAMPLE) {
+				// a power of two, as RenderTarget halves its way down; the same for --renderer=cpu
+				options.supersample = 1;
+				while (options.supersample * 2 <= (unsigned)factor) {
+					options.supersample *= 2;
+				}
+				if (options.supersample != (unsigned)factor) {
+					cout << "Rounding " << arg << " down to " << options.supersample << endl;
+				}
+			}
+			else {
+				cout << "Ignoring invalid " << arg << endl;
+			}
+		}
+		else if (arg.compare(0, 6, "--fps=") == 0) {
+			float fps = atof(arg.c_str() + 6);
+			if (fps > 0) {
+				options.maxFPS = fps;
+			}
+			else {
+				cout << "Ignoring invalid " << arg << endl;
+			}
+		}
+		else {
+			argv[kept++] = argv[i];
+		}
+	}
+
+	*argc = kept;
+	argv[kept] = nullptr;
+
+	return options;
+}
+
+// everything the baked frames depend on: the scene, its timing and the panel (all remaining args are --led-* flags)
+string SceneKey(const AppOptions& options, int argc, char* argv[]) {
+
+	ostringstream key;
+	key << "cube " << FB_WIDTH << "x" << FB_HEIGHT << " msaa " << options.msaa << " supersample " << options.supersample
+		<< " fov " << FOV << " cam " << CAM_DISTANCE
+		<< " spin " << SPIN_SPEED << " " << SPIN_ACCEL
+		<< " wander " << WANDER_SPEED << " " << WANDER_X << " " << WANDER_Y << " " << WANDER_Z
+		<< " fps " << options.maxFPS << " seconds " << options.cacheSeconds
+		<< " renderer " << (options.renderer == RENDERER::CPU ? "cpu" : "gl")
+		<< " mesh " << options.meshFile << " objects " << options.objects;
+	struct stat mesh;
+	if (!options.meshFile.empty() && stat(options.meshFile.c_str(), &mesh) == 0) { // an edited mesh bakes again
+		key << " modified " << mesh.st_mtime << " size " << mesh.st_size;
+	}
+	for (int i = 1; i < argc; ++i) {
+		key << " " << argv[i];
+	}
+	return key.str();
+}
+
+void SignalHandler(int signal) {
+	g_quit = 1;
+}
+
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
 
@@ -147,7 +380,8 @@ void GLFWErrorCallback(int error, const char* description) {
 	cout << "GLFWErrorCallback(): error: " << error << ", description: " << description << endl;
 }
 
-GLFWwindow* InitializeGLFW() {
+// "samples" is for the window's own framebuffer, 0 when rendering into a RenderTarget
+GLFWwindow* InitializeGLFW(HEADLESS headless, unsigned samples) {
 
 	cout << "InitializeGLFW()" << endl;
 
@@ -157,6 +391,18 @@ GLFWwindow* InitializeGLFW() {
 
 	glfwSetErrorCallback(GLFWErrorCallback);
 
+	if (headless != HEADLESS::OFF) {
+#if GLFW_VERSION_MAJOR > 3 || (GLFW_VERSION_MAJOR == 3 && GLFW_VERSION_MINOR >= 4)
+		// no X at all: GLFW's null platform only hosts the context
+		glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+		if (headless == HEADLESS::EGL) {
+			setenv("EGL_PLATFORM", "surfaceless", 0); // Mesa: don't look for a display server
+		}
+#else
+		cout << "GLFW < 3.4 has no null platform, headless mode still needs a display." << endl;
+#endif
+	}
+
 	if (glfwInit()) {
 		cout << "GLFW Initialized." << endl;
 	}
@@ -169,9 +415,19 @@ GLFWwindow* InitializeGLFW() {
 
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
-	glfwWindowHint(GLFW_SAMPLES, MSAA_SAMPLES);
 
-	//glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE); // try off-screen rendering for xserver crash -- no go.
+	if (headless == HEADLESS::OFF) {
+		glfwWindowHint(GLFW_SAMPLES, samples);
+	}
+	else {
+		// rendering goes to a RenderTarget, the window is never shown or swapped
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+#if GLFW_VERSION_MAJOR > 3 || (GLFW_VERSION_MAJOR == 3 && GLFW_VERSION_MINOR >= 4)
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API,
+					   headless == HEADLESS::EGL ? GLFW_EGL_CONTEXT_API : GLFW_OSMESA_CONTEXT_API);
+#endif
+	}
+
 	GLFWwindow* window = glfwCreateWindow(FB_WIDTH, FB_HEIGHT, "picube", NULL, NULL);
 	if (!window) {
 		cout << "Error creating GLFW window." << endl;
@@ -184,12 +440,18 @@ GLFWwindow* InitializeGLFW() {
 	return window;
 }
 
-bool InitializeGLEW() {
+bool InitializeGLEW(HEADLESS headless) {
 
 	// NOTE: OpenGL context must be setup first
 
 	glewExperimental = GL_TRUE;
 	GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	// GLEW also wants GLX, which an OSMesa/EGL context doesn't have. the GL entry points are loaded regardless.
+	if (err == GLEW_ERROR_NO_GLX_DISPLAY && headless != HEADLESS::OFF) {
+		err = GLEW_OK;
+	}
+#endif
 	if (err != GLEW_OK) {
 		cout << "Error initializing GLEW: " << err << endl;
 		return false;
@@ -205,47 +467,87 @@ bool InitializeGLEW() {
 }
 
 #ifdef LINUX
-bool InitializeLEDMatrix(int argc, char* argv[]) {
-	
-	RGBMatrix::Options defaults;
-	defaults.hardware_mapping = "adafruit-hat";
-	defaults.rows = 32;
-	defaults.cols = 64;
-	defaults.chain_length = 1;
-	defaults.parallel = 1;
-	defaults.show_refresh_rate = false;
-	led_canvas = rgb_matrix::CreateMatrixFromFlags(&argc, &argv, &defaults);
-	led_canvas->Fill(0, 0, 0);
-	
-	return led_canvas;
-}
-#endif
-
-string LoadTextFile(const string &path) {
+// panel refresh times from the LED matrix thread
+class RefreshMetrics : public RGBMatrix::RefreshObserver {
+public:
+	void OnRefresh(uint32_t usec) override {
+		g_metrics[FrameMetrics::REFRESH].Record(usec);
+	}
+};
 
-	string line;
-	string source = "";
-	ifstream infile;
+RefreshMetrics g_refreshMetrics;
 
-	infile.open(path);
+RGBMatrix::Options g_ledOptions;
+rgb_matrix::RuntimeOptions g_ledRuntime;
 
-	if (infile.is_open()) {
+// the --led-* flags, left in argv for SceneKey(). call before starting any thread: --led-daemon forks.
+bool ParseLEDFlags(int argc, char* argv[]) {
 
-		while (!infile.eof()) {
-			getline(infile, line);
-			//cout << line << endl;
-			source += line;
-			source += "\n";
+	g_ledOptions.hardware_mapping = "adafruit-hat";
+	g_ledOptions.rows = 32;
+	g_ledOptions.cols = 64;
+	g_ledOptions.chain_length = 1;
+	g_ledOptions.parallel = 1;
+	g_ledOptions.show_refresh_rate = false;
+	if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv, &g_ledOptions, &g_ledRuntime, false)) {
+		return false;
+	}
+	if (g_ledRuntime.daemon > 0) {
+		if (daemon(1, 0) != 0) {
+			perror("Failed to become daemon");
 		}
+		g_ledRuntime.daemon = 0; // done
+	}
+	return true;
+}
 
-		infile.close();
+// keeping root if "dropPrivileges" is false, for GL to open its devices meanwhile; see DropLEDPrivileges()
+bool InitializeLEDMatrix(bool dropPrivileges) {
+
+	rgb_matrix::RuntimeOptions runtime = g_ledRuntime;
+	if (!dropPrivileges && runtime.drop_privileges > 0) {
+		runtime.drop_privileges = 0;
 	}
-	else {
-		cout << "Couldn't open file: " << path << endl;
+	led_matrix = rgb_matrix::CreateMatrixFromOptions(g_ledOptions, runtime);
+	if (!led_matrix) {
+		return false;
+	}
+	led_matrix->Fill(0, 0, 0);
+	led_matrix->SetRefreshObserver(&g_refreshMetrics);
+	led_canvas = led_matrix->CreateFrameCanvas();
+	LogStartup("LED matrix ready");
+
+	return true;
+}
+
+void DropLEDPrivileges() {
+	if (g_ledRuntime.drop_privileges > 0) {
+		rgb_matrix::DropPrivileges();
 	}
+}
 
-	return source;
+// the upload stage: the pixels that changed go into led_canvas, which is then shown
+UploadThread::Upload PanelUpload(FrameDiff* frameDiff) {
+	return [frameDiff](const unsigned char* snapshot) {
+		static FrameTimer timer(&g_metrics); // only ever on the upload thread
+		timer.Start();
+		bool changed = frameDiff->Update(led_canvas, snapshot,
+										 [](unsigned x, unsigned y, unsigned width, const unsigned char* rgba) {
+			led_canvas->SetPixels(x, y, width, 1, rgba, width * BYTES_PER_COMP);
+		});
+		if (changed) { // otherwise the panel already shows this
+			led_canvas = led_matrix->PublishFrame(led_canvas); // never waits for the refresh
+			static bool first = true;
+			if (first) {
+				LogStartup("First frame on the panel");
+				first = false;
+			}
+		}
+		timer.Lap(FrameMetrics::CONVERT);
+		timer.Finish();
+	};
 }
+#endif
 
 bool CheckShaderCompile(GLuint shaderID) {
 
@@ -283,216 +585,369 @@ bool CheckProgramLink(GLuint programID) {
 	return true;
 }
 
-bool CreateProgram(string baseName, GLuint* programID) {
+GLuint CompileShader(GLenum type, const char* source) {
 
-	string prefix = "";
-#ifdef XCODE
-	prefix = "../../";
-#endif
-	string vert_path = prefix + "shaders/" + baseName + ".vert";
-	string vert_source = LoadTextFile(vert_path);
-	const char *vert_source_cstr = vert_source.c_str();
-
-	string frag_path = prefix + "shaders/" + baseName + ".frag";
-	string frag_source = LoadTextFile(frag_path);
-	const char *frag_source_cstr = frag_source.c_str();
-
-	GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vs, 1, &vert_source_cstr, NULL);
-	glCompileShader(vs);
-	CheckShaderCompile(vs);
-	GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fs, 1, &frag_source_cstr, NULL);
-	glCompileShader(fs);
-	CheckShaderCompile(fs);
-
-	GLuint prog = glCreateProgram();
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	CheckShaderCompile(shader);
+	return shader;
+}
+
+// the shaders/NAME.vert and .frag embedded at build time, linked or loaded from "cache"
+bool CreateProgram(const string& name, ProgramCache* cache, GLuint* programID) {
+
+	const EmbeddedShader* shader = nullptr;
+	for (const EmbeddedShader& embedded : EMBEDDED_SHADERS) {
+		if (name == embedded.name) {
+			shader = &embedded;
+		}
+	}
+	if (!shader) {
+		cout << "No shaders named " << name << endl;
+		return false;
+	}
+
+	GLuint prog = cache->Load(shader->vertex, shader->fragment);
+	if (prog) {
+		*programID = prog;
+		LogStartup("Program " + name + " loaded from cache");
+		return true;
+	}
+
+	GLuint vs = CompileShader(GL_VERTEX_SHADER, shader->vertex);
+	GLuint fs = CompileShader(GL_FRAGMENT_SHADER, shader->fragment);
+
+	prog = glCreateProgram();
 	glAttachShader(prog, fs);
 	glAttachShader(prog, vs);
+	cache->PrepareForSave(prog);
 
 	glLinkProgram(prog);
+	glDeleteShader(vs); // only flagged, they go with the program
+	glDeleteShader(fs);
 	if (!CheckProgramLink(prog)) {
 		return false;
 	}
+	cache->Save(shader->vertex, shader->fragment, prog);
 
 	*programID = prog;
+	LogStartup("Program " + name + " compiled");
 
 	return true;
 }
 
-unsigned CreatCube(GLint vPos, GLint vNorm, GLint vColor, GLuint* vbo) {
+mat4 CubeView() {
+	vec3 view_eye = { 0, 0, CAM_DISTANCE };
+	vec3 view_center = { 0, 0, 0 };
+	vec3 view_up = { 0, 1, 0 };
+	return lookAt(view_eye, // eye - location
+				  view_center, // center - look at
+				  view_up); // up
+}
 
-	constexpr float DIM = 1.0;
-	constexpr float HDIM = DIM/2.0;
+mat4 CubeProjection() {
+	return perspectiveFov((float)radians(FOV),
+						  (float)FB_WIDTH, (float)FB_HEIGHT,
+						  1.0f, 100.0f);
+}
 
-	const vec3 BLUE_COLOR = { 0.0/255.0, 112.0/255.0, 175.0/255.0 };
-	const vec3 GREEN_COLOR = { 29.0/255.0, 122.0/255.0, 51.0/255.0 };
-	const vec3 PURPLE_COLOR = { 133.0/255.0, 95.0/255.0, 167.0/255.0 };
+// the cube, or --mesh, as --objects objects on rotators of their own
+bool BuildScene(const AppOptions& options, Scene* scene) {
 
-	Vertex verts[] = {
+	Mesh mesh = Mesh::Cube();
+	if (!options.meshFile.empty() && !mesh.Load(options.meshFile)) {
+		return false;
+	}
+	unsigned meshIndex = scene->AddMesh(mesh);
+
+	ya_rand_init(0); // normally this is done internally by xscreensaver
+	float scale = 1.0f / sqrt((float)options.objects); // about the same area covered however many
+	for (unsigned i = 0; i < options.objects; ++i) {
+		scene->AddObject(meshIndex,
+						 make_rotator(SPIN_SPEED,
+									  SPIN_SPEED,
+									  SPIN_SPEED,
+									  SPIN_ACCEL,
+									  WANDER_SPEED,
+									  true),
+						 scale);
+	}
 
-		// default winding order is ccw
+	return true;
+}
 
-		// TOP, 1
+#ifdef LINUX
+// the scene without OpenGL: rasterized on the CPU straight into the snapshots for the panel
+void RunSoftwareRenderer(const AppOptions& options, Scene* scene, SceneCache* cache) {
 
-		{ vec3(HDIM, HDIM, HDIM),		vec3(0.0f, 1.0f, 0.0f),		PURPLE_COLOR }, 	// x, y, z
-		{ vec3(HDIM, HDIM, -HDIM),		vec3(0.0f, 1.0f, 0.0f),		PURPLE_COLOR }, 	// x, y, -z
-		{ vec3(-HDIM, HDIM, -HDIM),		vec3(0.0f, 1.0f, 0.0f),		PURPLE_COLOR }, 	// -x, y, -z
+	mat4 viewProjection = CubeProjection() * CubeView();
+	Rasterizer rasterizer(FB_WIDTH * options.supersample, FB_HEIGHT * options.supersample, options.msaa);
+	Downsampler downsampler(FB_WIDTH, FB_HEIGHT, options.supersample);
+	vector<unsigned char> supersampled(options.supersample > 1 ? rasterizer.Width() * rasterizer.Height() * BYTES_PER_COMP : 0);
 
-		// TOP, 2
+	FrameDiff frameDiff(FB_WIDTH, FB_HEIGHT);
+	UploadThread uploadThread(FB_WIDTH * FB_HEIGHT * BYTES_PER_COMP, UPLOAD_QUEUE_DEPTH, PanelUpload(&frameDiff));
 
-		{ vec3(-HDIM, HDIM, -HDIM),		vec3(0.0f, 1.0f, 0.0f),		PURPLE_COLOR }, 	// -x, y, -z
-		{ vec3(-HDIM, HDIM, HDIM),		vec3(0.0f, 1.0f, 0.0f),		PURPLE_COLOR }, 	// -x, y, z
-		{ vec3(HDIM, HDIM, HDIM),		vec3(0.0f, 1.0f, 0.0f),		PURPLE_COLOR }, 	// x, y, z
+	GifRecorder recorder(FB_WIDTH, FB_HEIGHT, RECORD_FPS, RECORD_POOL_FRAMES);
+	if (!options.recordFile.empty()) {
+		recorder.Start(options.recordFile);
+	}
 
-		// BOTTOM, 1
+	const uint32_t bakeHoldMicros = 1e6f / options.maxFPS;
+	if (cache->Enabled()) {
+		cache->StartRecording(led_matrix, options.cacheSeconds * options.maxFPS);
+	}
+	const bool baking = cache->Recording();
 
-		{ vec3(-HDIM, -HDIM, -HDIM),	vec3(0.0f, -1.0f, 0.0f),	PURPLE_COLOR },		// -x, -y, -z
-		{ vec3(HDIM, -HDIM, -HDIM),		vec3(0.0f, -1.0f, 0.0f),	PURPLE_COLOR }, 	// x, -y, -z
-		{ vec3(HDIM, -HDIM, HDIM),		vec3(0.0f, -1.0f, 0.0f),	PURPLE_COLOR },		// x, -y, z
+	Compositor compositor(FB_WIDTH, FB_HEIGHT);
+	AddModeLayers(&compositor);
+	MODE shownMode = g_mode;
 
-		// BOTTOM, 2
+	FrameScheduler scheduler(options.maxFPS);
+	FrameTimer timer(&g_metrics);
 
-		{ vec3(HDIM, -HDIM, HDIM),		vec3(0.0f, -1.0f, 0.0f),	PURPLE_COLOR },		// x, -y, z
-		{ vec3(-HDIM, -HDIM, HDIM),		vec3(0.0f, -1.0f, 0.0f),	PURPLE_COLOR },		// -x, -y, z
-		{ vec3(-HDIM, -HDIM, -HDIM),	vec3(0.0f, -1.0f, 0.0f),	PURPLE_COLOR },		// -x, -y, -z
+	while (!g_quit && !(baking && !cache->Recording())) {
 
-		// LEFT, 1
+		timer.Start();
+		float deltaSeconds = baking ? 1.0f / options.maxFPS : scheduler.WaitForFrame();
+		timer.Lap(FrameMetrics::SWAP_WAIT);
+		scene->Advance(deltaSeconds);
 
-		{ vec3(-HDIM, HDIM, HDIM),		vec3(-1.0f, 0.0f, 0.0f),	GREEN_COLOR },		// -x, y, z
-		{ vec3(-HDIM, HDIM, -HDIM),		vec3(-1.0f, 0.0f, 0.0f),	GREEN_COLOR },		// -x, y, -z
-		{ vec3(-HDIM, -HDIM, -HDIM),	vec3(-1.0f, 0.0f, 0.0f),	GREEN_COLOR },		// -x, -y, -z
+		if (g_mode != shownMode) {
+			compositor.Crossfade(ModeLayer(g_mode), options.crossfadeSeconds);
+			shownMode = g_mode;
+		}
+		compositor.Advance(deltaSeconds);
 
-		// LEFT, 2
+		if (compositor.Visible(ModeLayer(MODE::EMISSIVE_CUBE))) {
+			rasterizer.Clear(vec3(0.0f));
+			for (const Scene::Object& object : scene->Objects()) {
+				rasterizer.DrawMesh(scene->Meshes()[object.mesh], viewProjection * scene->Model(object));
+			}
 
-		{ vec3(-HDIM, -HDIM, -HDIM),	vec3(-1.0f, 0.0f, 0.0f),	GREEN_COLOR },		// -x, -y, -z
-		{ vec3(-HDIM, -HDIM, HDIM),		vec3(-1.0f, 0.0f, 0.0f),	GREEN_COLOR },		// -x, -y, z
-		{ vec3(-HDIM, HDIM, HDIM),		vec3(-1.0f, 0.0f, 0.0f),	GREEN_COLOR },		// -x, y, z
+			unsigned char* layer = compositor.Draw(ModeLayer(MODE::EMISSIVE_CUBE));
+			if (supersampled.empty()) {
+				rasterizer.Resolve(layer);
+			}
+			else {
+				rasterizer.Resolve(supersampled.data());
+				downsampler.Reduce(supersampled.data(), layer);
+			}
+		}
+		timer.Lap(FrameMetrics::RENDER);
 
-		// RIGHT, 1
+		unsigned char* snapshot = uploadThread.AcquireFrame();
+		bool composed = compositor.Compose(snapshot);
+		timer.Lap(FrameMetrics::COMPOSE);
+		timer.Finish();
 
-		{ vec3(HDIM, -HDIM, -HDIM),		vec3(1.0f, 0.0f, 0.0f),		GREEN_COLOR },		// x, -y, -z
-		{ vec3(HDIM, HDIM, -HDIM),		vec3(1.0f, 0.0f, 0.0f),		GREEN_COLOR },		// x, y, -z
-		{ vec3(HDIM, HDIM, HDIM),		vec3(1.0f, 0.0f, 0.0f),		GREEN_COLOR },		// x, y, z
+		if (!composed) {
+			uploadThread.ReleaseFrame(snapshot); // same as the last frame
+		}
+		else if (baking) {
+			cache->Record(snapshot, bakeHoldMicros);
+			uploadThread.ReleaseFrame(snapshot);
+		}
+		else {
+			recorder.Capture(snapshot);
+			uploadThread.SubmitFrame(snapshot);
+		}
+	}
+}
 
-		// RIGHT, 2
+// frames published by other processes instead of the scene, until interrupted
+void RunIngest(const AppOptions& options) {
 
-		{ vec3(HDIM, HDIM, HDIM),		vec3(1.0f, 0.0f, 0.0f),		GREEN_COLOR },		// x, y, z
-		{ vec3(HDIM, -HDIM, HDIM),		vec3(1.0f, 0.0f, 0.0f),		GREEN_COLOR },		// x, -y, z
-		{ vec3(HDIM, -HDIM, -HDIM),		vec3(1.0f, 0.0f, 0.0f),		GREEN_COLOR },		// x, -y, -z
+	if (!InitializeLEDMatrix(true)) {
+		cout << "Error initializing LED matrix." << endl;
+		exit(-1);
+	}
 
-		// FRONT, 1
+	// producers may send the canvas encoding for these --led-* flags instead of RGBA
+	const char* bitplanes;
+	size_t bitplaneBytes;
+	led_canvas->Serialize(&bitplanes, &bitplaneBytes);
 
-		{ vec3(HDIM, -HDIM, HDIM),		vec3(0.0f, 0.0f, 1.0f),		BLUE_COLOR },		// x, -y, z
-		{ vec3(HDIM, HDIM, HDIM),		vec3(0.0f, 0.0f, 1.0f),		BLUE_COLOR },		// x, y, z
-		{ vec3(-HDIM, HDIM, HDIM),		vec3(0.0f, 0.0f, 1.0f),		BLUE_COLOR },		// -x, y, z
+	FrameIngest ingest(options.ingestName, FB_WIDTH, FB_HEIGHT, bitplaneBytes, INGEST_SLOTS, INGEST_HOLD_SECONDS);
+	if (!ingest.Open()) {
+		exit(-1);
+	}
+	cout << "Showing frames published to " << options.ingestName << endl;
 
-		// FRONT, 2
+	FrameTimer timer(&g_metrics);
+	bool showing = false;
 
-		{ vec3(-HDIM, HDIM, HDIM),		vec3(0.0f, 0.0f, 1.0f),		BLUE_COLOR },		// -x, y, z
-		{ vec3(-HDIM, -HDIM, HDIM),		vec3(0.0f, 0.0f, 1.0f),		BLUE_COLOR },		// -x, -y, z
-		{ vec3(HDIM, -HDIM, HDIM),		vec3(0.0f, 0.0f, 1.0f),		BLUE_COLOR },		// x, -y, z
+	while (!g_quit) {
 
-		// BACK, 1
+		IngestView frame;
+		const bool received = ingest.Next(IDLE_POLL_INTERVAL, &frame);
+		timer.Start();
+		if (received && frame.format == IngestFormat::RGBA) {
+			led_canvas->SetPixels(0, 0, FB_WIDTH, FB_HEIGHT, frame.data, FB_WIDTH * BYTES_PER_COMP);
+		}
+		else if (received) {
+			led_canvas->Deserialize(reinterpret_cast<const char*>(frame.data), frame.length);
+		}
+		else if (showing && !ingest.Active()) {
+			led_canvas->Clear(); // every producer is gone
+		}
+		else {
+			continue;
+		}
+		showing = received;
+		led_canvas = led_matrix->PublishFrame(led_canvas);
+		timer.Lap(FrameMetrics::CONVERT);
+		timer.Finish();
+	}
+}
+#endif
 
-		{ vec3(-HDIM, -HDIM, -HDIM),	vec3(0.0f, 0.0f, -1.0f),	BLUE_COLOR },		// -x, -y, -z
-		{ vec3(-HDIM, HDIM, -HDIM),		vec3(0.0f, 0.0f, -1.0f),	BLUE_COLOR },		// -x, y, -z
-		{ vec3(HDIM, HDIM, -HDIM),		vec3(0.0f, 0.0f, -1.0f),	BLUE_COLOR },		// x, y, -z
+// the scene is built, and the LED matrix started, on threads of their own while GL comes up
+class Startup {
+public:
+	Startup(const AppOptions& options, Scene* scene) {
+		sceneThread_ = thread([this, &options, scene]() {
+			sceneReady_ = BuildScene(options, scene);
+			LogStartup("Scene ready");
+		});
+#ifdef LINUX
+		ledThread_ = thread([this]() { ledReady_ = InitializeLEDMatrix(false); });
+#endif
+	}
 
-		// BACK, 2
+	~Startup() {
+		Join();
+	}
 
-		{ vec3(HDIM, HDIM, -HDIM),		vec3(0.0f, 0.0f, -1.0f),	BLUE_COLOR },		// x, y, -z
-		{ vec3(HDIM, -HDIM, -HDIM),		vec3(0.0f, 0.0f, -1.0f),	BLUE_COLOR },		// x, -y, -z
-		{ vec3(-HDIM, -HDIM, -HDIM),	vec3(0.0f, 0.0f, -1.0f),	BLUE_COLOR }		// -x, -y, -z
-	};
+	// wait for both, then give up root. exits if either failed.
+	void Finish() {
+		if (finished_) {
+			return;
+		}
+		finished_ = true;
+		Join();
+		if (!sceneReady_) {
+			cout << "Error loading the scene." << endl;
+			exit(-1);
+		}
+#ifdef LINUX
+		if (!ledReady_) {
+			cout << "Error initializing LED matrix." << endl;
+			exit(-1);
+		}
+		DropLEDPrivileges();
+#endif
+	}
 
-	unsigned numTriangles = 12;
-
-	glGenBuffers(1, vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, *vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * 3 * numTriangles, verts, GL_STATIC_DRAW);
-
-	glEnableVertexAttribArray(vPos);
-	glVertexAttribPointer(vPos,
-						  3,
-						  GL_FLOAT,
-						  GL_FALSE,
-						  sizeof(Vertex),
-						  0);
-
-	glEnableVertexAttribArray(vNorm);
-	glVertexAttribPointer(vNorm,
-						  3,
-						  GL_FLOAT,
-						  GL_FALSE,
-						  sizeof(Vertex),
-						  (void *)sizeof(vec3));
-
-
-	glEnableVertexAttribArray(vColor);
-	glVertexAttribPointer(vColor,
-						  3,
-						  GL_FLOAT,
-						  GL_FALSE,
-						  sizeof(Vertex),
-						  (void *)(sizeof(vec3) + sizeof(vec3)));
-
-	return 3 * numTriangles;
-}
+private:
+	void Join() {
+		if (sceneThread_.joinable()) {
+			sceneThread_.join();
+		}
+#ifdef LINUX
+		if (ledThread_.joinable()) {
+			ledThread_.join();
+		}
+#endif
+	}
 
-void GetSnapshot(unsigned char* snapshot) {
-	
-	unsigned framebufferWidth = FB_WIDTH;
-	unsigned framebufferHeight = FB_HEIGHT;
-	//unsigned char* pixelBuf = (unsigned char*)malloc(framebufferWidth * framebufferHeight * 4);
-	
-	glReadPixels(0, 0, framebufferWidth, framebufferHeight, GL_RGBA, GL_UNSIGNED_BYTE, snapshot);
-	
-	//return pixelBuf;
-}
+	thread sceneThread_;
+	bool sceneReady_ = false;
+#ifdef LINUX
+	thread ledThread_;
+	bool ledReady_ = false;
+#endif
+	bool finished_ = false;
+};
 
 int main(int argc, char* argv[]) {
 
-	GLFWwindow* window = InitializeGLFW();
+	AppOptions options = ParseAppOptions(&argc, argv);
+	bool headless = options.headless != HEADLESS::OFF;
+	bool offscreen = headless || options.supersample > 1; // render into a RenderTarget, not the window
 
-	if (window) {
-		if (InitializeGLEW()) {
-			
 #ifdef LINUX
-			if (!InitializeLEDMatrix(argc, argv)) {
-				cout << "Error initializing LED matrix." << endl;
-				exit(-1);
-			}
+	if (!ParseLEDFlags(argc, argv)) {
+		cout << "Error initializing LED matrix." << endl;
+		exit(-1);
+	}
 #endif
 
-			GLuint program;
-			if (CreateProgram("cube", &program)) {
-				glUseProgram(program);
+	signal(SIGINT, SignalHandler);
+	signal(SIGTERM, SignalHandler);
 
-				GLint vPos = glGetAttribLocation(program, "vPos");
-				GLint vNorm = glGetAttribLocation(program, "vNorm");
-				GLint vColor = glGetAttribLocation(program, "vColor");
+	MetricsExporter metricsExporter(g_metrics, options.metricsTarget, METRICS_INTERVAL);
+	if (!options.metricsTarget.empty() && !metricsExporter.Start()) {
+		cout << "Not exporting metrics." << endl;
+	}
 
-				GLuint vbo;
-				unsigned numVerts = CreatCube(vPos, vNorm, vColor, &vbo);
+#ifdef LINUX
+	if (!options.ingestName.empty()) {
+		RunIngest(options);
+		return 0;
+	}
 
-				// MODEL
-				mat4 model = mat4(1.0f);
+	SceneCache cache(options.cacheDir, SceneKey(options, argc, argv), FB_WIDTH, FB_HEIGHT);
+	if (cache.Exists()) {
+		// baked already: no GL at all
+		if (!InitializeLEDMatrix(true)) {
+			cout << "Error initializing LED matrix." << endl;
+			exit(-1);
+		}
+		cache.Play(led_matrix, g_quit);
+		return 0;
+	}
+#endif
+
+	Scene scene(vec3(WANDER_X, WANDER_Y, WANDER_Z));
+	Startup startup(options, &scene);
+
+#ifdef LINUX
+	if (options.renderer == RENDERER::CPU) {
+		startup.Finish();
+		RunSoftwareRenderer(options, &scene, &cache);
+		if (cache.Exists() && !g_quit) {
+			cache.Play(led_matrix, g_quit);
+		}
+		return 0;
+	}
+#else
+	if (options.renderer == RENDERER::CPU) {
+		cout << "--renderer=cpu only drives the LED matrix, using GL." << endl;
+	}
+	if (!options.ingestName.empty()) {
+		cout << "--ingest only drives the LED matrix, ignoring it." << endl;
+	}
+#endif
+
+	GLFWwindow* window = InitializeGLFW(options.headless, offscreen ? 0 : options.msaa);
+
+	if (window) {
+		if (InitializeGLEW(options.headless)) {
+
+			LogStartup("GL ready");
+			ProgramCache programCache(options.programCacheDir);
+			GLuint program;
+			bool programCreated = CreateProgram("scene", &programCache, &program);
+			startup.Finish();
+			programCache.Flush(); // not as root
+
+			if (programCreated) {
+				glUseProgram(program);
+
+				// MODELS
+				SceneRenderer sceneRenderer;
+				if (!sceneRenderer.Create(scene, program)) {
+					exit(-1);
+				}
 
 				// VIEW
-				vec3 view_eye = { 0, 0, CAM_DISTANCE };
-				vec3 view_center = { 0, 0, 0 };
-				vec3 view_up = { 0, 1, 0 };
-				mat4 view = lookAt(view_eye, // eye - location
-								   view_center, // center - look at
-								   view_up); // up
+				mat4 view = CubeView();
 
 				// PROJECTION
-				mat4 projection = perspectiveFov((float)radians(FOV),
-												 (float)FB_WIDTH, (float)FB_HEIGHT,
-												 1.0f, 100.0f);
+				mat4 projection = CubeProjection();
 
-				GLint modelLoc = glGetUniformLocation(program, "model");
 				GLint viewLoc = glGetUniformLocation(program, "view");
 				GLint projectionLoc = glGetUniformLocation(program, "projection");
 
@@ -500,15 +955,6 @@ int main(int argc, char* argv[]) {
 				glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, value_ptr(projection));
 
 
-				ya_rand_init(0); // normally this is done internally by xscreensaver
-				rotator* rotator = make_rotator(SPIN_SPEED,
-												SPIN_SPEED,
-												SPIN_SPEED,
-												SPIN_ACCEL,
-												WANDER_SPEED,
-												true);
-
-
 				glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 				glEnable(GL_DEPTH_TEST);
 				glDepthFunc(GL_LESS);
@@ -517,105 +963,161 @@ int main(int argc, char* argv[]) {
 
 				glfwSetKeyCallback(window, key_callback);
 
-				while (!glfwWindowShouldClose(window)) {
+				RenderTarget renderTarget;
+				if (offscreen && !renderTarget.Create(FB_WIDTH, FB_HEIGHT, options.msaa, options.supersample)) {
+					cout << "Error creating offscreen render target." << endl;
+					exit(-1);
+				}
 
-					float time = glfwGetTime();
-					static float lastFrameTime = time;
-					float deltaSeconds = time - lastFrameTime;
+#ifdef LINUX
+				SnapshotReader snapshotReader(FB_WIDTH, FB_HEIGHT, SNAPSHOT_BUFFERS);
+				// canvases rotate through PublishFrame(), FrameDiff knows what each one holds
+				FrameDiff frameDiff(FB_WIDTH, FB_HEIGHT);
+				UploadThread uploadThread(FB_WIDTH * FB_HEIGHT * BYTES_PER_COMP, UPLOAD_QUEUE_DEPTH, PanelUpload(&frameDiff));
+
+				GifRecorder recorder(FB_WIDTH, FB_HEIGHT, RECORD_FPS, RECORD_POOL_FRAMES);
+				if (!options.recordFile.empty()) {
+					recorder.Start(options.recordFile);
+				}
+
+				// bake the loop as fast as it renders, stepping the scene as if at maxFPS. nothing goes to the panel meanwhile.
+				const uint32_t bakeHoldMicros = 1e6f / options.maxFPS;
+				if (cache.Enabled()) {
+					cache.StartRecording(led_matrix, options.cacheSeconds * options.maxFPS);
+				}
+				const bool baking = cache.Recording();
+#else
+				const bool baking = false;
+#endif
 
-					if (deltaSeconds > 1.0/TARGET_FPS) {
+				Compositor compositor(FB_WIDTH, FB_HEIGHT);
+				AddModeLayers(&compositor);
+				MODE shownMode = g_mode;
+#ifdef LINUX
+				bool cubeWasVisible = compositor.Visible(ModeLayer(MODE::EMISSIVE_CUBE));
+#endif
 
-						static unsigned frameCounter = 0;
-						static float lastFPSSampleTime = time;
+				FrameScheduler scheduler(options.maxFPS);
+				FrameTimer timer(&g_metrics);
 
-						float lastFPSSampleDelta = (time - lastFPSSampleTime);
-						if (lastFPSSampleDelta > FPS_SAMPLE_RATE) {
-							//float fps = ((float)frameCounter) / lastFPSSampleDelta;
-							//cout << fps << " fps" << endl;
-							//glfwSetWindowTitle(window, string(to_string(fps) + " fps").c_str());
+				while (!glfwWindowShouldClose(window) && !g_quit) {
 
-							lastFPSSampleTime = time;
-							frameCounter = 0;
+#ifdef LINUX
+					if (baking && !cache.Recording()) {
+						break; // done, or failed writing
+					}
+#endif
+
+					// nothing moves once the cube has faded out: stop rendering and uploading until the mode changes
+					if (!baking && g_mode == shownMode && compositor.Settled() && !compositor.Visible(ModeLayer(MODE::EMISSIVE_CUBE))) {
+						glfwWaitEventsTimeout(IDLE_POLL_INTERVAL);
+						if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
+							glfwSetWindowShouldClose(window, GLFW_TRUE);
 						}
+						scheduler.Reset();
+						continue;
+					}
 
-						lastFrameTime = time;
+					timer.Start();
+					float deltaSeconds = baking ? 1.0f / options.maxFPS : scheduler.WaitForFrame();
+					timer.Lap(FrameMetrics::SWAP_WAIT);
+					float time = glfwGetTime();
 
-						glViewport(0, 0, FB_WIDTH, FB_HEIGHT);
-						glClearColor(0.0, 0.0, 0.0, 1.0);
-						glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+					static unsigned frameCounter = 0;
+					static float lastFPSSampleTime = time;
 
-						if (g_mode == MODE::EMISSIVE_CUBE) {
-							double x, y, z;
+					float lastFPSSampleDelta = (time - lastFPSSampleTime);
+					if (lastFPSSampleDelta > FPS_SAMPLE_RATE) {
+						//float fps = ((float)frameCounter) / lastFPSSampleDelta;
+						//cout << fps << " fps" << endl;
+						//glfwSetWindowTitle(window, string(to_string(fps) + " fps").c_str());
 
-							get_position(rotator, &x, &y, &z, 1);
-							x -= 0.5; y -= 0.5; z -= 0.5;
-							mat4 translate = glm::translate(mat4(1.0), { x * WANDER_X, y * WANDER_Y, z * WANDER_Z});
+						lastFPSSampleTime = time;
+						frameCounter = 0;
+					}
 
-							get_rotation(rotator, &x, &y, &z, 1);
-							mat4 rotateX = rotate(mat4(1.0), radians((float)x * 360.0f), { 1, 0, 0 });
-							mat4 rotateY = rotate(mat4(1.0), radians((float)y * 360.0f), { 0, 1, 0 });
-							mat4 rotateZ = rotate(mat4(1.0), radians((float)z * 360.0f), { 0, 0, 1 });
+					scene.Advance(deltaSeconds);
 
-							model = translate * rotateZ * rotateY * rotateX;
+					if (g_mode != shownMode) {
+						compositor.Crossfade(ModeLayer(g_mode), options.crossfadeSeconds);
+						shownMode = g_mode;
+					}
+					compositor.Advance(deltaSeconds);
+					const bool cubeVisible = compositor.Visible(ModeLayer(MODE::EMISSIVE_CUBE));
 
-							glUniformMatrix4fv(modelLoc, 1, GL_FALSE, value_ptr(model));
+					if (offscreen) {
+						renderTarget.Bind();
+						glViewport(0, 0, renderTarget.RenderWidth(), renderTarget.RenderHeight());
+					}
+					else {
+						glViewport(0, 0, FB_WIDTH, FB_HEIGHT);
+					}
+					glClearColor(0.0, 0.0, 0.0, 1.0);
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-							glDrawArrays(GL_TRIANGLES, 0, numVerts);
-						}
+					if (cubeVisible) {
+						sceneRenderer.Draw(scene);
+					}
 
-						glfwPollEvents();
+					glfwPollEvents();
 
-						if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-							glfwSetWindowShouldClose(window, GLFW_TRUE);
-						}
+					if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
+						glfwSetWindowShouldClose(window, GLFW_TRUE);
+					}
 
-						glfwSwapBuffers(window);
+					if (offscreen) {
+						renderTarget.Resolve();
+					}
 
 #ifdef LINUX
-//							typedef struct {
-//								uint8_t r;
-//								uint8_t g;
-//								uint8_t b;
-//								uint8_t a;
-//							} Pixel;
-							
-							constexpr int BYTES_PER_COMP = 4;
-							
-
-							unsigned char snapshot[FB_WIDTH * FB_HEIGHT * BYTES_PER_COMP];
-							GetSnapshot(snapshot);
-
-							
-							for (int r = 0; r<FB_HEIGHT; ++r) {
-								
-								for (int c = 0; c<FB_WIDTH; ++c) {
-
-//									// why is this shifted?
-//									int pixelIndex = (r * (FB_WIDTH * BYTES_PER_COMP)) + c * BYTES_PER_COMP;
-//									Pixel* pixel = (Pixel*)&snapshot[pixelIndex];
-//									led_canvas->SetPixel(c, r, pixel->r, pixel->b, pixel->b);
-									
-									int pixelIndex = (r * (FB_WIDTH * BYTES_PER_COMP)) + c * BYTES_PER_COMP;
-									led_canvas->SetPixel(c, r,
-														 snapshot[pixelIndex],
-														 snapshot[pixelIndex+1],
-														 snapshot[pixelIndex+2]);
-								}
-							}
+					// start reading this frame back before the swap; it's picked up next frame.
+					if (cubeVisible) {
+						if (!cubeWasVisible) {
+							snapshotReader.Reset(); // what was in flight when the cube went is stale by now
+						}
+						snapshotReader.Request();
+					}
+					cubeWasVisible = cubeVisible;
 #endif
+					timer.Lap(FrameMetrics::RENDER); // GL may still be drawing, which then shows up in the swap or readback
 
-						++frameCounter;
+					if (!headless) {
+						if (offscreen) {
+							int windowWidth, windowHeight;
+							glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
+							renderTarget.Present(windowWidth, windowHeight);
+						}
+						glfwSwapBuffers(window);
+						timer.Lap(FrameMetrics::SWAP_WAIT);
+					}
 
-						CheckError(__LINE__);
+#ifdef LINUX
+					bool read = !cubeVisible || snapshotReader.Read(compositor.Draw(ModeLayer(MODE::EMISSIVE_CUBE)));
+					timer.Lap(FrameMetrics::READBACK);
+
+					unsigned char* snapshot = uploadThread.AcquireFrame();
+					bool composed = read && compositor.Compose(snapshot);
+					timer.Lap(FrameMetrics::COMPOSE);
+					if (!composed) {
+						uploadThread.ReleaseFrame(snapshot); // ring still filling, or the same as the last frame
+					}
+					else if (baking) {
+						cache.Record(snapshot, bakeHoldMicros); // every frame; the upload thread would drop some
+						uploadThread.ReleaseFrame(snapshot);
 					}
 					else {
-						usleep(1);
+						recorder.Capture(snapshot); // just a copy, encoding is on another thread
+						uploadThread.SubmitFrame(snapshot);
 					}
+#endif
+
+					timer.Finish();
+					++frameCounter;
+
+					CheckError(__LINE__);
 				}
 
-				free_rotator(rotator);
 				glDeleteProgram(program);
-				glDeleteBuffers(1, &vbo);
 			}
 
 			glfwDestroyWindow(window);
@@ -623,5 +1125,14 @@ int main(int argc, char* argv[]) {
 
 		glfwTerminate();
 	}
+
+	startup.Finish(); // done already, unless GL didn't come up
+
+#ifdef LINUX
+	// just baked: play it like next time, without GL
+	if (cache.Exists() && led_matrix && !g_quit) {
+		cache.Play(led_matrix, g_quit);
+	}
+#endif
 }
 
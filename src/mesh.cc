@@ -0,0 +1,268 @@
+#include "mesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <sys/stat.h>
+
+using namespace std;
+
+
+constexpr uint32_t MESH_MAGIC = 0x534d4350; // "PCMS"
+constexpr uint32_t MESH_VERSION = 1;
+constexpr size_t MAX_VERTICES = 65536;
+constexpr float OBJ_DEFAULT_COLOR = 0.8; // gray, for vertices without a color
+
+struct MeshHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vertexCount;
+	uint32_t indexCount;
+};
+
+struct Vec3 {
+	float v[3];
+};
+
+static MeshVertex MakeVertex(const float* position, const float* normal, const float* color) {
+
+	MeshVertex vertex = {};
+	for (int i = 0; i < 3; ++i) {
+		vertex.position[i] = position[i];
+		vertex.normal[i] = (int8_t)lround(max(-1.0f, min(1.0f, normal[i])) * 127.0f);
+		vertex.color[i] = (uint8_t)lround(max(0.0f, min(1.0f, color[i])) * 255.0f);
+	}
+	vertex.color[3] = 255;
+	return vertex;
+}
+
+
+Mesh Mesh::Cube() {
+
+	constexpr float HDIM = 0.5;
+
+	const float BLUE_COLOR[] = { 0.0/255.0, 112.0/255.0, 175.0/255.0 };
+	const float GREEN_COLOR[] = { 29.0/255.0, 122.0/255.0, 51.0/255.0 };
+	const float PURPLE_COLOR[] = { 133.0/255.0, 95.0/255.0, 167.0/255.0 };
+
+	// per face its normal and two axes across it with u x v = normal, so the corners below are ccw
+	struct Face {
+		int normal, u, v; // axis 0..2
+		float sign;
+		const float* color;
+	};
+	const Face faces[] = {
+		{ 1, 2, 0, 1, PURPLE_COLOR },	// top
+		{ 1, 0, 2, -1, PURPLE_COLOR },	// bottom
+		{ 0, 2, 1, -1, GREEN_COLOR },	// left
+		{ 0, 1, 2, 1, GREEN_COLOR },	// right
+		{ 2, 0, 1, 1, BLUE_COLOR },		// front
+		{ 2, 1, 0, -1, BLUE_COLOR },	// back
+	};
+	const float CORNERS[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+
+	Mesh mesh;
+	for (const Face& face : faces) {
+		uint16_t first = mesh.vertices_.size();
+		for (const auto& corner : CORNERS) {
+			float position[3];
+			float normal[3] = { 0, 0, 0 };
+			position[face.normal] = face.sign * HDIM;
+			position[face.u] = corner[0] * HDIM;
+			position[face.v] = corner[1] * HDIM;
+			normal[face.normal] = face.sign;
+			mesh.vertices_.push_back(MakeVertex(position, normal, face.color));
+		}
+		for (uint16_t i : { 0, 1, 2, 2, 3, 0 }) {
+			mesh.indices_.push_back(first + i);
+		}
+	}
+	return mesh;
+}
+
+bool Mesh::LoadOBJ(const string& path) {
+
+	ifstream in(path);
+	if (!in.is_open()) {
+		cout << "Couldn't open mesh: " << path << endl;
+		return false;
+	}
+
+	vector<Vec3> positions, colors, normals;
+	vector<MeshVertex> vertices;
+	vector<uint16_t> indices;
+	map<pair<long, long>, uint16_t> known; // (position, normal) -> vertex
+
+	string line;
+	unsigned lineNumber = 0;
+	while (getline(in, line)) {
+		++lineNumber;
+		istringstream tokens(line);
+		string type;
+		tokens >> type;
+
+		if (type == "v") {
+			Vec3 p, c = { { OBJ_DEFAULT_COLOR, OBJ_DEFAULT_COLOR, OBJ_DEFAULT_COLOR } };
+			tokens >> p.v[0] >> p.v[1] >> p.v[2];
+			if (tokens >> c.v[0]) {
+				tokens >> c.v[1] >> c.v[2];
+			}
+			positions.push_back(p);
+			colors.push_back(c);
+		}
+		else if (type == "vn") {
+			Vec3 n;
+			tokens >> n.v[0] >> n.v[1] >> n.v[2];
+			normals.push_back(n);
+		}
+		else if (type == "f") {
+			// "p", "p/t", "p//n" or "p/t/n", 1 based or negative from the end
+			vector<pair<long, long>> corners;
+			string corner;
+			while (tokens >> corner) {
+				long p = 0, n = 0;
+				size_t slash = corner.find('/');
+				p = atol(corner.c_str());
+				if (slash != string::npos) {
+					size_t second = corner.find('/', slash + 1);
+					if (second != string::npos) {
+						n = atol(corner.c_str() + second + 1);
+					}
+				}
+				p = p < 0 ? (long)positions.size() + p : p - 1;
+				n = n < 0 ? (long)normals.size() + n : n - 1;
+				// n is -1 for a corner without a normal
+				if (p < 0 || p >= (long)positions.size() || n < -1 || n >= (long)normals.size()) {
+					cout << path << ":" << lineNumber << ": bad face" << endl;
+					return false;
+				}
+				corners.push_back({ p, n });
+			}
+			if (corners.size() < 3) {
+				continue;
+			}
+
+			bool flat = false;
+			for (const auto& c : corners) {
+				flat |= c.second < 0;
+			}
+			if (flat) {
+				// the face's own normal for the corners that have none
+				const float* a = positions[corners[0].first].v;
+				const float* b = positions[corners[1].first].v;
+				const float* c = positions[corners[2].first].v;
+				float u[3], v[3];
+				for (int i = 0; i < 3; ++i) {
+					u[i] = b[i] - a[i];
+					v[i] = c[i] - a[i];
+				}
+				Vec3 n = { { u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0] } };
+				float length = sqrt(n.v[0] * n.v[0] + n.v[1] * n.v[1] + n.v[2] * n.v[2]);
+				for (float& x : n.v) {
+					x = length > 0 ? x / length : 0;
+				}
+				normals.push_back(n);
+				for (auto& c : corners) {
+					if (c.second < 0) {
+						c.second = normals.size() - 1;
+					}
+				}
+			}
+
+			vector<uint16_t> face;
+			for (const auto& c : corners) {
+				auto found = known.find(c);
+				if (found == known.end()) {
+					if (vertices.size() >= MAX_VERTICES) {
+						cout << path << ": more than " << MAX_VERTICES << " vertices" << endl;
+						return false;
+					}
+					found = known.insert({ c, (uint16_t)vertices.size() }).first;
+					vertices.push_back(MakeVertex(positions[c.first].v, normals[c.second].v, colors[c.first].v));
+				}
+				face.push_back(found->second);
+			}
+			for (size_t i = 1; i + 1 < face.size(); ++i) {
+				indices.insert(indices.end(), { face[0], face[i], face[i + 1] });
+			}
+		}
+	}
+
+	if (indices.empty()) {
+		cout << path << ": no faces" << endl;
+		return false;
+	}
+
+	vertices_.swap(vertices);
+	indices_.swap(indices);
+	return true;
+}
+
+bool Mesh::LoadBinary(const string& path) {
+
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file) {
+		return false;
+	}
+
+	MeshHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1
+		&& header.magic == MESH_MAGIC && header.version == MESH_VERSION
+		&& header.vertexCount <= MAX_VERTICES && header.indexCount % 3 == 0;
+	vector<MeshVertex> vertices;
+	vector<uint16_t> indices;
+	if (ok) {
+		vertices.resize(header.vertexCount);
+		indices.resize(header.indexCount);
+		ok = fread(vertices.data(), sizeof(MeshVertex), vertices.size(), file) == vertices.size()
+			&& fread(indices.data(), sizeof(uint16_t), indices.size(), file) == indices.size();
+	}
+	fclose(file);
+
+	ok = ok && all_of(indices.begin(), indices.end(), [&vertices](uint16_t i) { return i < vertices.size(); });
+	if (ok) {
+		vertices_.swap(vertices);
+		indices_.swap(indices);
+	}
+	return ok;
+}
+
+bool Mesh::SaveBinary(const string& path) const {
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+
+	MeshHeader header = { MESH_MAGIC, MESH_VERSION, (uint32_t)vertices_.size(), (uint32_t)indices_.size() };
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(vertices_.data(), sizeof(MeshVertex), vertices_.size(), file) == vertices_.size()
+		&& fwrite(indices_.data(), sizeof(uint16_t), indices_.size(), file) == indices_.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		remove(path.c_str()); // don't leave half a cache behind
+	}
+	return ok;
+}
+
+bool Mesh::Load(const string& path) {
+
+	string binaryPath = path + ".mesh";
+	struct stat source, binary;
+	if (stat(path.c_str(), &source) == 0 && stat(binaryPath.c_str(), &binary) == 0
+		&& binary.st_mtime >= source.st_mtime && LoadBinary(binaryPath)) {
+		return true;
+	}
+
+	if (!LoadOBJ(path)) {
+		return false;
+	}
+	if (!SaveBinary(binaryPath)) {
+		cout << "Couldn't cache mesh to " << binaryPath << endl;
+	}
+	return true;
+}
@@ -0,0 +1,314 @@
+#include "metrics.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+constexpr unsigned FIRST_EXPORTED_OCTAVE = 3;	// le = 8us
+constexpr unsigned LAST_EXPORTED_OCTAVE = 25;	// le = 33.5s
+constexpr int SOCKET_POLL_MS = 100;				// how soon the socket thread notices Stop()
+constexpr double QUANTILES[] = { 0.5, 0.9, 0.99, 1.0 };
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS: a client hanging up early raises SIGPIPE
+#endif
+
+
+static unsigned BucketOf(uint32_t micros) {
+
+	if (micros < Histogram::SUB_BUCKETS) {
+		return micros;
+	}
+	unsigned octave = 31 - __builtin_clz(micros); // >= 2
+	unsigned sub = (micros >> (octave - 2)) & (Histogram::SUB_BUCKETS - 1);
+	return Histogram::SUB_BUCKETS * (octave - 1) + sub;
+}
+
+uint64_t Histogram::LowerBound(unsigned bucket) {
+
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+	unsigned octave = bucket / SUB_BUCKETS + 1;
+	return uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << (octave - 2);
+}
+
+Histogram::Histogram()
+	: sum_(0) {
+	for (auto& bucket : buckets_) {
+		bucket.store(0, memory_order_relaxed);
+	}
+}
+
+void Histogram::Record(uint32_t micros) {
+	buckets_[BucketOf(micros)].fetch_add(1, memory_order_relaxed);
+	sum_.fetch_add(micros, memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::Read() const {
+
+	Snapshot snapshot;
+	for (unsigned i = 0; i < BUCKETS; ++i) {
+		snapshot.buckets[i] = buckets_[i].load(memory_order_relaxed);
+	}
+	snapshot.sum = sum_.load(memory_order_relaxed);
+	return snapshot;
+}
+
+uint64_t Histogram::Snapshot::Count() const {
+
+	uint64_t count = 0;
+	for (uint64_t n : buckets) {
+		count += n;
+	}
+	return count;
+}
+
+double Histogram::Snapshot::Quantile(double q) const {
+
+	const uint64_t count = Count();
+	if (!count) {
+		return 0;
+	}
+
+	const double rank = q * count;
+	uint64_t below = 0;
+	for (unsigned i = 0; i < BUCKETS; ++i) {
+		if (buckets[i] && below + buckets[i] >= rank) {
+			double lower = LowerBound(i);
+			double upper = LowerBound(i + 1);
+			return lower + (upper - lower) * (rank - below) / buckets[i];
+		}
+		below += buckets[i];
+	}
+	return LowerBound(BUCKETS);
+}
+
+Histogram::Snapshot Histogram::Snapshot::Since(const Snapshot& earlier) const {
+
+	Snapshot delta;
+	for (unsigned i = 0; i < BUCKETS; ++i) {
+		delta.buckets[i] = buckets[i] - earlier.buckets[i];
+	}
+	delta.sum = sum - earlier.sum;
+	return delta;
+}
+
+
+const char* FrameMetrics::Name(Stage stage) {
+
+	switch (stage) {
+	case RENDER: return "render";
+	case READBACK: return "readback";
+	case COMPOSE: return "compose";
+	case CONVERT: return "convert";
+	case SWAP_WAIT: return "swap_wait";
+	case REFRESH: return "refresh";
+	default: return "unknown";
+	}
+}
+
+
+FrameTimer::FrameTimer(FrameMetrics* metrics)
+	: metrics_(metrics) {
+	Start();
+}
+
+void FrameTimer::Start() {
+	last_ = Clock::now();
+	for (unsigned stage = 0; stage < FrameMetrics::STAGES; ++stage) {
+		totals_[stage] = Clock::duration::zero();
+		lapped_[stage] = false;
+	}
+}
+
+void FrameTimer::Lap(FrameMetrics::Stage stage) {
+	Clock::time_point now = Clock::now();
+	totals_[stage] += now - last_;
+	lapped_[stage] = true;
+	last_ = now;
+}
+
+void FrameTimer::Finish() {
+	for (unsigned stage = 0; stage < FrameMetrics::STAGES; ++stage) {
+		if (lapped_[stage]) {
+			(*metrics_)[FrameMetrics::Stage(stage)].Record(chrono::duration_cast<chrono::microseconds>(totals_[stage]).count());
+		}
+	}
+}
+
+
+MetricsExporter::MetricsExporter(const FrameMetrics& metrics, const string& target, float interval)
+	: metrics_(metrics),
+	  target_(target),
+	  interval_(int(interval * 1000)),
+	  previous_(FrameMetrics::STAGES),
+	  listenFD_(-1),
+	  running_(false) {
+
+	for (unsigned stage = 0; stage < FrameMetrics::STAGES; ++stage) {
+		previous_[stage] = metrics_[FrameMetrics::Stage(stage)].Read();
+	}
+}
+
+MetricsExporter::~MetricsExporter() {
+	Stop();
+}
+
+bool MetricsExporter::Start() {
+
+	if (target_.compare(0, 5, "unix:") == 0) {
+
+		string path = target_.substr(5);
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+			cout << "Invalid metrics socket path: " << path << endl;
+			return false;
+		}
+		strcpy(address.sun_path, path.c_str());
+
+		listenFD_ = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(path.c_str()); // left over from a previous run
+		if (listenFD_ < 0 || bind(listenFD_, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenFD_, 4) != 0) {
+			cout << "Couldn't listen for metrics on " << path << ": " << strerror(errno) << endl;
+			if (listenFD_ >= 0) {
+				close(listenFD_);
+				listenFD_ = -1;
+			}
+			return false;
+		}
+	}
+
+	running_ = true;
+	thread_ = thread(&MetricsExporter::Run, this);
+	return true;
+}
+
+void MetricsExporter::Stop() {
+
+	if (!thread_.joinable()) {
+		return;
+	}
+
+	running_ = false;
+	thread_.join();
+
+	if (listenFD_ >= 0) {
+		close(listenFD_);
+		unlink(target_.c_str() + 5);
+		listenFD_ = -1;
+	}
+	else {
+		WriteFile();
+	}
+}
+
+string MetricsExporter::Export() {
+
+	ostringstream text;
+	text.precision(9); // enough for the bucket bounds in seconds
+
+	text << "# HELP picube_stage_seconds Time per frame spent in each stage.\n"
+		 << "# TYPE picube_stage_seconds histogram\n";
+	vector<Histogram::Snapshot> current(FrameMetrics::STAGES);
+	for (unsigned stage = 0; stage < FrameMetrics::STAGES; ++stage) {
+
+		const Histogram::Snapshot& snapshot = current[stage] = metrics_[FrameMetrics::Stage(stage)].Read();
+		const char* name = FrameMetrics::Name(FrameMetrics::Stage(stage));
+
+		// cumulative counts at each power of two
+		uint64_t cumulative = 0;
+		unsigned bucket = 0;
+		for (unsigned octave = FIRST_EXPORTED_OCTAVE; octave <= LAST_EXPORTED_OCTAVE; ++octave) {
+			const unsigned end = Histogram::SUB_BUCKETS * (octave - 1); // first bucket >= 2^octave
+			for (; bucket < end; ++bucket) {
+				cumulative += snapshot.buckets[bucket];
+			}
+			text << "picube_stage_seconds_bucket{stage=\"" << name << "\",le=\"" << (1u << octave) * 1e-6 << "\"} " << cumulative << "\n";
+		}
+		text << "picube_stage_seconds_bucket{stage=\"" << name << "\",le=\"+Inf\"} " << snapshot.Count() << "\n"
+			 << "picube_stage_seconds_sum{stage=\"" << name << "\"} " << snapshot.sum * 1e-6 << "\n"
+			 << "picube_stage_seconds_count{stage=\"" << name << "\"} " << snapshot.Count() << "\n";
+	}
+
+	text << "# HELP picube_stage_recent_seconds Quantiles of the stage times since the previous export.\n"
+		 << "# TYPE picube_stage_recent_seconds gauge\n";
+	for (unsigned stage = 0; stage < FrameMetrics::STAGES; ++stage) {
+
+		Histogram::Snapshot recent = current[stage].Since(previous_[stage]);
+		const char* name = FrameMetrics::Name(FrameMetrics::Stage(stage));
+		for (double q : QUANTILES) {
+			text << "picube_stage_recent_seconds{stage=\"" << name << "\",quantile=\"" << q << "\"} " << recent.Quantile(q) * 1e-6 << "\n";
+		}
+		previous_[stage] = current[stage];
+	}
+
+	return text.str();
+}
+
+void MetricsExporter::Run() {
+
+	auto nextWrite = chrono::steady_clock::now() + interval_;
+
+	while (running_) {
+
+		if (listenFD_ >= 0) {
+			pollfd listening = { listenFD_, POLLIN, 0 };
+			if (poll(&listening, 1, SOCKET_POLL_MS) > 0) {
+				ServeSocket();
+			}
+			continue;
+		}
+
+		// short sleeps so Stop() doesn't wait for a whole interval
+		this_thread::sleep_for(min(interval_, chrono::milliseconds(SOCKET_POLL_MS)));
+		if (chrono::steady_clock::now() >= nextWrite) {
+			WriteFile();
+			nextWrite += interval_;
+		}
+	}
+}
+
+void MetricsExporter::WriteFile() {
+
+	// written aside and renamed, so readers never see half a file
+	string temporary = target_ + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "w");
+	if (!file) {
+		return;
+	}
+	string text = Export();
+	bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok || rename(temporary.c_str(), target_.c_str()) != 0) {
+		remove(temporary.c_str());
+	}
+}
+
+void MetricsExporter::ServeSocket() {
+
+	int client = accept(listenFD_, nullptr, nullptr);
+	if (client < 0) {
+		return;
+	}
+	string text = Export();
+	for (size_t written = 0; written < text.size();) {
+		ssize_t n = send(client, text.data() + written, text.size() - written, MSG_NOSIGNAL);
+		if (n <= 0) {
+			break;
+		}
+		written += n;
+	}
+	close(client);
+}
@@ -0,0 +1,168 @@
+#include "program-cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+
+constexpr uint32_t PROGRAM_MAGIC = 0x50524f47; // "GORP"
+
+// in front of the binary in each file
+struct ProgramHeader {
+	uint32_t magic;
+	uint32_t format;	// GLenum from glGetProgramBinary()
+	uint32_t length;
+};
+
+
+// FNV-1a, 64 bit
+static uint64_t HashKey(const string& key) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char c : key) {
+		hash = (hash ^ c) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static string GLString(GLenum name) {
+	const GLubyte* value = glGetString(name);
+	return value ? reinterpret_cast<const char*>(value) : "";
+}
+
+
+ProgramCache::ProgramCache(const string& dir)
+	: dir_(dir) {
+
+	if (dir_.empty()) {
+		return;
+	}
+
+	GLint formats = 0;
+	if (GLEW_ARB_get_program_binary) {
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	}
+	if (formats <= 0) {
+		cout << "The GL driver doesn't provide program binaries, compiling shaders on every start." << endl;
+		dir_.clear();
+		return;
+	}
+
+	driver_ = GLString(GL_VENDOR) + "\n" + GLString(GL_RENDERER) + "\n" + GLString(GL_VERSION);
+}
+
+string ProgramCache::DefaultDir() {
+
+	const char* cacheHome = getenv("XDG_CACHE_HOME");
+	if (cacheHome && *cacheHome) {
+		return string(cacheHome) + "/picube";
+	}
+	const char* home = getenv("HOME");
+	return home && *home ? string(home) + "/.cache/picube" : "";
+}
+
+string ProgramCache::EntryPath(const string& vertexSource, const string& fragmentSource) const {
+
+	ostringstream path;
+	path << dir_ << "/program-" << hex << setw(16) << setfill('0')
+		 << HashKey(driver_ + "\n" + vertexSource + "\n" + fragmentSource) << ".bin";
+	return path.str();
+}
+
+GLuint ProgramCache::Load(const string& vertexSource, const string& fragmentSource) {
+
+	if (!Enabled()) {
+		return 0;
+	}
+
+	FILE* file = fopen(EntryPath(vertexSource, fragmentSource).c_str(), "rb");
+	if (!file) {
+		return 0;
+	}
+	ProgramHeader header;
+	vector<char> binary;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == PROGRAM_MAGIC;
+	if (ok) {
+		binary.resize(header.length);
+		ok = fread(binary.data(), 1, binary.size(), file) == binary.size();
+	}
+	fclose(file);
+	if (!ok) {
+		return 0;
+	}
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header.format, binary.data(), binary.size());
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (linked != GL_TRUE) {
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+void ProgramCache::PrepareForSave(GLuint program) {
+	if (Enabled()) {
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+}
+
+void ProgramCache::Save(const string& vertexSource, const string& fragmentSource, GLuint program) {
+
+	if (!Enabled()) {
+		return;
+	}
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) {
+		return;
+	}
+	Entry entry;
+	entry.path = EntryPath(vertexSource, fragmentSource);
+	entry.format = 0;
+	entry.binary.resize(length);
+	glGetProgramBinary(program, length, &length, &entry.format, entry.binary.data());
+	entry.binary.resize(length);
+	unsaved_.push_back(move(entry));
+}
+
+void ProgramCache::Flush() {
+
+	if (unsaved_.empty()) {
+		return;
+	}
+
+	// ~/.cache may not be there yet either
+	size_t slash = dir_.rfind('/');
+	if (slash != string::npos && slash > 0) {
+		mkdir(dir_.substr(0, slash).c_str(), 0755);
+	}
+	mkdir(dir_.c_str(), 0755); // fine if it's there already
+
+	for (const Entry& entry : unsaved_) {
+		ProgramHeader header = { PROGRAM_MAGIC, entry.format, uint32_t(entry.binary.size()) };
+
+		// written aside and renamed, so a start never sees half a file
+		string temporary = entry.path + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (!file) {
+			cout << "Couldn't write " << temporary << ", compiling shaders again next start." << endl;
+			continue;
+		}
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+			&& fwrite(entry.binary.data(), 1, entry.binary.size(), file) == entry.binary.size();
+		ok = fclose(file) == 0 && ok;
+		if (!ok || rename(temporary.c_str(), entry.path.c_str()) != 0) {
+			remove(temporary.c_str());
+		}
+	}
+	unsaved_.clear();
+}
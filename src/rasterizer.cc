@@ -0,0 +1,296 @@
+#include "rasterizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RASTERIZER_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RASTERIZER_SSE2
+#endif
+
+
+constexpr unsigned MAX_CLIP_VERTICES = 5; // a triangle clipped by the near and far planes
+
+// standard MSAA sample positions, in 1/16 pixel from the center
+static const int SAMPLES_1[] = { 0, 0 };
+static const int SAMPLES_4[] = { -2, -6, 6, -2, -6, 2, 2, 6 };
+static const int SAMPLES_8[] = { 1, -3, -1, 3, 5, 1, -3, -5, -5, 5, -7, -1, 3, 7, 7, -7 };
+static const int SAMPLES_16[] = { 1, 1, -1, -3, -3, 2, 4, -1, -5, -2, 2, 5, 5, 3, 3, -5,
+								  -2, 6, 0, -7, -4, -6, -6, 4, -8, 0, 7, -4, 6, 7, -7, -8 };
+
+static unsigned SupportedSamples(unsigned samples) {
+	return samples <= 1 ? 1 : samples <= 4 ? 4 : samples <= 8 ? 8 : 16;
+}
+
+static inline uint32_t PackColor(const glm::vec3& color) {
+	auto channel = [](float c) { return (uint32_t)(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f); };
+	return channel(color.x) | channel(color.y) << 8 | channel(color.z) << 16 | 0xffu << 24;
+}
+
+
+// a triangle in window coordinates, as plane equations a * x + b * y + c
+struct Setup {
+	float edge[3][3]; // positive inside; edge i is opposite of vertex i
+	float depth[3];
+};
+
+static inline float Plane(const float* p, float x, float y) {
+	return p[0] * x + p[1] * y + p[2];
+}
+
+// bit i is set if sample i of the four at (x + offsetX[i], y + offsetY[i]) is
+// inside the triangle and nearer than depth[i]. their depths go to z.
+static inline unsigned Cover4(float x, float y, const float* offsetX, const float* offsetY,
+							  const Setup& s, const float* depth, float* z) {
+#if defined(RASTERIZER_NEON)
+	static const uint32_t bits[4] = { 1, 2, 4, 8 };
+	float32x4_t vx = vaddq_f32(vdupq_n_f32(x), vld1q_f32(offsetX));
+	float32x4_t vy = vaddq_f32(vdupq_n_f32(y), vld1q_f32(offsetY));
+	uint32x4_t covered = vdupq_n_u32(~0u);
+	for (int i = 0; i < 3; ++i) {
+		float32x4_t e = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(s.edge[i][2]), vx, s.edge[i][0]), vy, s.edge[i][1]);
+		covered = vandq_u32(covered, vcgeq_f32(e, vdupq_n_f32(0.0f)));
+	}
+	float32x4_t vz = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(s.depth[2]), vx, s.depth[0]), vy, s.depth[1]);
+	vst1q_f32(z, vz);
+	covered = vandq_u32(covered, vcltq_f32(vz, vld1q_f32(depth)));
+	uint32x4_t masked = vandq_u32(covered, vld1q_u32(bits));
+	uint32x2_t sum = vpadd_u32(vget_low_u32(masked), vget_high_u32(masked));
+	return vget_lane_u32(vpadd_u32(sum, sum), 0);
+#elif defined(RASTERIZER_SSE2)
+	__m128 vx = _mm_add_ps(_mm_set1_ps(x), _mm_loadu_ps(offsetX));
+	__m128 vy = _mm_add_ps(_mm_set1_ps(y), _mm_loadu_ps(offsetY));
+	__m128 covered = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	for (int i = 0; i < 3; ++i) {
+		__m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, _mm_set1_ps(s.edge[i][0])),
+										 _mm_mul_ps(vy, _mm_set1_ps(s.edge[i][1]))),
+							  _mm_set1_ps(s.edge[i][2]));
+		covered = _mm_and_ps(covered, _mm_cmpge_ps(e, _mm_setzero_ps()));
+	}
+	__m128 vz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, _mm_set1_ps(s.depth[0])),
+									  _mm_mul_ps(vy, _mm_set1_ps(s.depth[1]))),
+						   _mm_set1_ps(s.depth[2]));
+	_mm_storeu_ps(z, vz);
+	covered = _mm_and_ps(covered, _mm_cmplt_ps(vz, _mm_loadu_ps(depth)));
+	return _mm_movemask_ps(covered);
+#else
+	unsigned mask = 0;
+	for (int i = 0; i < 4; ++i) {
+		float sx = x + offsetX[i];
+		float sy = y + offsetY[i];
+		z[i] = Plane(s.depth, sx, sy);
+		if (Plane(s.edge[0], sx, sy) >= 0 && Plane(s.edge[1], sx, sy) >= 0 && Plane(s.edge[2], sx, sy) >= 0
+			&& z[i] < depth[i]) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+#endif
+}
+
+
+Rasterizer::Rasterizer(unsigned width, unsigned height, unsigned samples)
+	: width_(width),
+	  height_(height),
+	  samples_(SupportedSamples(samples)),
+	  groups_((samples_ + 3) / 4),
+	  sampleX_(groups_ * 4, 0.0f),
+	  sampleY_(groups_ * 4, 0.0f),
+	  color_(width * height * groups_ * 4),
+	  depth_(width * height * groups_ * 4) {
+
+	const int* positions = samples_ == 1 ? SAMPLES_1 : samples_ == 4 ? SAMPLES_4 : samples_ == 8 ? SAMPLES_8 : SAMPLES_16;
+	for (unsigned i = 0; i < samples_; ++i) {
+		sampleX_[i] = positions[2 * i] / 16.0f;
+		sampleY_[i] = positions[2 * i + 1] / 16.0f;
+	}
+
+	Clear(glm::vec3(0.0f));
+}
+
+void Rasterizer::Clear(const glm::vec3& color) {
+	std::fill(color_.begin(), color_.end(), PackColor(color));
+	std::fill(depth_.begin(), depth_.end(), 1.0f);
+}
+
+void Rasterizer::DrawMesh(const Mesh& mesh, const glm::mat4& mvp) {
+
+	const std::vector<MeshVertex>& vertices = mesh.Vertices();
+	const std::vector<uint16_t>& indices = mesh.Indices();
+
+	transformed_.resize(vertices.size());
+	for (size_t i = 0; i < vertices.size(); ++i) {
+		const MeshVertex& v = vertices[i];
+		transformed_[i].position = mvp * glm::vec4(v.position[0], v.position[1], v.position[2], 1.0f);
+		transformed_[i].color = glm::vec3(v.color[0], v.color[1], v.color[2]) * (1.0f / 255.0f);
+	}
+
+	for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+		ClipVertex triangle[3] = { transformed_[indices[i]], transformed_[indices[i + 1]], transformed_[indices[i + 2]] };
+		DrawClipped(triangle, 3);
+	}
+}
+
+// clip against the near and far planes like GL does, then draw as a fan.
+// left, right, top and bottom just limit the pixels that are visited.
+void Rasterizer::DrawClipped(const ClipVertex* v, unsigned count) {
+
+	ClipVertex buffers[2][MAX_CLIP_VERTICES];
+	const ClipVertex* in = v;
+
+	for (int plane = 0; plane < 2; ++plane) {
+		// distance to the plane: z + w >= 0 (near), w - z >= 0 (far)
+		auto distance = [plane](const ClipVertex& c) {
+			return plane == 0 ? c.position.z + c.position.w : c.position.w - c.position.z;
+		};
+
+		ClipVertex* out = buffers[plane];
+		unsigned outCount = 0;
+		for (unsigned i = 0; i < count; ++i) {
+			const ClipVertex& a = in[i];
+			const ClipVertex& b = in[(i + 1) % count];
+			float da = distance(a);
+			float db = distance(b);
+			if (da >= 0) {
+				out[outCount++] = a;
+			}
+			if ((da >= 0) != (db >= 0) && outCount < MAX_CLIP_VERTICES) {
+				float t = da / (da - db);
+				out[outCount].position = a.position + (b.position - a.position) * t;
+				out[outCount].color = a.color + (b.color - a.color) * t;
+				++outCount;
+			}
+		}
+		in = out;
+		count = outCount;
+	}
+
+	for (unsigned i = 1; i + 1 < count; ++i) {
+		DrawTriangle(in[0], in[i], in[i + 1]);
+	}
+}
+
+void Rasterizer::DrawTriangle(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c) {
+
+	// window coordinates
+	const ClipVertex* v[3] = { &a, &b, &c };
+	float x[3], y[3], z[3], invW[3];
+	for (int i = 0; i < 3; ++i) {
+		const glm::vec4& p = v[i]->position;
+		invW[i] = 1.0f / p.w;
+		x[i] = (p.x * invW[i] + 1.0f) * 0.5f * width_;
+		y[i] = (p.y * invW[i] + 1.0f) * 0.5f * height_;
+		z[i] = p.z * invW[i] * 0.5f + 0.5f;
+	}
+
+	float area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+	if (area == 0 || std::isnan(area)) {
+		return;
+	}
+
+	// edge i runs between the other two vertices, oriented so inside is positive for either winding
+	Setup s;
+	for (int i = 0; i < 3; ++i) {
+		int j = (i + 1) % 3;
+		int k = (i + 2) % 3;
+		float ea = (y[j] - y[k]) / area;
+		float eb = (x[k] - x[j]) / area;
+		s.edge[i][0] = ea;
+		s.edge[i][1] = eb;
+		s.edge[i][2] = -(ea * x[j] + eb * y[j]);
+	}
+	// half a pixel along each edge's gradient: a pixel whose center is further out is missed by all its samples
+	float reach[3];
+	for (int i = 0; i < 3; ++i) {
+		reach[i] = -0.5f * (std::fabs(s.edge[i][0]) + std::fabs(s.edge[i][1]));
+	}
+	// the normalized edge functions are the barycentric coordinates; depth is linear in them
+	for (int i = 0; i < 3; ++i) {
+		s.depth[i] = s.edge[0][i] * z[0] + s.edge[1][i] * z[1] + s.edge[2][i] * z[2];
+	}
+
+	int minX = std::max(0, (int)std::floor(std::min({ x[0], x[1], x[2] })));
+	int maxX = std::min((int)width_ - 1, (int)std::ceil(std::max({ x[0], x[1], x[2] })));
+	int minY = std::max(0, (int)std::floor(std::min({ y[0], y[1], y[2] })));
+	int maxY = std::min((int)height_ - 1, (int)std::ceil(std::max({ y[0], y[1], y[2] })));
+
+	const unsigned validLast = samples_ % 4 ? (1u << samples_ % 4) - 1 : 0xf;
+	const unsigned stride = groups_ * 4;
+
+	for (int py = minY; py <= maxY; ++py) {
+		for (int px = minX; px <= maxX; ++px) {
+
+			float cx = px + 0.5f;
+			float cy = py + 0.5f;
+			if (Plane(s.edge[0], cx, cy) < reach[0] || Plane(s.edge[1], cx, cy) < reach[1]
+				|| Plane(s.edge[2], cx, cy) < reach[2]) {
+				continue;
+			}
+
+			const size_t pixel = ((size_t)py * width_ + px) * stride;
+			float* depth = depth_.data() + pixel;
+			uint32_t* color = color_.data() + pixel;
+
+			bool shaded = false;
+			uint32_t packed = 0;
+
+			for (unsigned g = 0; g < groups_; ++g) {
+				float sampleZ[4];
+				unsigned mask = Cover4(cx, cy, &sampleX_[g * 4], &sampleY_[g * 4], s, depth + g * 4, sampleZ);
+				if (g == groups_ - 1) {
+					mask &= validLast;
+				}
+				if (!mask) {
+					continue;
+				}
+
+				if (!shaded) {
+					// once per pixel, at its center, perspective correct
+					float w[3];
+					for (int i = 0; i < 3; ++i) {
+						w[i] = Plane(s.edge[i], cx, cy) * invW[i];
+					}
+					float sum = w[0] + w[1] + w[2];
+					glm::vec3 shade = (a.color * w[0] + b.color * w[1] + c.color * w[2]) / sum;
+					packed = PackColor(shade);
+					shaded = true;
+				}
+
+				for (unsigned i = 0; i < 4; ++i) {
+					if (mask & (1u << i)) {
+						depth[g * 4 + i] = sampleZ[i];
+						color[g * 4 + i] = packed;
+					}
+				}
+			}
+		}
+	}
+}
+
+void Rasterizer::Resolve(unsigned char* rgba) const {
+
+	const unsigned stride = groups_ * 4;
+
+	for (size_t pixel = 0; pixel < (size_t)width_ * height_; ++pixel) {
+		const uint32_t* samples = color_.data() + pixel * stride;
+		if (std::all_of(samples + 1, samples + samples_, [samples](uint32_t c) { return c == samples[0]; })) {
+			// not on an edge, which is most of them
+			for (unsigned c = 0; c < 4; ++c) {
+				rgba[pixel * 4 + c] = (samples[0] >> (8 * c)) & 0xff;
+			}
+			continue;
+		}
+		unsigned sum[4] = { 0, 0, 0, 0 };
+		for (unsigned i = 0; i < samples_; ++i) {
+			for (unsigned c = 0; c < 4; ++c) {
+				sum[c] += (samples[i] >> (8 * c)) & 0xff;
+			}
+		}
+		for (unsigned c = 0; c < 4; ++c) {
+			rgba[pixel * 4 + c] = (sum[c] + samples_ / 2) / samples_;
+		}
+	}
+}
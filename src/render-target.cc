@@ -0,0 +1,166 @@
+#include "render-target.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+
+static bool CheckFramebufferComplete(const char* name) {
+
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		cout << "Incomplete " << name << " framebuffer: " << status << endl;
+		return false;
+	}
+	return true;
+}
+
+RenderTarget::RenderTarget()
+	: width_(0),
+	  height_(0),
+	  samples_(0),
+	  supersample_(1),
+	  drawFBO_(0),
+	  colorRB_(0),
+	  depthRB_(0) {
+}
+
+RenderTarget::~RenderTarget() {
+	Destroy();
+}
+
+bool RenderTarget::Create(unsigned width, unsigned height, unsigned samples, unsigned supersample) {
+
+	Destroy();
+
+	if (!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object) {
+		cout << "Framebuffer objects not supported." << endl;
+		return false;
+	}
+
+	width_ = width;
+	height_ = height;
+
+	GLint maxSamples = 0;
+	glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+	samples_ = min<unsigned>(samples, max(maxSamples, 0));
+	if (samples_ < 2) {
+		samples_ = 0;
+	}
+
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxSize);
+	supersample_ = 1;
+	while (supersample_ * 2 <= supersample && width_ * supersample_ * 2 <= (unsigned)maxSize
+		   && height_ * supersample_ * 2 <= (unsigned)maxSize) {
+		supersample_ *= 2;
+	}
+
+	glGenRenderbuffers(1, &colorRB_);
+	glGenRenderbuffers(1, &depthRB_);
+
+	// the FBO we draw into, multisampled or not
+	glGenFramebuffers(1, &drawFBO_);
+	glBindFramebuffer(GL_FRAMEBUFFER, drawFBO_);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, colorRB_);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples_, GL_RGBA8, RenderWidth(), RenderHeight());
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorRB_);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, depthRB_);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples_, GL_DEPTH_COMPONENT24, RenderWidth(), RenderHeight());
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRB_);
+
+	if (!CheckFramebufferComplete("draw")) {
+		Destroy();
+		return false;
+	}
+
+	// single sampled FBO to resolve into, then one per halving down to the output size
+	bool ok = !samples_ || AddStage(RenderWidth(), RenderHeight());
+	for (unsigned factor = supersample_ / 2; ok && factor >= 1; factor /= 2) {
+		ok = AddStage(width_ * factor, height_ * factor);
+	}
+	if (!ok) {
+		Destroy();
+		return false;
+	}
+
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	cout << "Render target " << width_ << "x" << height_ << ", " << samples_ << " samples";
+	if (supersample_ > 1) {
+		cout << ", supersampled from " << RenderWidth() << "x" << RenderHeight();
+	}
+	cout << "." << endl;
+
+	return true;
+}
+
+bool RenderTarget::AddStage(unsigned width, unsigned height) {
+
+	Stage stage = { 0, 0, width, height };
+	glGenFramebuffers(1, &stage.fbo);
+	glGenRenderbuffers(1, &stage.colorRB);
+	stages_.push_back(stage); // Destroy() cleans up after a failure
+
+	glBindFramebuffer(GL_FRAMEBUFFER, stage.fbo);
+	glBindRenderbuffer(GL_RENDERBUFFER, stage.colorRB);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, stage.colorRB);
+
+	return CheckFramebufferComplete(stages_.size() == 1 && samples_ ? "resolve" : "downsample");
+}
+
+void RenderTarget::Bind() {
+	glBindFramebuffer(GL_FRAMEBUFFER, drawFBO_);
+}
+
+void RenderTarget::Resolve() {
+
+	GLuint source = drawFBO_;
+	unsigned sourceWidth = RenderWidth();
+	unsigned sourceHeight = RenderHeight();
+
+	for (const Stage& stage : stages_) {
+		// a halving samples between the 2x2 source pixels, so linear filtering averages them
+		GLenum filter = stage.width == sourceWidth ? GL_NEAREST : GL_LINEAR;
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, source);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, stage.fbo);
+		glBlitFramebuffer(0, 0, sourceWidth, sourceHeight, 0, 0, stage.width, stage.height, GL_COLOR_BUFFER_BIT, filter);
+
+		source = stage.fbo;
+		sourceWidth = stage.width;
+		sourceHeight = stage.height;
+	}
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, OutputFBO());
+}
+
+void RenderTarget::Present(unsigned windowWidth, unsigned windowHeight) {
+
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, width_, height_, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+void RenderTarget::Destroy() {
+
+	for (const Stage& stage : stages_) {
+		glDeleteFramebuffers(1, &stage.fbo);
+		glDeleteRenderbuffers(1, &stage.colorRB);
+	}
+	stages_.clear();
+	if (drawFBO_) {
+		glDeleteFramebuffers(1, &drawFBO_);
+	}
+	if (colorRB_) {
+		glDeleteRenderbuffers(1, &colorRB_);
+	}
+	if (depthRB_) {
+		glDeleteRenderbuffers(1, &depthRB_);
+	}
+
+	drawFBO_ = colorRB_ = depthRB_ = 0;
+}
@@ -0,0 +1,159 @@
+#ifdef LINUX
+
+#include "scene-cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "content-streamer.h"
+#include "led-matrix.h"
+
+#include "frame-scheduler.h"
+
+using namespace std;
+using rgb_matrix::FileStreamIO;
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::StreamReader;
+using rgb_matrix::StreamWriter;
+
+
+// FNV-1a, 64 bit
+static uint64_t HashKey(const string& key) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char c : key) {
+		hash = (hash ^ c) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static string CachePath(const string& dir, const string& key) {
+	if (dir.empty()) {
+		return "";
+	}
+	ostringstream path;
+	path << dir << "/scene-" << hex << setw(16) << setfill('0') << HashKey(key) << ".stream";
+	return path.str();
+}
+
+
+SceneCache::SceneCache(const string& dir, const string& key, unsigned width, unsigned height)
+	: dir_(dir),
+	  path_(CachePath(dir, key)),
+	  width_(width),
+	  height_(height),
+	  canvas_(nullptr),
+	  framesLeft_(0) {
+}
+
+SceneCache::~SceneCache() {
+}
+
+bool SceneCache::Exists() const {
+	return Enabled() && access(path_.c_str(), R_OK) == 0;
+}
+
+bool SceneCache::StartRecording(RGBMatrix* matrix, unsigned frames) {
+
+	if (!Enabled() || Recording() || frames == 0) {
+		return false;
+	}
+
+	mkdir(dir_.c_str(), 0755); // fine if it's there already
+
+	string tempPath = path_ + ".tmp";
+	int fd = open(tempPath.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0) {
+		cout << "Error creating " << tempPath << endl;
+		return false;
+	}
+
+	io_.reset(new FileStreamIO(fd));
+	writer_.reset(new StreamWriter(io_.get(), true));
+	if (!canvas_) {
+		canvas_ = matrix->CreateFrameCanvas();
+	}
+	framesLeft_ = frames;
+
+	cout << "Baking " << frames << " frames to " << path_ << endl;
+	return true;
+}
+
+void SceneCache::Record(const unsigned char* rgba, uint32_t holdMicros) {
+
+	if (!Recording()) {
+		return;
+	}
+
+	canvas_->SetPixels(0, 0, width_, height_, rgba, width_ * 4);
+	if (!writer_->Stream(*canvas_, holdMicros)) {
+		cout << "Error writing " << path_ << ".tmp" << endl;
+		writer_.reset();
+		io_.reset();
+		return;
+	}
+
+	if (--framesLeft_ == 0) {
+		FinishRecording();
+	}
+}
+
+void SceneCache::FinishRecording() {
+
+	bool finished = writer_->Finish();
+	writer_.reset();
+	io_.reset(); // closes the file
+
+	string tempPath = path_ + ".tmp";
+	if (!finished || rename(tempPath.c_str(), path_.c_str()) != 0) {
+		cout << "Error finishing " << path_ << endl;
+		return;
+	}
+	cout << "Baked " << path_ << endl;
+}
+
+bool SceneCache::Play(RGBMatrix* matrix, const volatile sig_atomic_t& quit) {
+
+	int fd = open(path_.c_str(), O_RDONLY);
+	if (fd < 0) {
+		cout << "Error opening " << path_ << endl;
+		return false;
+	}
+
+	FileStreamIO io(fd);
+	StreamReader reader(&io);
+	if (reader.FrameCount() == 0) {
+		cout << "No frames in " << path_ << endl;
+		return false;
+	}
+
+	cout << "Playing " << reader.FrameCount() << " baked frames from " << path_ << endl;
+
+	FrameCanvas* canvas = matrix->CreateFrameCanvas();
+	FrameScheduler scheduler(1);
+	uint32_t holdMicros = 0;
+
+	while (!quit) {
+		if (!reader.GetNext(canvas, &holdMicros)) {
+			reader.Rewind();
+			if (!reader.GetNext(canvas, &holdMicros)) {
+				return false; // doesn't fit this panel
+			}
+		}
+
+		// the previous frame is up until this one's deadline
+		scheduler.SetMaxFPS(1e6f / max(holdMicros, 1u));
+		scheduler.WaitForFrame();
+		canvas = matrix->PublishFrame(canvas);
+	}
+
+	return true;
+}
+
+#endif // LINUX
@@ -0,0 +1,125 @@
+#include "scene-renderer.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+
+#include <glm/gtc/type_ptr.hpp>
+
+using namespace std;
+
+
+constexpr unsigned MAX_BATCH = 16; // size of "models" in shaders/scene.vert
+constexpr unsigned MAX_BATCH_VERTICES = 65536; // 16 bit indices
+
+// a mesh vertex and which copy in the batch it belongs to
+struct BatchVertex {
+	MeshVertex vertex;
+	GLfloat copy;
+};
+
+
+SceneRenderer::SceneRenderer()
+	: vPos_(-1),
+	  vNorm_(-1),
+	  vColor_(-1),
+	  vCopy_(-1),
+	  modelsLoc_(-1) {
+}
+
+SceneRenderer::~SceneRenderer() {
+	Destroy();
+}
+
+bool SceneRenderer::Create(const Scene& scene, GLuint program) {
+
+	Destroy();
+
+	vPos_ = glGetAttribLocation(program, "vPos");
+	vNorm_ = glGetAttribLocation(program, "vNorm");
+	vColor_ = glGetAttribLocation(program, "vColor");
+	vCopy_ = glGetAttribLocation(program, "vCopy");
+	modelsLoc_ = glGetUniformLocation(program, "models");
+	if (vPos_ < 0 || vColor_ < 0 || vCopy_ < 0 || modelsLoc_ < 0) {
+		cout << "Scene program lacks vPos, vColor, vCopy or models." << endl;
+		return false;
+	}
+
+	for (const Mesh& mesh : scene.Meshes()) {
+
+		const vector<MeshVertex>& vertices = mesh.Vertices();
+		const vector<uint16_t>& indices = mesh.Indices();
+
+		Batch batch;
+		batch.copies = max<size_t>(1, min<size_t>(MAX_BATCH, MAX_BATCH_VERTICES / max<size_t>(1, vertices.size())));
+		batch.indexCount = indices.size();
+
+		vector<BatchVertex> batchVertices;
+		vector<uint16_t> batchIndices;
+		batchVertices.reserve(vertices.size() * batch.copies);
+		batchIndices.reserve(indices.size() * batch.copies);
+		for (unsigned copy = 0; copy < batch.copies; ++copy) {
+			uint16_t first = batchVertices.size();
+			for (const MeshVertex& v : vertices) {
+				batchVertices.push_back({ v, (GLfloat)copy });
+			}
+			for (uint16_t i : indices) {
+				batchIndices.push_back(first + i);
+			}
+		}
+
+		glGenBuffers(1, &batch.vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, batch.vbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(BatchVertex) * batchVertices.size(), batchVertices.data(), GL_STATIC_DRAW);
+
+		glGenBuffers(1, &batch.ibo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t) * batchIndices.size(), batchIndices.data(), GL_STATIC_DRAW);
+
+		batches_.push_back(batch);
+	}
+
+	return true;
+}
+
+void SceneRenderer::Draw(const Scene& scene) {
+
+	for (unsigned mesh = 0; mesh < batches_.size(); ++mesh) {
+
+		scene.Models(mesh, &models_);
+		if (models_.empty()) {
+			continue;
+		}
+
+		const Batch& batch = batches_[mesh];
+		glBindBuffer(GL_ARRAY_BUFFER, batch.vbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.ibo);
+
+		// no VAOs in GL 2.1: point the attributes at this mesh's buffer
+		const GLsizei stride = sizeof(BatchVertex);
+		glEnableVertexAttribArray(vPos_);
+		glVertexAttribPointer(vPos_, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(MeshVertex, position));
+		if (vNorm_ >= 0) {
+			glEnableVertexAttribArray(vNorm_);
+			glVertexAttribPointer(vNorm_, 3, GL_BYTE, GL_TRUE, stride, (void*)offsetof(MeshVertex, normal));
+		}
+		glEnableVertexAttribArray(vColor_);
+		glVertexAttribPointer(vColor_, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void*)offsetof(MeshVertex, color));
+		glEnableVertexAttribArray(vCopy_);
+		glVertexAttribPointer(vCopy_, 1, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(BatchVertex, copy));
+
+		for (size_t first = 0; first < models_.size(); first += batch.copies) {
+			GLsizei count = min<size_t>(batch.copies, models_.size() - first);
+			glUniformMatrix4fv(modelsLoc_, count, GL_FALSE, glm::value_ptr(models_[first]));
+			glDrawElements(GL_TRIANGLES, batch.indexCount * count, GL_UNSIGNED_SHORT, 0);
+		}
+	}
+}
+
+void SceneRenderer::Destroy() {
+	for (Batch& batch : batches_) {
+		glDeleteBuffers(1, &batch.vbo);
+		glDeleteBuffers(1, &batch.ibo);
+	}
+	batches_.clear();
+}
@@ -0,0 +1,56 @@
+#include "scene.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+using namespace glm;
+
+
+Scene::Scene(const vec3& wander)
+	: wander_(wander) {
+}
+
+Scene::~Scene() {
+	for (Object& object : objects_) {
+		free_rotator(object.motion);
+	}
+}
+
+unsigned Scene::AddMesh(const Mesh& mesh) {
+	meshes_.push_back(mesh);
+	return meshes_.size() - 1;
+}
+
+void Scene::AddObject(unsigned mesh, rotator* motion, float scale) {
+	objects_.push_back({ mesh, motion, scale });
+}
+
+void Scene::Advance(double seconds) {
+	for (Object& object : objects_) {
+		advance_rotator(object.motion, seconds);
+	}
+}
+
+mat4 Scene::Model(const Object& object) const {
+
+	double x, y, z;
+
+	get_position_interpolated(object.motion, &x, &y, &z);
+	x -= 0.5; y -= 0.5; z -= 0.5;
+	mat4 translate = glm::translate(mat4(1.0), { x * wander_.x, y * wander_.y, z * wander_.z });
+
+	get_rotation_interpolated(object.motion, &x, &y, &z);
+	mat4 rotateX = rotate(mat4(1.0), radians((float)x * 360.0f), { 1, 0, 0 });
+	mat4 rotateY = rotate(mat4(1.0), radians((float)y * 360.0f), { 0, 1, 0 });
+	mat4 rotateZ = rotate(mat4(1.0), radians((float)z * 360.0f), { 0, 0, 1 });
+
+	return translate * rotateZ * rotateY * rotateX * scale(mat4(1.0), vec3(object.scale));
+}
+
+void Scene::Models(unsigned mesh, std::vector<mat4>* models) const {
+	models->clear();
+	for (const Object& object : objects_) {
+		if (object.mesh == mesh) {
+			models->push_back(Model(object));
+		}
+	}
+}
@@ -0,0 +1,89 @@
+#include "snapshot-reader.h"
+
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+
+constexpr unsigned BYTES_PER_PIXEL = 4;
+
+SnapshotReader::SnapshotReader(unsigned width, unsigned height, unsigned numBuffers)
+	: width_(width),
+	  height_(height),
+	  numBuffers_(numBuffers < 1 ? 1 : numBuffers),
+	  usePBO_(GLEW_VERSION_2_1 || GLEW_ARB_pixel_buffer_object),
+	  head_(0),
+	  pending_(0) {
+
+	if (!usePBO_) {
+		cout << "Pixel buffer objects not supported, reading snapshots synchronously." << endl;
+		return;
+	}
+
+	pbos_.resize(numBuffers_);
+	glGenBuffers(numBuffers_, pbos_.data());
+	for (GLuint pbo : pbos_) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, width_ * height_ * BYTES_PER_PIXEL, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+SnapshotReader::~SnapshotReader() {
+	if (usePBO_) {
+		glDeleteBuffers(numBuffers_, pbos_.data());
+	}
+}
+
+void SnapshotReader::Request() {
+
+	if (!usePBO_) {
+		pending_ = 1;
+		return;
+	}
+
+	if (pending_ == numBuffers_) {
+		// ring is full and nobody read the oldest: overwrite it.
+		--pending_;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos_[head_]);
+	glReadPixels(0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	head_ = (head_ + 1) % numBuffers_;
+	++pending_;
+}
+
+void SnapshotReader::Reset() {
+	pending_ = 0;
+}
+
+bool SnapshotReader::Read(unsigned char* snapshot) {
+
+	if (!usePBO_) {
+		if (!pending_) {
+			return false;
+		}
+		glReadPixels(0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, snapshot);
+		pending_ = 0;
+		return true;
+	}
+
+	if (pending_ < numBuffers_) {
+		return false;
+	}
+
+	unsigned oldest = (head_ + numBuffers_ - pending_) % numBuffers_;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos_[oldest]);
+	const void* pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (pixels) {
+		memcpy(snapshot, pixels, width_ * height_ * BYTES_PER_PIXEL);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	--pending_;
+	return pixels != nullptr;
+}
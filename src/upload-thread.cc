@@ -0,0 +1,60 @@
+#include "upload-thread.h"
+
+
+UploadThread::UploadThread(size_t frameSize, unsigned queueDepth, Upload upload)
+	: upload_(upload),
+	  frames_(queueDepth + 1, std::vector<unsigned char>(frameSize)), // +1 for the one being uploaded
+	  free_(queueDepth + 1),
+	  ready_(queueDepth) {
+
+	for (auto &frame : frames_) {
+		free_.TryPush(frame.data());
+	}
+
+	thread_ = std::thread(&UploadThread::Run, this);
+}
+
+UploadThread::~UploadThread() {
+	Stop();
+}
+
+unsigned char* UploadThread::AcquireFrame() {
+
+	unsigned char* frame = nullptr;
+	if (free_.TryPop(&frame)) {
+		return frame;
+	}
+
+	// the upload stage is behind: drop the stalest queued frame instead of waiting.
+	// one of the two queues always has a frame since only one is ever being uploaded.
+	while (!ready_.TryPop(&frame) && !free_.TryPop(&frame)) {
+		std::this_thread::yield();
+	}
+	return frame;
+}
+
+void UploadThread::SubmitFrame(unsigned char* frame) {
+	if (!ready_.TryPush(frame)) {
+		free_.TryPush(frame); // stopped
+	}
+}
+
+void UploadThread::ReleaseFrame(unsigned char* frame) {
+	free_.TryPush(frame);
+}
+
+void UploadThread::Stop() {
+	if (thread_.joinable()) {
+		ready_.Close();
+		thread_.join();
+	}
+}
+
+void UploadThread::Run() {
+
+	unsigned char* frame;
+	while (ready_.Pop(&frame)) {
+		upload_(frame);
+		free_.TryPush(frame);
+	}
+}